@@ -3,6 +3,9 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := cpustats.c
 
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libprocfile/include
+LOCAL_STATIC_LIBRARIES := libprocfile
+
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
 LOCAL_MODULE_TAGS := debug
 LOCAL_MODULE := cpustats
@@ -29,45 +29,141 @@
  * SUCH DAMAGE.
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_BUF_SIZE 64
+#include <linux/perf_event.h>
+
+#include <procfile/procfile.h>
+
+#include "cpustats_record.h"
+
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+#define SYS_NODE_DIR "/sys/devices/system/node"
+#define MAX_SAMPLE_HZ 1000
+#define NS_PER_SEC 1000000000ULL
 
 struct freq_info {
     unsigned freq;
     long unsigned time;
 };
 
+// Counters read with -p. Either the hardware ones or, where the PMU can't
+// provide them, the software ones.
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFS,
+    PERF_CACHE_MISSES,
+    PERF_EVENT_COUNT
+};
+
+enum {
+    PERF_SW_CPU_CLOCK,
+    PERF_SW_CONTEXT_SWITCHES,
+    PERF_SW_MIGRATIONS,
+    PERF_SW_PAGE_FAULTS
+};
+
 struct cpu_info {
     long unsigned utime, ntime, stime, itime, iowtime, irqtime, sirqtime;
     struct freq_info *freqs;
     int freq_count;
+    // Whether the cpu was in the last /proc/stat. Offline cpus keep their
+    // last times, so they show no change until they come back.
+    char online;
+    // Running totals, scaled up for the time the group wasn't counting.
+    uint64_t perf[PERF_EVENT_COUNT];
 };
 
 #define die(...) { fprintf(stderr, __VA_ARGS__); exit(EXIT_FAILURE); }
 
 static struct cpu_info old_total_cpu, new_total_cpu, *old_cpus, *new_cpus;
+// Kept open across samples so each update only has to reread them.
+static procfile_t stat_file, *freq_files;
 static int cpu_count, delay, iterations;
 static char minimal, aggregate_freq_stats;
 
-static int get_cpu_count();
-static int get_cpu_count_from_file(char *filename);
+// The present cpus, which need not be numbered contiguously. Everything per
+// cpu is indexed by position in cpu_ids; cpu_index maps a cpu id back to its
+// position, or -1.
+static int *cpu_ids, *cpu_index, max_cpu_id;
+// Cpus of the same cpufreq policy share its time_in_state, so it is only
+// read through the first of them, its owner. -1 for cpus without one.
+static int *freq_owner;
+// The first cpu with frequency stats, whose frequencies the total uses.
+static int freq_reference = -1;
+
+// Cpus are shown in groups: one per cpu, or with -g one per cluster, node
+// or package, whose times are the sums of their members'.
+struct cpu_group {
+    char label[32];  // "package" or "cluster" and an int, as set in make_groups()
+    int *members;
+    int member_count;
+};
+
+static char *group_by;
+static struct cpu_group *groups;
+static struct cpu_info *old_groups, *new_groups;
+static int group_count, top_count;
+
+// High frequency sampling: every sample's deltas go in a ring of fixed size
+// records laid out as described in cpustats_record.h, which is drained
+// once per window of delay seconds, either to the output file or as a
+// summary.
+static int sample_hz;
+static char *output_file;
+static uint32_t *ring;
+static size_t ring_size, ring_head, ring_count, record_words, total_freq_count;
+// Where the frequency residencies of each cpu start within a record.
+static size_t *freq_offsets;
+static unsigned long dropped_samples, missed_ticks;
+
+// One group of PERF_EVENT_COUNT counters per cpu, the first one of each
+// group being its leader.
+static char perf_mode, perf_software;
+static int *perf_fds;
+
+static void get_cpus();
+static int read_cpu_list(const char *filename, int **ids);
 static long unsigned get_cpu_total_time(struct cpu_info *cpu);
+static long unsigned get_cpu_busy_time(struct cpu_info *cpu);
 static int get_freq_scales_count(int cpu);
+static void open_freq_stats();
+static void make_groups();
+static void sum_groups();
+static int select_groups(int *order, double *busy);
 static void print_stats();
 static void print_cpu_stats(char *label, struct cpu_info *new_cpu, struct cpu_info *old_cpu,
         char print_freq);
 static void print_freq_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu);
 static void read_stats();
+static void swap_stats();
+static void sample_loop();
+static void record_sample(uint64_t timestamp_ns);
+static void write_header(int fd);
+static void flush_samples(int fd);
+static void print_window();
 static void read_freq_stats(int cpu);
+static void open_perf_counters();
+static void read_perf_counters(int cpu);
+static void close_perf_counters();
+static void print_perf_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu);
 static char should_aggregate_freq_stats();
 static char should_print_freq_stats();
 static void usage(char *cmd);
 
 int main(int argc, char *argv[]) {
-    struct cpu_info *tmp_cpus, tmp_total_cpu;
     int i, freq_count;
 
     delay = 3;
@@ -94,36 +190,116 @@ int main(int argc, char *argv[]) {
             delay = atoi(argv[++i]);
             continue;
         }
+        if (!strcmp(argv[i], "-f")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option -f expects an argument.\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            sample_hz = atoi(argv[++i]);
+            if (sample_hz <= 0 || sample_hz > MAX_SAMPLE_HZ) {
+                fprintf(stderr, "Option -f expects a rate between 1 and %d Hz.\n",
+                        MAX_SAMPLE_HZ);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "-o")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option -o expects an argument.\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            output_file = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-g")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option -g expects an argument.\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            group_by = argv[++i];
+            if (strcmp(group_by, "cluster") && strcmp(group_by, "node") &&
+                    strcmp(group_by, "package")) {
+                fprintf(stderr, "Option -g expects cluster, node or package.\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "-t")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option -t expects an argument.\n");
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            top_count = atoi(argv[++i]);
+            continue;
+        }
         if (!strcmp(argv[i], "-m")) {
             minimal = 1;
         }
+        if (!strcmp(argv[i], "-p")) {
+            perf_mode = 1;
+        }
         if (!strcmp(argv[i], "-h")) {
             usage(argv[0]);
             exit(EXIT_SUCCESS);
         }
     }
 
-    cpu_count = get_cpu_count();
+    if (output_file && !sample_hz) {
+        fprintf(stderr, "Option -o requires -f.\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (perf_mode && sample_hz) {
+        fprintf(stderr, "Option -p can not be used with -f.\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (delay <= 0) delay = 1;
+    if (top_count < 0) top_count = 0;
 
-    old_cpus = malloc(sizeof(struct cpu_info) * cpu_count);
+    get_cpus();
+
+    // Zeroed, so cpus that are offline from the start show no time.
+    old_cpus = calloc(cpu_count, sizeof(struct cpu_info));
     if (!old_cpus) die("Could not allocate struct cpu_info\n");
-    new_cpus = malloc(sizeof(struct cpu_info) * cpu_count);
+    new_cpus = calloc(cpu_count, sizeof(struct cpu_info));
     if (!new_cpus) die("Could not allocate struct cpu_info\n");
+    freq_files = malloc(sizeof(procfile_t) * cpu_count);
+    if (!freq_files) die("Could not allocate freq files\n");
+    freq_owner = malloc(sizeof(int) * cpu_count);
+    if (!freq_owner) die("Could not allocate freq owners\n");
+
+    procfile_init(&stat_file);
+    if (procfile_open(&stat_file, "/proc/stat")) die("Could not open /proc/stat.\n");
 
+    open_freq_stats();
     for (i = 0; i < cpu_count; i++) {
         old_cpus[i].freq_count = new_cpus[i].freq_count = get_freq_scales_count(i);
+        if (!new_cpus[i].freq_count) continue;
         new_cpus[i].freqs = malloc(sizeof(struct freq_info) * new_cpus[i].freq_count);
         if (!new_cpus[i].freqs) die("Could not allocate struct freq_info\n");
         old_cpus[i].freqs = malloc(sizeof(struct freq_info) * old_cpus[i].freq_count);
         if (!old_cpus[i].freqs) die("Could not allocate struct freq_info\n");
     }
 
+    make_groups();
+
+    if (perf_mode) {
+        open_perf_counters();
+    }
+
     // Read stats without aggregating freq stats in the total cpu
     read_stats();
 
     aggregate_freq_stats = should_aggregate_freq_stats();
     if (aggregate_freq_stats) {
-        old_total_cpu.freq_count = new_total_cpu.freq_count = new_cpus[0].freq_count;
+        freq_count = new_cpus[freq_reference].freq_count;
+        old_total_cpu.freq_count = new_total_cpu.freq_count = freq_count;
         new_total_cpu.freqs = malloc(sizeof(struct freq_info) * new_total_cpu.freq_count);
         if (!new_total_cpu.freqs) die("Could not allocate struct freq_info\n");
         old_total_cpu.freqs = malloc(sizeof(struct freq_info) * old_total_cpu.freq_count);
@@ -133,19 +309,15 @@ int main(int argc, char *argv[]) {
         read_stats();
     }
 
-    while ((iterations == -1) || (iterations-- > 0)) {
-        // Swap new and old cpu buffers;
-        tmp_total_cpu = old_total_cpu;
-        old_total_cpu = new_total_cpu;
-        new_total_cpu = tmp_total_cpu;
-
-        tmp_cpus = old_cpus;
-        old_cpus = new_cpus;
-        new_cpus = tmp_cpus;
-
-        sleep(delay);
-        read_stats();
-        print_stats();
+    if (sample_hz) {
+        sample_loop();
+    } else {
+        while ((iterations == -1) || (iterations-- > 0)) {
+            swap_stats();
+            sleep(delay);
+            read_stats();
+            print_stats();
+        }
     }
 
     // Clean up
@@ -156,126 +328,964 @@ int main(int argc, char *argv[]) {
     for (i = 0; i < cpu_count; i++) {
         free(new_cpus[i].freqs);
         free(old_cpus[i].freqs);
+        procfile_destroy(&freq_files[i]);
+    }
+    free(freq_files);
+    free(freq_owner);
+    if (perf_mode) {
+        close_perf_counters();
     }
+    for (i = 0; i < group_count; i++) {
+        free(groups[i].members);
+        if (group_by) {
+            free(new_groups[i].freqs);
+            free(old_groups[i].freqs);
+        }
+    }
+    free(groups);
+    free(new_groups);
+    free(old_groups);
     free(new_cpus);
     free(old_cpus);
+    free(cpu_ids);
+    free(cpu_index);
+    procfile_destroy(&stat_file);
 
     return 0;
 }
 
 /*
- * Get the number of CPUs of the system.
- *
- * Uses the two files /sys/devices/system/cpu/present and
- * /sys/devices/system/cpu/online to determine the number of CPUs. Expects the
- * format of both files to be either 0 or 0-N where N+1 is the number of CPUs.
+ * Get the present CPUs of the system from /sys/devices/system/cpu/present.
  *
- * Exits if the present CPUs is not equal to the online CPUs
+ * Present CPUs may be offline, and come and go while running; those are
+ * handled by read_stats().
  */
-static int get_cpu_count() {
-    int cpu_count = get_cpu_count_from_file("/sys/devices/system/cpu/present");
-    if (cpu_count != get_cpu_count_from_file("/sys/devices/system/cpu/online")) {
-        die("present cpus != online cpus\n");
+static void get_cpus() {
+    int i;
+
+    cpu_count = read_cpu_list(SYS_CPU_DIR "/present", &cpu_ids);
+    if (cpu_count <= 0) die("Could not get the present cpus from " SYS_CPU_DIR "/present\n");
+
+    max_cpu_id = cpu_ids[cpu_count - 1];
+    cpu_index = malloc(sizeof(int) * (max_cpu_id + 1));
+    if (!cpu_index) die("Could not allocate cpu index\n");
+    for (i = 0; i <= max_cpu_id; i++) {
+        cpu_index[i] = -1;
+    }
+    for (i = 0; i < cpu_count; i++) {
+        cpu_index[cpu_ids[i]] = i;
     }
-    return cpu_count;
 }
 
 /*
- * Get the number of CPUs from a given filename.
+ * Read a list of CPUs in the kernel's format, such as 0-3,8,10-11, into a
+ * newly allocated array of ids. Returns the number of CPUs, or -1 if the
+ * file can't be read or isn't in that format.
  */
-static int get_cpu_count_from_file(char *filename) {
-    FILE *file;
-    char line[MAX_BUF_SIZE];
-    int cpu_count;
-
-    file = fopen(filename, "r");
-    if (!file) die("Could not open %s\n", filename);
-    if (!fgets(line, MAX_BUF_SIZE, file)) die("Could not get %s contents\n", filename);
-    fclose(file);
+static int read_cpu_list(const char *filename, int **ids) {
+    procfile_t file;
+    const char *p;
+    uint64_t first, last;
+    int *list = NULL, *tmp;
+    int count = 0, size = 0;
 
-    if (strcmp(line, "0\n") == 0) {
-        return 1;
+    procfile_init(&file);
+    if (procfile_open(&file, filename) || procfile_read(&file) < 0) {
+        procfile_destroy(&file);
+        return -1;
     }
 
-    if (1 == sscanf(line, "0-%d\n", &cpu_count)) {
-        return cpu_count + 1;
+    p = file.buf;
+    while (*p != '\n' && *p != '\0') {
+        p = procfile_parse_u64(p, &first);
+        if (!p) goto bad;
+        last = first;
+        if (*p == '-' && !(p = procfile_parse_u64(p + 1, &last))) goto bad;
+        if (last < first || last >= INT_MAX) goto bad;
+        for (; first <= last; first++) {
+            if (count == size) {
+                size = size ? size * 2 : 16;
+                tmp = realloc(list, sizeof(int) * size);
+                if (!tmp) die("Could not allocate cpu list\n");
+                list = tmp;
+            }
+            // The kernel lists cpus in increasing order.
+            if (count && (int)first <= list[count - 1]) goto bad;
+            list[count++] = first;
+        }
+        if (*p == ',') p++;
     }
 
-    die("Unexpected input in file %s (%s).\n", filename, line);
+    procfile_destroy(&file);
+    *ids = list;
+    return count;
+
+bad:
+    fprintf(stderr, "Unexpected input in file %s (%s).\n", filename, file.buf);
+    procfile_destroy(&file);
+    free(list);
     return -1;
 }
 
 /*
- * Get the number of frequency states a given CPU can be scaled to.
+ * Read a single number from a sysfs file, or return fallback if there is
+ * no such file.
+ */
+static int read_sys_int(const char *filename, int fallback) {
+    procfile_t file;
+    uint64_t value;
+    int result = fallback;
+
+    procfile_init(&file);
+    if (!procfile_open(&file, filename) && procfile_read(&file) > 0 &&
+            procfile_parse_u64(file.buf, &value)) {
+        result = value;
+    }
+    procfile_destroy(&file);
+
+    return result;
+}
+
+/*
+ * Get the number of frequency states a given CPU can be scaled to, 0 if
+ * it has no frequency stats.
  */
 static int get_freq_scales_count(int cpu) {
-    FILE *file;
-    char filename[MAX_BUF_SIZE];
-    long unsigned freq;
+    const char *p;
+    uint64_t freq;
     int count = 0;
 
-    sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/stats/time_in_state", cpu);
-    file = fopen(filename, "r");
-    if (!file) die("Could not open %s\n", filename);
-    do {
-        freq = 0;
-        fscanf(file, "%lu %*d\n", &freq);
-        if (freq) count++;
-    } while(freq);
-    fclose(file);
+    if (freq_owner[cpu] < 0) return 0;
+    if (freq_owner[cpu] != cpu) return new_cpus[freq_owner[cpu]].freq_count;
+
+    if (procfile_read(&freq_files[cpu]) < 0) die("Could not read time_in_state of cpu%d\n",
+            cpu_ids[cpu]);
+    for (p = freq_files[cpu].buf; p; p = procfile_next_line(p)) {
+        if (!procfile_parse_u64(p, &freq) || !freq) break;
+        count++;
+    }
 
     return count;
 }
 
+/*
+ * Open the frequency stats files. The cpufreq directory of every cpu in a
+ * policy links to the same policy directory, so it is enough to open the
+ * time_in_state of the first cpu of each policy: with many cpus per
+ * cluster that saves most of the reads of each update.
+ *
+ * Cpus without frequency stats, because of the kernel configuration or
+ * because they are offline, just don't show any.
+ */
+static void open_freq_stats() {
+    char path[PATH_MAX], filename[PATH_MAX];
+    char **policies;
+    int i, j;
+
+    policies = calloc(cpu_count, sizeof(char *));
+    if (!policies) die("Could not allocate cpufreq policies\n");
+
+    for (i = 0; i < cpu_count; i++) {
+        procfile_init(&freq_files[i]);
+        freq_owner[i] = -1;
+
+        snprintf(path, sizeof(path), SYS_CPU_DIR "/cpu%d/cpufreq", cpu_ids[i]);
+        policies[i] = realpath(path, NULL);
+        if (!policies[i]) continue;
+
+        for (j = 0; j < i; j++) {
+            if (policies[j] && !strcmp(policies[i], policies[j])) {
+                freq_owner[i] = freq_owner[j];
+                break;
+            }
+        }
+        if (j < i) continue;
+
+        snprintf(filename, sizeof(filename), "%s/stats/time_in_state", policies[i]);
+        if (!procfile_open(&freq_files[i], filename)) freq_owner[i] = i;
+    }
+
+    for (i = 0; i < cpu_count; i++) {
+        free(policies[i]);
+    }
+    free(policies);
+}
+
 /*
  * Read the CPU and frequency stats for all cpus.
  */
 static void read_stats() {
-    FILE *file;
-    char scanline[MAX_BUF_SIZE];
+    const char *p;
+    uint64_t values[7], cpu;
+    struct cpu_info *info;
     int i;
 
-    file = fopen("/proc/stat", "r");
-    if (!file) die("Could not open /proc/stat.\n");
-    fscanf(file, "cpu  %lu %lu %lu %lu %lu %lu %lu %*d %*d %*d\n",
-           &new_total_cpu.utime, &new_total_cpu.ntime, &new_total_cpu.stime, &new_total_cpu.itime,
-           &new_total_cpu.iowtime, &new_total_cpu.irqtime, &new_total_cpu.sirqtime);
+    if (procfile_read(&stat_file) < 0) die("Could not read /proc/stat.\n");
     if (aggregate_freq_stats) {
         for (i = 0; i < new_total_cpu.freq_count; i++) {
             new_total_cpu.freqs[i].time = 0;
         }
     }
+    for (i = 0; i < cpu_count; i++) {
+        new_cpus[i].online = 0;
+    }
+
+    // The cpu lines come first: the total, then one per online cpu.
+    for (p = stat_file.buf; p && !strncmp(p, "cpu", 3); p = procfile_next_line(p)) {
+        if (p[3] == ' ') {
+            info = &new_total_cpu;
+            p += 3;
+        } else {
+            p = procfile_parse_u64(p + 3, &cpu);
+            if (!p || cpu > (uint64_t)max_cpu_id || cpu_index[cpu] < 0) continue;
+            info = &new_cpus[cpu_index[cpu]];
+        }
+        if (!procfile_parse_u64s(p, values, 7)) die("Unexpected input in /proc/stat.\n");
+        info->utime = values[0];
+        info->ntime = values[1];
+        info->stime = values[2];
+        info->itime = values[3];
+        info->iowtime = values[4];
+        info->irqtime = values[5];
+        info->sirqtime = values[6];
+        info->online = 1;
+    }
 
     for (i = 0; i < cpu_count; i++) {
-        sprintf(scanline, "cpu%d %%lu %%lu %%lu %%lu %%lu %%lu %%lu %%*d %%*d %%*d\n", i);
-        fscanf(file, scanline, &new_cpus[i].utime, &new_cpus[i].ntime, &new_cpus[i].stime,
-               &new_cpus[i].itime, &new_cpus[i].iowtime, &new_cpus[i].irqtime,
-               &new_cpus[i].sirqtime);
+        if (!new_cpus[i].online) {
+            // Offline, carry the last times over.
+            new_cpus[i].utime = old_cpus[i].utime;
+            new_cpus[i].ntime = old_cpus[i].ntime;
+            new_cpus[i].stime = old_cpus[i].stime;
+            new_cpus[i].itime = old_cpus[i].itime;
+            new_cpus[i].iowtime = old_cpus[i].iowtime;
+            new_cpus[i].irqtime = old_cpus[i].irqtime;
+            new_cpus[i].sirqtime = old_cpus[i].sirqtime;
+        } else if (!old_cpus[i].online) {
+            // Just came online, its times count from here.
+            old_cpus[i].utime = new_cpus[i].utime;
+            old_cpus[i].ntime = new_cpus[i].ntime;
+            old_cpus[i].stime = new_cpus[i].stime;
+            old_cpus[i].itime = new_cpus[i].itime;
+            old_cpus[i].iowtime = new_cpus[i].iowtime;
+            old_cpus[i].irqtime = new_cpus[i].irqtime;
+            old_cpus[i].sirqtime = new_cpus[i].sirqtime;
+        }
         read_freq_stats(i);
     }
-    fclose(file);
+
+    if (perf_mode) {
+        memset(new_total_cpu.perf, 0, sizeof(new_total_cpu.perf));
+        for (i = 0; i < cpu_count; i++) {
+            read_perf_counters(i);
+        }
+    }
+
+    if (group_by) {
+        sum_groups();
+    }
 }
 
 /*
- * Read the frequency stats for a given cpu.
+ * Read the frequency stats for a given cpu. Cpus sharing a policy take
+ * them from its owner, which comes first and has been read already.
  */
 static void read_freq_stats(int cpu) {
-    FILE *file;
-    char filename[MAX_BUF_SIZE];
-    int i;
+    const char *p;
+    uint64_t freq, time;
+    int i, owner = freq_owner[cpu];
+
+    if (owner < 0) return;
+
+    if (owner == cpu) {
+        if (procfile_read(&freq_files[cpu]) < 0) die("Could not read time_in_state of cpu%d\n",
+                cpu_ids[cpu]);
+        p = freq_files[cpu].buf;
+        for (i = 0; i < new_cpus[cpu].freq_count && p; i++) {
+            const char *q = procfile_parse_u64(p, &freq);
+            if (!q || !procfile_parse_u64(q, &time)) break;
+            new_cpus[cpu].freqs[i].freq = freq;
+            new_cpus[cpu].freqs[i].time = time;
+            p = procfile_next_line(p);
+        }
+    } else if (new_cpus[cpu].freq_count) {
+        memcpy(new_cpus[cpu].freqs, new_cpus[owner].freqs,
+                sizeof(struct freq_info) * new_cpus[cpu].freq_count);
+    }
 
-    sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/stats/time_in_state", cpu);
-    file = fopen(filename, "r");
-    if (!file) die("Could not open %s\n", filename);
-    for (i = 0; i < new_cpus[cpu].freq_count; i++) {
-        fscanf(file, "%u %lu\n", &new_cpus[cpu].freqs[i].freq,
-               &new_cpus[cpu].freqs[i].time);
-        if (aggregate_freq_stats) {
+    if (aggregate_freq_stats) {
+        for (i = 0; i < new_cpus[cpu].freq_count; i++) {
             new_total_cpu.freqs[i].freq = new_cpus[cpu].freqs[i].freq;
             new_total_cpu.freqs[i].time += new_cpus[cpu].freqs[i].time;
         }
     }
-    fclose(file);
+}
+
+/*
+ * Read the NUMA node of every cpu from the cpulist of each node, 0 for
+ * cpus the kernel puts in none, or when it isn't built with NUMA.
+ */
+static void get_cpu_nodes(int *nodes) {
+    char filename[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+    int *list, count, node, i;
+
+    for (i = 0; i < cpu_count; i++) {
+        nodes[i] = 0;
+    }
+
+    dir = opendir(SYS_NODE_DIR);
+    if (!dir) return;
+    while ((entry = readdir(dir))) {
+        if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+        snprintf(filename, sizeof(filename), SYS_NODE_DIR "/%s/cpulist", entry->d_name);
+        count = read_cpu_list(filename, &list);
+        for (i = 0; i < count; i++) {
+            if (list[i] <= max_cpu_id && cpu_index[list[i]] >= 0) {
+                nodes[cpu_index[list[i]]] = node;
+            }
+        }
+        if (count > 0) free(list);
+    }
+    closedir(dir);
+}
+
+/*
+ * Split the cpus into the groups that are shown: one per cpu, or with -g
+ * the cpus of each cpufreq policy ("cluster"), NUMA node or physical
+ * package. Cpus without a cpufreq policy are clustered by package.
+ */
+static void make_groups() {
+    char filename[PATH_MAX];
+    int *keys, i, g, m, clusters = 0;
+    struct cpu_group *group;
+    char shared;
+
+    groups = calloc(cpu_count, sizeof(struct cpu_group));
+    if (!groups) die("Could not allocate cpu groups\n");
+    keys = malloc(sizeof(int) * cpu_count);
+    if (!keys) die("Could not allocate cpu groups\n");
+
+    if (group_by && !strcmp(group_by, "node")) {
+        get_cpu_nodes(keys);
+    } else if (group_by) {
+        for (i = 0; i < cpu_count; i++) {
+            snprintf(filename, sizeof(filename), SYS_CPU_DIR "/cpu%d/topology/physical_package_id",
+                    cpu_ids[i]);
+            keys[i] = read_sys_int(filename, 0);
+            // Negative package keys can't clash with policies.
+            if (!strcmp(group_by, "cluster")) {
+                keys[i] = (freq_owner[i] >= 0) ? freq_owner[i] : -1 - keys[i];
+            }
+        }
+    }
+
+    for (i = 0; i < cpu_count; i++) {
+        if (group_by) {
+            for (g = 0; g < group_count; g++) {
+                if (keys[groups[g].members[0]] == keys[i]) break;
+            }
+        } else {
+            g = group_count;
+        }
+        group = &groups[g];
+        if (g == group_count) {
+            group_count++;
+            group->members = malloc(sizeof(int) * cpu_count);
+            if (!group->members) die("Could not allocate cpu groups\n");
+            if (!group_by) {
+                snprintf(group->label, sizeof(group->label), "cpu%d", cpu_ids[i]);
+            } else if (!strcmp(group_by, "cluster")) {
+                snprintf(group->label, sizeof(group->label), "cluster%d", clusters++);
+            } else {
+                snprintf(group->label, sizeof(group->label), "%s%d", group_by, keys[i]);
+            }
+        }
+        group->members[group->member_count++] = i;
+    }
+    free(keys);
+
+    if (!group_by) return;
+
+    new_groups = calloc(group_count, sizeof(struct cpu_info));
+    old_groups = calloc(group_count, sizeof(struct cpu_info));
+    if (!new_groups || !old_groups) die("Could not allocate struct cpu_info\n");
+    for (g = 0; g < group_count; g++) {
+        group = &groups[g];
+        // Only a group within one policy has frequency stats of its own.
+        m = group->members[0];
+        shared = freq_owner[m] >= 0;
+        for (i = 1; i < group->member_count && shared; i++) {
+            shared = freq_owner[group->members[i]] == freq_owner[m];
+        }
+        if (!shared) continue;
+        new_groups[g].freq_count = old_groups[g].freq_count = new_cpus[m].freq_count;
+        new_groups[g].freqs = malloc(sizeof(struct freq_info) * new_cpus[m].freq_count);
+        old_groups[g].freqs = malloc(sizeof(struct freq_info) * new_cpus[m].freq_count);
+        if (!new_groups[g].freqs || !old_groups[g].freqs) {
+            die("Could not allocate struct freq_info\n");
+        }
+    }
+
+    if (!minimal && !output_file) {
+        for (g = 0; g < group_count; g++) {
+            printf("%s:", groups[g].label);
+            for (i = 0; i < groups[g].member_count; i++) {
+                printf(" cpu%d", cpu_ids[groups[g].members[i]]);
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Add up the times and counters of the members of each group, from cpus
+ * into info.
+ */
+static void sum_group_stats(struct cpu_info *info, struct cpu_info *cpus) {
+    struct cpu_info *cpu;
+    int g, i, j;
+
+    for (g = 0; g < group_count; g++, info++) {
+        info->utime = info->ntime = info->stime = info->itime = 0;
+        info->iowtime = info->irqtime = info->sirqtime = 0;
+        info->online = 0;
+        memset(info->perf, 0, sizeof(info->perf));
+        for (i = 0; i < groups[g].member_count; i++) {
+            cpu = &cpus[groups[g].members[i]];
+            info->utime += cpu->utime;
+            info->ntime += cpu->ntime;
+            info->stime += cpu->stime;
+            info->itime += cpu->itime;
+            info->iowtime += cpu->iowtime;
+            info->irqtime += cpu->irqtime;
+            info->sirqtime += cpu->sirqtime;
+            info->online |= cpu->online;
+            for (j = 0; j < PERF_EVENT_COUNT; j++) {
+                info->perf[j] += cpu->perf[j];
+            }
+        }
+        // All members share the policy, and so its residencies.
+        if (info->freq_count) {
+            memcpy(info->freqs, cpus[groups[g].members[0]].freqs,
+                    sizeof(struct freq_info) * info->freq_count);
+        }
+    }
+}
+
+/*
+ * Add up both the new and the old stats of the groups, the old ones
+ * again as read_stats() may have restarted cpus that came back online.
+ */
+static void sum_groups() {
+    sum_group_stats(new_groups, new_cpus);
+    sum_group_stats(old_groups, old_cpus);
+}
+
+static const double *sort_busy;
+
+static int compare_busy(const void *a, const void *b) {
+    double busy_a = sort_busy[*(const int *)a], busy_b = sort_busy[*(const int *)b];
+
+    if (busy_a != busy_b) return busy_a < busy_b ? 1 : -1;
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Fill order with the groups to show: the online ones, or with -t only the
+ * top_count busiest of them, busiest first, as given by busy. Returns how
+ * many there are.
+ */
+static int select_groups(int *order, double *busy) {
+    struct cpu_info *info = group_by ? new_groups : new_cpus;
+    int g, count = 0;
+
+    for (g = 0; g < group_count; g++) {
+        if (info[g].online) order[count++] = g;
+    }
+    if (top_count && busy) {
+        sort_busy = busy;
+        qsort(order, count, sizeof(int), compare_busy);
+        if (count > top_count) count = top_count;
+    }
+
+    return count;
+}
+
+/*
+ * Swap the new and old cpu buffers.
+ */
+static void swap_stats() {
+    struct cpu_info *tmp_cpus, tmp_total_cpu;
+
+    tmp_total_cpu = old_total_cpu;
+    old_total_cpu = new_total_cpu;
+    new_total_cpu = tmp_total_cpu;
+
+    tmp_cpus = old_cpus;
+    old_cpus = new_cpus;
+    new_cpus = tmp_cpus;
+
+    tmp_cpus = old_groups;
+    old_groups = new_groups;
+    new_groups = tmp_cpus;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Sample sample_hz times a second, on absolute deadlines so the time spent
+ * reading doesn't add up, and hand the samples over once per window.
+ * Deadlines that have already passed are skipped rather than caught up.
+ */
+static void sample_loop() {
+    struct timespec next;
+    uint64_t period_ns = NS_PER_SEC / sample_hz;
+    uint64_t deadline, now;
+    size_t window_samples = (size_t)delay * sample_hz;
+    size_t i;
+    int fd = -1;
+
+    freq_offsets = malloc(sizeof(size_t) * cpu_count);
+    if (!freq_offsets) die("Could not allocate freq offsets\n");
+    for (i = 0; i < (size_t)cpu_count; i++) {
+        freq_offsets[i] = 2 + cpu_count * CPUSTATS_TIME_FIELDS + total_freq_count;
+        total_freq_count += new_cpus[i].freq_count;
+    }
+    record_words = 2 + cpu_count * CPUSTATS_TIME_FIELDS + total_freq_count;
+    ring_size = window_samples;
+    ring = malloc(ring_size * record_words * sizeof(uint32_t));
+    if (!ring) die("Could not allocate the sample ring\n");
+
+    if (output_file) {
+        fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) die("Could not open %s: %s\n", output_file, strerror(errno));
+        write_header(fd);
+    }
+
+    deadline = now_ns();
+    while ((iterations == -1) || (iterations-- > 0)) {
+        for (i = 0; i < window_samples; i++) {
+            deadline += period_ns;
+            next.tv_sec = deadline / NS_PER_SEC;
+            next.tv_nsec = deadline % NS_PER_SEC;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+            swap_stats();
+            read_stats();
+            now = now_ns();
+            record_sample(now);
+
+            if (now > deadline + period_ns) {
+                missed_ticks += (now - deadline) / period_ns;
+                deadline += (now - deadline) / period_ns * period_ns;
+            }
+        }
+
+        if (fd >= 0) {
+            flush_samples(fd);
+        } else {
+            print_window();
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    if (missed_ticks || dropped_samples) {
+        fprintf(stderr, "warning: missed %lu ticks, dropped %lu samples\n", missed_ticks,
+                dropped_samples);
+    }
+    free(ring);
+    free(freq_offsets);
+}
+
+/*
+ * Store the deltas between the old and new stats in the next ring slot.
+ */
+static void record_sample(uint64_t timestamp_ns) {
+    uint32_t *r;
+    int i, j;
+
+    if (ring_count == ring_size) {
+        // Nobody drained the ring in time, overwrite the oldest sample.
+        ring_head = (ring_head + 1) % ring_size;
+        ring_count--;
+        dropped_samples++;
+    }
+    r = ring + ((ring_head + ring_count) % ring_size) * record_words;
+    ring_count++;
+
+    memcpy(r, &timestamp_ns, sizeof(timestamp_ns));
+    r += 2;
+    for (i = 0; i < cpu_count; i++) {
+        *r++ = new_cpus[i].utime - old_cpus[i].utime;
+        *r++ = new_cpus[i].ntime - old_cpus[i].ntime;
+        *r++ = new_cpus[i].stime - old_cpus[i].stime;
+        *r++ = new_cpus[i].itime - old_cpus[i].itime;
+        *r++ = new_cpus[i].iowtime - old_cpus[i].iowtime;
+        *r++ = new_cpus[i].irqtime - old_cpus[i].irqtime;
+        *r++ = new_cpus[i].sirqtime - old_cpus[i].sirqtime;
+    }
+    for (i = 0; i < cpu_count; i++) {
+        for (j = 0; j < new_cpus[i].freq_count; j++) {
+            *r++ = new_cpus[i].freqs[j].time - old_cpus[i].freqs[j].time;
+        }
+    }
+}
+
+static void write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            die("Could not write to %s: %s\n", output_file, strerror(errno));
+        }
+        p += written;
+        len -= written;
+    }
+}
+
+/*
+ * Write the file header and frequency tables described in cpustats_record.h.
+ */
+static void write_header(int fd) {
+    struct cpustats_header header;
+    uint32_t value;
+    int i, j;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CPUSTATS_MAGIC;
+    header.version = CPUSTATS_VERSION;
+    header.header_size = sizeof(header) + (2 * cpu_count + total_freq_count) * sizeof(uint32_t);
+    header.record_size = record_words * sizeof(uint32_t);
+    header.cpu_count = cpu_count;
+    header.freq_count = total_freq_count;
+    header.sample_hz = sample_hz;
+    header.clock_ticks = sysconf(_SC_CLK_TCK);
+    write_all(fd, &header, sizeof(header));
+
+    for (i = 0; i < cpu_count; i++) {
+        value = cpu_ids[i];
+        write_all(fd, &value, sizeof(value));
+    }
+    for (i = 0; i < cpu_count; i++) {
+        value = new_cpus[i].freq_count;
+        write_all(fd, &value, sizeof(value));
+    }
+    for (i = 0; i < cpu_count; i++) {
+        for (j = 0; j < new_cpus[i].freq_count; j++) {
+            value = new_cpus[i].freqs[j].freq;
+            write_all(fd, &value, sizeof(value));
+        }
+    }
+}
+
+/*
+ * Write out and empty the ring, with at most two writes.
+ */
+static void flush_samples(int fd) {
+    size_t first = ring_count;
+
+    if (ring_head + first > ring_size) first = ring_size - ring_head;
+    write_all(fd, ring + ring_head * record_words, first * record_words * sizeof(uint32_t));
+    write_all(fd, ring, (ring_count - first) * record_words * sizeof(uint32_t));
+    ring_head = ring_count = 0;
+}
+
+/*
+ * Get how busy some cpus were over the samples in the ring, on average and
+ * at the busiest sample, in percent.
+ */
+static double get_window_busy(const int *members, int member_count, double *max_busy) {
+    unsigned long busy, total, window_busy = 0, window_total = 0;
+    const uint32_t *r, *t;
+    size_t i;
+    int m;
+
+    *max_busy = 0;
+    for (i = 0; i < ring_count; i++) {
+        r = ring + ((ring_head + i) % ring_size) * record_words;
+        busy = total = 0;
+        for (m = 0; m < member_count; m++) {
+            t = r + 2 + members[m] * CPUSTATS_TIME_FIELDS;
+            // Everything but idle and iowait.
+            busy += t[0] + t[1] + t[2] + t[5] + t[6];
+            total += t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6];
+        }
+        window_busy += busy;
+        window_total += total;
+        if (total && 100.0 * busy / total > *max_busy) *max_busy = 100.0 * busy / total;
+    }
+
+    return window_total ? 100.0 * window_busy / window_total : 0.0;
+}
+
+/*
+ * Print how busy some cpus were over the samples in the ring, and their
+ * frequency residency if freq_count > 0, in which case they all have the
+ * frequencies of the first one.
+ */
+static void print_window_cpus(const char *label, const int *members, int member_count,
+        int freq_count) {
+    unsigned long freq_total = 0, *freq_times;
+    double busy, max_busy;
+    const uint32_t *r, *t;
+    const struct freq_info *freqs;
+    size_t i;
+    int m, f;
+
+    busy = get_window_busy(members, member_count, &max_busy);
+
+    freq_times = calloc(freq_count ? freq_count : 1, sizeof(*freq_times));
+    if (!freq_times) die("Could not allocate freq times\n");
+    for (i = 0; i < ring_count && freq_count; i++) {
+        r = ring + ((ring_head + i) % ring_size) * record_words;
+        // The residencies of all the cpus, which have the same
+        // frequencies, are added up.
+        for (m = 0; m < member_count; m++) {
+            if (new_cpus[members[m]].freq_count != freq_count) continue;
+            t = r + freq_offsets[members[m]];
+            for (f = 0; f < freq_count; f++) {
+                freq_times[f] += t[f];
+                freq_total += t[f];
+            }
+        }
+    }
+    freqs = new_cpus[members[0]].freqs;
+
+    if (!minimal) {
+        printf("%s: Busy %.1f%% (max %.1f%%) over %zu samples\n", label, busy, max_busy,
+                ring_count);
+        if (freq_count > 0) {
+            printf("  ");
+            for (f = 0; f < freq_count; f++) {
+                printf("%ukHz %.1f%%%s", freqs[f].freq,
+                        freq_total ? 100.0 * freq_times[f] / freq_total : 0.0,
+                        (f + 1 != freq_count) ? " + " : "\n");
+            }
+        }
+    } else {
+        printf("%s,%.1f,%.1f", label, busy, max_busy);
+        for (f = 0; f < freq_count; f++) {
+            printf(",%u,%.1f", freqs[f].freq,
+                    freq_total ? 100.0 * freq_times[f] / freq_total : 0.0);
+        }
+        printf("\n");
+    }
+
+    free(freq_times);
+}
+
+/*
+ * Print a summary of the samples in the ring and empty it.
+ */
+static void print_window() {
+    static int *all_cpus, *order;
+    static double *busy;
+    struct cpu_group *group;
+    double max_busy;
+    int i, count, freq_count;
+
+    if (!all_cpus) {
+        all_cpus = malloc(sizeof(int) * cpu_count);
+        order = malloc(sizeof(int) * group_count);
+        busy = malloc(sizeof(double) * group_count);
+        if (!all_cpus || !order || !busy) die("Could not allocate window summary\n");
+        // Total starts with the frequency reference, whose frequencies it shows.
+        all_cpus[0] = freq_reference >= 0 ? freq_reference : 0;
+        for (i = 0, count = 1; i < cpu_count; i++) {
+            if (i != all_cpus[0]) all_cpus[count++] = i;
+        }
+    }
+
+    print_window_cpus("Total", all_cpus, cpu_count,
+            aggregate_freq_stats ? new_cpus[freq_reference].freq_count : 0);
+
+    if (top_count) {
+        for (i = 0; i < group_count; i++) {
+            busy[i] = get_window_busy(groups[i].members, groups[i].member_count, &max_busy);
+        }
+    }
+    count = select_groups(order, busy);
+    for (i = 0; i < count; i++) {
+        group = &groups[order[i]];
+        freq_count = group_by ? new_groups[order[i]].freq_count :
+                new_cpus[order[i]].freq_count;
+        print_window_cpus(group->label, group->members, group->member_count, freq_count);
+    }
+    printf("\n");
+    fflush(stdout);
+    ring_head = ring_count = 0;
+}
+
+static int perf_event_open(struct perf_event_attr *attr, int cpu, int group_fd) {
+    return syscall(__NR_perf_event_open, attr, -1, cpu, group_fd, 0);
+}
+
+/*
+ * Open the counter group of a cpu, returning -1 with errno set if any of
+ * the counters isn't available.
+ */
+static int open_perf_group(int cpu, char software) {
+    static const uint64_t hw_events[PERF_EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+    static const uint64_t sw_events[PERF_EVENT_COUNT] = {
+        PERF_COUNT_SW_CPU_CLOCK,
+        PERF_COUNT_SW_CONTEXT_SWITCHES,
+        PERF_COUNT_SW_CPU_MIGRATIONS,
+        PERF_COUNT_SW_PAGE_FAULTS,
+    };
+    struct perf_event_attr attr;
+    int *fds = perf_fds + cpu * PERF_EVENT_COUNT;
+    int i, saved_errno;
+
+    for (i = 0; i < PERF_EVENT_COUNT; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = software ? PERF_TYPE_SOFTWARE : PERF_TYPE_HARDWARE;
+        attr.config = software ? sw_events[i] : hw_events[i];
+        // The whole group is read at once through the leader.
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = (i == 0);
+        fds[i] = perf_event_open(&attr, cpu_ids[cpu], i ? fds[0] : -1);
+        if (fds[i] < 0) {
+            saved_errno = errno;
+            while (i-- > 0) close(fds[i]);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, 0);
+    return 0;
+}
+
+/*
+ * Open a counter group on every online cpu. Falls back to the software
+ * counters when the hardware ones can't be counted, as on many virtual
+ * machines. Offline cpus are left without counters.
+ */
+static void open_perf_counters() {
+    int i, j;
+
+    perf_fds = malloc(sizeof(int) * PERF_EVENT_COUNT * cpu_count);
+    if (!perf_fds) die("Could not allocate perf fds\n");
+
+    for (i = 0; i < cpu_count; i++) {
+        if (open_perf_group(i, perf_software) == 0) continue;
+        if (errno == ENODEV) {
+            perf_fds[i * PERF_EVENT_COUNT] = -1;
+            continue;
+        }
+        if (errno == EACCES || errno == EPERM) {
+            die("Could not open perf counters: %s\n"
+                "Per-cpu counters need root or a lower kernel.perf_event_paranoid.\n",
+                strerror(errno));
+        }
+        if (perf_software) {
+            die("Could not open perf counters of cpu%d: %s\n", cpu_ids[i], strerror(errno));
+        }
+        // Start over with the software counters.
+        for (; i > 0; i--) {
+            if (perf_fds[(i - 1) * PERF_EVENT_COUNT] < 0) continue;
+            for (j = 0; j < PERF_EVENT_COUNT; j++) {
+                close(perf_fds[(i - 1) * PERF_EVENT_COUNT + j]);
+            }
+        }
+        perf_software = 1;
+        i = -1;
+    }
+}
+
+/*
+ * Read the counters of a cpu with a single read of its group and add them
+ * to the total.
+ */
+static void read_perf_counters(int cpu) {
+    // nr, time_enabled, time_running, then the values.
+    uint64_t buf[3 + PERF_EVENT_COUNT];
+    ssize_t bytes;
+    int i;
+
+    if (perf_fds[cpu * PERF_EVENT_COUNT] < 0) return;
+    bytes = read(perf_fds[cpu * PERF_EVENT_COUNT], buf, sizeof(buf));
+    if (bytes != sizeof(buf)) die("Could not read perf counters of cpu%d\n", cpu_ids[cpu]);
+
+    for (i = 0; i < PERF_EVENT_COUNT; i++) {
+        // Scale up when the counters were multiplexed with others.
+        if (buf[2] && buf[2] < buf[1]) {
+            new_cpus[cpu].perf[i] = (uint64_t)((double)buf[3 + i] * buf[1] / buf[2]);
+        } else {
+            new_cpus[cpu].perf[i] = buf[3 + i];
+        }
+        new_total_cpu.perf[i] += new_cpus[cpu].perf[i];
+    }
+}
+
+static void close_perf_counters() {
+    int i;
+
+    for (i = 0; i < cpu_count * PERF_EVENT_COUNT; i++) {
+        if (perf_fds[i - i % PERF_EVENT_COUNT] >= 0) close(perf_fds[i]);
+    }
+    free(perf_fds);
+}
+
+/*
+ * Print the counter deltas of a cpu: IPC and cache miss rate from the
+ * hardware counters, or the software counters as they are.
+ */
+static void print_perf_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu) {
+    uint64_t d[PERF_EVENT_COUNT];
+    int i;
+
+    for (i = 0; i < PERF_EVENT_COUNT; i++) {
+        d[i] = new_cpu->perf[i] - old_cpu->perf[i];
+    }
+
+    if (perf_software) {
+        if (!minimal) {
+            printf("  CPU clock %.1f ms, Context switches %llu, Migrations %llu, "
+                    "Page faults %llu\n", d[PERF_SW_CPU_CLOCK] / 1e6,
+                    (unsigned long long)d[PERF_SW_CONTEXT_SWITCHES],
+                    (unsigned long long)d[PERF_SW_MIGRATIONS],
+                    (unsigned long long)d[PERF_SW_PAGE_FAULTS]);
+        } else {
+            printf(",%llu,%llu,%llu,%llu", (unsigned long long)d[PERF_SW_CPU_CLOCK],
+                    (unsigned long long)d[PERF_SW_CONTEXT_SWITCHES],
+                    (unsigned long long)d[PERF_SW_MIGRATIONS],
+                    (unsigned long long)d[PERF_SW_PAGE_FAULTS]);
+        }
+        return;
+    }
+
+    if (!minimal) {
+        printf("  Cycles %.1fM, Instructions %.1fM, IPC %.2f, Cache refs %.1fM, "
+                "Misses %.1fM (%.1f%%)\n", d[PERF_CYCLES] / 1e6, d[PERF_INSTRUCTIONS] / 1e6,
+                d[PERF_CYCLES] ? (double)d[PERF_INSTRUCTIONS] / d[PERF_CYCLES] : 0.0,
+                d[PERF_CACHE_REFS] / 1e6, d[PERF_CACHE_MISSES] / 1e6,
+                d[PERF_CACHE_REFS] ? 100.0 * d[PERF_CACHE_MISSES] / d[PERF_CACHE_REFS] : 0.0);
+    } else {
+        printf(",%llu,%llu,%.2f,%llu,%llu,%.1f", (unsigned long long)d[PERF_CYCLES],
+                (unsigned long long)d[PERF_INSTRUCTIONS],
+                d[PERF_CYCLES] ? (double)d[PERF_INSTRUCTIONS] / d[PERF_CYCLES] : 0.0,
+                (unsigned long long)d[PERF_CACHE_REFS], (unsigned long long)d[PERF_CACHE_MISSES],
+                d[PERF_CACHE_REFS] ? 100.0 * d[PERF_CACHE_MISSES] / d[PERF_CACHE_REFS] : 0.0);
+    }
 }
 
 /*
@@ -287,19 +1297,43 @@ static long unsigned get_cpu_total_time(struct cpu_info *cpu) {
 }
 
 /*
- * Print the stats for all CPUs.
+ * Get the cpu time spent on anything but idle and iowait.
+ */
+static long unsigned get_cpu_busy_time(struct cpu_info *cpu) {
+    return get_cpu_total_time(cpu) - cpu->itime - cpu->iowtime;
+}
+
+/*
+ * Print the stats for all CPUs, or their groups.
  */
 static void print_stats() {
-    char label[8];
-    int i, j;
+    static int *order;
+    static double *busy;
+    struct cpu_info *new_info, *old_info;
+    int i, g, count;
     char print_freq;
 
-    print_freq = should_print_freq_stats();
+    if (!order) {
+        order = malloc(sizeof(int) * group_count);
+        busy = malloc(sizeof(double) * group_count);
+        if (!order || !busy) die("Could not allocate cpu order\n");
+    }
+
+    // The groups each have their own frequencies, if any.
+    print_freq = group_by || should_print_freq_stats();
+    new_info = group_by ? new_groups : new_cpus;
+    old_info = group_by ? old_groups : old_cpus;
 
     print_cpu_stats("Total", &new_total_cpu, &old_total_cpu, 1);
-    for (i = 0; i < cpu_count; i++) {
-        sprintf(label, "cpu%d", i);
-        print_cpu_stats(label, &new_cpus[i], &old_cpus[i], print_freq);
+    if (top_count) {
+        for (g = 0; g < group_count; g++) {
+            busy[g] = get_cpu_busy_time(&new_info[g]) - get_cpu_busy_time(&old_info[g]);
+        }
+    }
+    count = select_groups(order, busy);
+    for (i = 0; i < count; i++) {
+        g = order[i];
+        print_cpu_stats(groups[g].label, &new_info[g], &old_info[g], print_freq);
     }
     printf("\n");
 }
@@ -323,6 +1357,9 @@ static void print_cpu_stats(char *label, struct cpu_info *new_cpu, struct cpu_in
                 new_cpu->irqtime - old_cpu->irqtime,
                 new_cpu->sirqtime - old_cpu->sirqtime,
                 total_delta_time);
+        if (perf_mode) {
+            print_perf_stats(new_cpu, old_cpu);
+        }
         if (print_freq) {
             print_freq_stats(new_cpu, old_cpu);
         }
@@ -335,6 +1372,9 @@ static void print_cpu_stats(char *label, struct cpu_info *new_cpu, struct cpu_in
                 new_cpu->iowtime - old_cpu->iowtime,
                 new_cpu->irqtime - old_cpu->irqtime,
                 new_cpu->sirqtime - old_cpu->sirqtime);
+        if (perf_mode) {
+            print_perf_stats(new_cpu, old_cpu);
+        }
         print_freq_stats(new_cpu, old_cpu);
         printf("\n");
     }
@@ -379,12 +1419,14 @@ static void print_freq_stats(struct cpu_info *new_cpu, struct cpu_info *old_cpu)
  * printed.
  */
 static char should_print_freq_stats() {
-    int i, j;
+    int i, j, ref = freq_reference;
 
-    for (i = 1; i < cpu_count; i++) {
+    if (!aggregate_freq_stats) return 1;
+    for (i = 0; i < cpu_count; i++) {
+        if (!new_cpus[i].freq_count || freq_owner[i] == freq_owner[ref]) continue;
         for (j = 0; j < new_cpus[i].freq_count; j++) {
             if (new_cpus[i].freqs[j].time - old_cpus[i].freqs[j].time !=
-                    new_cpus[0].freqs[j].time - old_cpus[0].freqs[j].time) {
+                    new_cpus[ref].freqs[j].time - old_cpus[ref].freqs[j].time) {
                 return 1;
             }
         }
@@ -396,18 +1438,23 @@ static char should_print_freq_stats() {
  * Determine if the frequency stats should be aggregated.
  *
  * Only aggregate the frequency stats in the total cpu stats if the frequencies
- * reported by all CPUs are identical.  Must be called after read_stats() has
- * been called once.
+ * reported by all CPUs that have any are identical.  Must be called after
+ * read_stats() has been called once.  Also sets freq_reference.
  */
 static char should_aggregate_freq_stats() {
-    int i, j;
+    int i, j, ref;
+
+    for (ref = 0; ref < cpu_count && !new_cpus[ref].freq_count; ref++);
+    if (ref == cpu_count) return 0;
+    freq_reference = ref;
 
-    for (i = 1; i < cpu_count; i++) {
-        if (new_cpus[i].freq_count != new_cpus[0].freq_count) {
+    for (i = ref + 1; i < cpu_count; i++) {
+        if (!new_cpus[i].freq_count) continue;
+        if (new_cpus[i].freq_count != new_cpus[ref].freq_count) {
             return 0;
         }
         for (j = 0; j < new_cpus[i].freq_count; j++) {
-            if (new_cpus[i].freqs[j].freq != new_cpus[0].freqs[j].freq) {
+            if (new_cpus[i].freqs[j].freq != new_cpus[ref].freqs[j].freq) {
                 return 0;
             }
         }
@@ -420,10 +1467,25 @@ static char should_aggregate_freq_stats() {
  * Print the usage message.
  */
 static void usage(char *cmd) {
-    fprintf(stderr, "Usage %s [ -n iterations ] [ -d delay ] [ -c cpu ] [ -m ] [ -h ]\n"
+    fprintf(stderr, "Usage %s [ -n iterations ] [ -d delay ] [ -c cpu ] [ -m ] [ -p ]\n"
+            "         [ -g cluster|node|package ] [ -t num ] [ -f hz [ -o file ] ] [ -h ]\n"
             "    -n num  Updates to show before exiting.\n"
             "    -d num  Seconds to wait between updates.\n"
             "    -m      Display minimal output.\n"
+            "    -p      Also count cycles, instructions and cache references and\n"
+            "            misses on each cpu, and show IPC and the cache miss rate.\n"
+            "            Uses software counters (cpu clock in ns, context switches,\n"
+            "            migrations, page faults) if those aren't available. With\n"
+            "            -m they follow the times as extra columns.\n"
+            "    -g by   Show cpus added up by cpufreq cluster, NUMA node or package\n"
+            "            instead of one by one.\n"
+            "    -t num  Show only the num busiest cpus, or groups with -g, busiest\n"
+            "            first. Offline cpus are never shown.\n"
+            "    -f hz   Sample hz times a second, and show how busy each cpu was on\n"
+            "            average and at most, and its frequency residency, every\n"
+            "            delay seconds.\n"
+            "    -o file With -f, write every sample to file in the binary format of\n"
+            "            cpustats_record.h instead of showing updates.\n"
             "    -h      Display this help screen.\n",
             cmd);
 }
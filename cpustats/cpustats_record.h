@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2013, The Android Open Source Project
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *  * Neither the name of Google, Inc. nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef CPUSTATS_RECORD_H
+#define CPUSTATS_RECORD_H
+
+#include <stdint.h>
+
+/*
+ * Binary output of cpustats -f <hz> -o <file>, in host byte order.
+ *
+ * The file starts with a struct cpustats_header, followed by cpu_count
+ * uint32_t giving the id of each cpu, which need not be contiguous, then
+ * cpu_count uint32_t giving the number of frequencies of each cpu, and
+ * then by freq_count uint32_t giving the frequencies in kHz, cpu after cpu.
+ *
+ * Then come fixed size records, one per sample:
+ *
+ *   uint64_t timestamp_ns;                          CLOCK_MONOTONIC
+ *   uint32_t times[cpu_count][CPUSTATS_TIME_FIELDS];
+ *   uint32_t freq_times[freq_count];
+ *
+ * Every value is the change since the previous sample, in clock ticks
+ * (clock_ticks per second) for both the /proc/stat times and the
+ * time_in_state residencies. Offline cpus show no change.
+ */
+
+#define CPUSTATS_MAGIC 0x54535043  /* "CPST" */
+#define CPUSTATS_VERSION 2
+
+/* user, nice, system, idle, iowait, irq, softirq */
+#define CPUSTATS_TIME_FIELDS 7
+
+struct cpustats_header {
+    uint32_t magic;
+    uint32_t version;
+    /* Size of this struct plus the frequency tables following it. */
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t cpu_count;
+    uint32_t freq_count;
+    uint32_t sample_hz;
+    uint32_t clock_ticks;
+};
+
+#endif
@@ -7,9 +7,12 @@ libext4_utils_src_files := \
     ext4fixup.c \
     ext4_utils.c \
     allocate.c \
+    bitmap.c \
     contents.c \
     extent.c \
+    gzip_image.c \
     indirect.c \
+    manifest.c \
     uuid.c \
     sha1.c \
     wipe.c \
@@ -43,6 +46,7 @@ ifeq ($(HOST_OS),windows)
 else
   LOCAL_STATIC_LIBRARIES += libselinux
   LOCAL_CFLAGS := -DHOST
+  LOCAL_LDLIBS += -lpthread
 endif
 include $(BUILD_HOST_EXECUTABLE)
 
@@ -101,6 +105,7 @@ LOCAL_STATIC_LIBRARIES += \
     libselinux \
     libsparse_host \
     libz
+LOCAL_LDLIBS += -lpthread
 include $(BUILD_HOST_EXECUTABLE)
 
 
@@ -128,6 +133,7 @@ LOCAL_STATIC_LIBRARIES += \
     libext4_utils_host \
     libsparse_host \
     libz
+LOCAL_LDLIBS += -lpthread
 include $(BUILD_HOST_EXECUTABLE)
 
 
@@ -16,6 +16,7 @@
 
 #include "ext4_utils.h"
 #include "allocate.h"
+#include "bitmap.h"
 #include "ext4.h"
 
 #include <sparse/sparse.h>
@@ -33,6 +34,8 @@ struct region_list {
 struct block_allocation {
 	struct region_list list;
 	struct region_list oob_list;
+	/* Next on the arena's free list */
+	struct block_allocation *next;
 };
 
 struct region {
@@ -54,21 +57,135 @@ struct block_group_info {
 	u8 *inode_table;
 	u32 free_blocks;
 	u32 first_free_block;
+	/* Free blocks below first_free_block, left by pin_blocks() and
+	   unpin_blocks(), which are not allocated again */
+	u32 skipped_blocks;
 	u32 free_inodes;
 	u32 first_free_inode;
 	u16 flags;
 	u16 used_dirs;
+	/* Position in inode_table_cache, in low memory mode */
+	struct block_group_info *cache_prev;
+	struct block_group_info *cache_next;
 };
 
 struct xattr_list_element {
-	struct ext4_inode *inode;
+	u32 inode_num;
 	struct ext4_xattr_header *header;
 	struct xattr_list_element *next;
 };
 
+/* Indexes over the block groups, so that an allocation doesn't have to try
+   every block group in turn.  max_free_blocks is a segment tree: leaf
+   leaves + i holds the free_blocks of block group i, and every other node
+   the larger of its two children.  first_unused_bg and first_free_inode_bg
+   can only move forward, as data_blocks_used never goes back to 0 and
+   inodes are never freed. */
+struct block_group_index {
+	u32 *max_free_blocks;
+	u32 leaves;
+	u32 first_unused_bg;
+	u32 first_free_inode_bg;
+};
+
+static struct block_group_index bg_index;
+
+/* The allocator's own bookkeeping (regions, block_allocations and xattr
+   list elements) is carved out of large chunks instead of being malloc()ed
+   an object at a time, and released all at once by block_allocator_free().
+   Regions and block_allocations given back by free_alloc() go on free lists
+   to be reused by later files. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	char data[ARENA_CHUNK_SIZE];
+};
+
+struct allocator_arena {
+	struct arena_chunk *chunks;
+	struct region *free_regions;
+	struct block_allocation *free_allocs;
+};
+
+static struct allocator_arena arena;
+
+/* In low memory mode every inode table is queued in info.sparse_file from
+   aux_info.scratch_fd, and only the most recently used ones are kept in
+   memory.  The others are written back to the scratch file, and read in
+   again if they are needed later.  A pointer returned by get_inode() stays
+   valid until the next call to get_inode(), as the group it was in is then
+   the most recently used. */
+#define INODE_TABLE_CACHE_GROUPS 16
+
+struct inode_table_cache {
+	/* Most recently used first */
+	struct block_group_info *first;
+	struct block_group_info *last;
+	u32 count;
+};
+
+static struct inode_table_cache inode_table_cache;
+
+static void *arena_alloc(size_t size)
+{
+	struct arena_chunk *chunk = arena.chunks;
+	void *ptr;
+
+	size = ALIGN(size, sizeof(u64));
+	if (chunk == NULL || chunk->used + size > ARENA_CHUNK_SIZE) {
+		chunk = malloc(sizeof(struct arena_chunk));
+		if (chunk == NULL)
+			critical_error_errno("malloc");
+		chunk->used = 0;
+		chunk->next = arena.chunks;
+		arena.chunks = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+static void arena_free_all(void)
+{
+	struct arena_chunk *chunk;
+
+	while (arena.chunks) {
+		chunk = arena.chunks;
+		arena.chunks = chunk->next;
+		free(chunk);
+	}
+	arena.free_regions = NULL;
+	arena.free_allocs = NULL;
+}
+
+static struct region *new_region(void)
+{
+	struct region *reg = arena.free_regions;
+
+	if (reg == NULL)
+		return arena_alloc(sizeof(struct region));
+
+	arena.free_regions = reg->next;
+	return reg;
+}
+
+static void release_region(struct region *reg)
+{
+	reg->next = arena.free_regions;
+	arena.free_regions = reg;
+}
+
 struct block_allocation *create_allocation()
 {
-	struct block_allocation *alloc = malloc(sizeof(struct block_allocation));
+	struct block_allocation *alloc = arena.free_allocs;
+	if (alloc == NULL)
+		alloc = arena_alloc(sizeof(struct block_allocation));
+	else
+		arena.free_allocs = alloc->next;
+	alloc->next = NULL;
 	alloc->list.first = NULL;
 	alloc->list.last = NULL;
 	alloc->oob_list.first = NULL;
@@ -80,20 +197,20 @@ struct block_allocation *create_allocation()
 	return alloc;
 }
 
-static struct ext4_xattr_header *xattr_list_find(struct ext4_inode *inode)
+static struct ext4_xattr_header *xattr_list_find(u32 inode_num)
 {
 	struct xattr_list_element *element;
 	for (element = aux_info.xattrs; element != NULL; element = element->next) {
-		if (element->inode == inode)
+		if (element->inode_num == inode_num)
 			return element->header;
 	}
 	return NULL;
 }
 
-static void xattr_list_insert(struct ext4_inode *inode, struct ext4_xattr_header *header)
+static void xattr_list_insert(u32 inode_num, struct ext4_xattr_header *header)
 {
-	struct xattr_list_element *element = malloc(sizeof(struct xattr_list_element));
-	element->inode = inode;
+	struct xattr_list_element *element = arena_alloc(sizeof(struct xattr_list_element));
+	element->inode_num = inode_num;
 	element->header = header;
 	element->next = aux_info.xattrs;
 	aux_info.xattrs = element;
@@ -158,7 +275,7 @@ void append_region(struct block_allocation *alloc,
 		u32 block, u32 len, int bg_num)
 {
 	struct region *reg;
-	reg = malloc(sizeof(struct region));
+	reg = new_region();
 	reg->block = block;
 	reg->len = len;
 	reg->bg = bg_num;
@@ -167,88 +284,210 @@ void append_region(struct block_allocation *alloc,
 	region_list_append(&alloc->list, reg);
 }
 
+static off64_t inode_table_scratch_offset(struct block_group_info *bg)
+{
+	return (off64_t)(bg - aux_info.bgs) * aux_info.inode_table_blocks * info.block_size;
+}
+
+static void inode_table_io(struct block_group_info *bg, int write_table)
+{
+	u32 len = aux_info.inode_table_blocks * info.block_size;
+	u32 done;
+	ssize_t ret;
+
+	if (lseek64(aux_info.scratch_fd, inode_table_scratch_offset(bg), SEEK_SET) < 0)
+		critical_error_errno("lseek64");
+
+	for (done = 0; done < len; done += ret) {
+		if (write_table)
+			ret = write(aux_info.scratch_fd, bg->inode_table + done, len - done);
+		else
+			ret = read(aux_info.scratch_fd, bg->inode_table + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret <= 0)
+			critical_error_errno("%s inode table", write_table ? "writing" : "reading");
+	}
+}
+
+static void inode_table_cache_remove(struct block_group_info *bg)
+{
+	if (bg->cache_prev)
+		bg->cache_prev->cache_next = bg->cache_next;
+	else
+		inode_table_cache.first = bg->cache_next;
+
+	if (bg->cache_next)
+		bg->cache_next->cache_prev = bg->cache_prev;
+	else
+		inode_table_cache.last = bg->cache_prev;
+
+	bg->cache_prev = NULL;
+	bg->cache_next = NULL;
+	inode_table_cache.count--;
+}
+
+static void inode_table_cache_insert(struct block_group_info *bg)
+{
+	bg->cache_prev = NULL;
+	bg->cache_next = inode_table_cache.first;
+	if (inode_table_cache.first)
+		inode_table_cache.first->cache_prev = bg;
+	else
+		inode_table_cache.last = bg;
+	inode_table_cache.first = bg;
+	inode_table_cache.count++;
+}
+
+static void inode_table_evict(struct block_group_info *bg)
+{
+	inode_table_io(bg, 1);
+	inode_table_cache_remove(bg);
+	free(bg->inode_table);
+	bg->inode_table = NULL;
+}
+
+/* Writes the inode tables still in memory to the scratch file.  Must be
+   called before the image is written in low memory mode. */
+void flush_inode_tables(void)
+{
+	while (inode_table_cache.first)
+		inode_table_evict(inode_table_cache.first);
+}
+
 static void allocate_bg_inode_table(struct block_group_info *bg)
 {
-	if (bg->inode_table != NULL)
+	if (bg->inode_table != NULL) {
+		if (info.low_memory && inode_table_cache.first != bg) {
+			inode_table_cache_remove(bg);
+			inode_table_cache_insert(bg);
+		}
 		return;
+	}
 
 	u32 block = bg->first_block + 2;
 
 	if (bg->has_superblock)
 		block += aux_info.bg_desc_blocks + info.bg_desc_reserve_blocks + 1;
 
+	if (info.low_memory && inode_table_cache.count >= INODE_TABLE_CACHE_GROUPS)
+		inode_table_evict(inode_table_cache.last);
+
 	bg->inode_table = calloc(aux_info.inode_table_blocks, info.block_size);
 	if (bg->inode_table == NULL)
 		critical_error_errno("calloc");
 
-	sparse_file_add_data(info.sparse_file, bg->inode_table,
-			aux_info.inode_table_blocks	* info.block_size, block);
+	if (!info.low_memory) {
+		sparse_file_add_data(info.sparse_file, bg->inode_table,
+				aux_info.inode_table_blocks	* info.block_size, block);
+	} else {
+		if (bg->flags & EXT4_BG_INODE_UNINIT)
+			sparse_file_add_fd(info.sparse_file, aux_info.scratch_fd,
+					inode_table_scratch_offset(bg),
+					aux_info.inode_table_blocks * info.block_size, block);
+		else
+			inode_table_io(bg, 0);
+		inode_table_cache_insert(bg);
+	}
 
 	bg->flags &= ~EXT4_BG_INODE_UNINIT;
 }
 
-static int bitmap_set_bit(u8 *bitmap, u32 bit)
+static void bg_index_init(void)
 {
-	if (bitmap[bit / 8] & 1 << (bit % 8))
-		return 1;
+	u32 i;
 
-	bitmap[bit / 8] |= 1 << (bit % 8);
-	return 0;
+	for (bg_index.leaves = 1; bg_index.leaves < aux_info.groups; bg_index.leaves *= 2)
+		;
+
+	bg_index.max_free_blocks = calloc(2 * bg_index.leaves, sizeof(u32));
+	if (bg_index.max_free_blocks == NULL)
+		critical_error_errno("calloc");
+
+	for (i = 0; i < aux_info.groups; i++)
+		bg_index.max_free_blocks[bg_index.leaves + i] = aux_info.bgs[i].free_blocks;
+	for (i = bg_index.leaves - 1; i > 0; i--)
+		bg_index.max_free_blocks[i] = max(bg_index.max_free_blocks[2 * i],
+				bg_index.max_free_blocks[2 * i + 1]);
+
+	bg_index.first_unused_bg = 0;
+	bg_index.first_free_inode_bg = 0;
 }
 
-static int bitmap_set_8_bits(u8 *bitmap, u32 bit)
+static void bg_index_update(struct block_group_info *bg)
 {
-	int ret = bitmap[bit / 8];
-	bitmap[bit / 8] = 0xFF;
-	return ret;
+	u32 *tree = bg_index.max_free_blocks;
+	u32 node;
+
+	/* Not built yet while block_allocator_init() reserves the headers */
+	if (tree == NULL)
+		return;
+
+	node = bg_index.leaves + (bg - aux_info.bgs);
+	tree[node] = bg->free_blocks;
+	for (node /= 2; node > 0; node /= 2)
+		tree[node] = max(tree[2 * node], tree[2 * node + 1]);
 }
 
-/* Marks a the first num_blocks blocks in a block group as used, and accounts
- for them in the block group free block info. */
-static int reserve_blocks(struct block_group_info *bg, u32 start, u32 num)
+/* Returns the first block group at or after start with at least len free
+   blocks, or -1 if there is none */
+static int bg_index_find_free(u32 start, u32 len)
 {
-	unsigned int i = 0;
+	u32 *tree = bg_index.max_free_blocks;
+	u32 node;
 
-	u32 block = start;
-	if (num > bg->free_blocks)
+	if (start >= aux_info.groups)
 		return -1;
 
-	for (i = 0; i < num && block % 8 != 0; i++, block++) {
-		if (bitmap_set_bit(bg->block_bitmap, block)) {
-			error("attempted to reserve already reserved block");
-			return -1;
+	/* Walk up from start until a subtree to the right of the path has
+	   enough free blocks, then down to its leftmost group that does */
+	node = bg_index.leaves + start;
+	if (tree[node] < len) {
+		while (1) {
+			if (node == 1)
+				return -1;
+			if (node % 2 == 0 && tree[node + 1] >= len) {
+				node++;
+				break;
+			}
+			node /= 2;
 		}
+		while (node < bg_index.leaves)
+			node = tree[2 * node] >= len ? 2 * node : 2 * node + 1;
 	}
 
-	for (; i + 8 <= (num & ~7); i += 8, block += 8) {
-		if (bitmap_set_8_bits(bg->block_bitmap, block)) {
-			error("attempted to reserve already reserved block");
-			return -1;
-		}
-	}
+	node -= bg_index.leaves;
+	return node < aux_info.groups ? (int)node : -1;
+}
 
-	for (; i < num; i++, block++) {
-		if (bitmap_set_bit(bg->block_bitmap, block)) {
-			error("attempted to reserve already reserved block");
-			return -1;
-		}
+/* Marks a the first num_blocks blocks in a block group as used, and accounts
+ for them in the block group free block info. */
+static int reserve_blocks(struct block_group_info *bg, u32 start, u32 num)
+{
+	if (num > bg->free_blocks)
+		return -1;
+
+	if (bitmap_find_next_set(bg->block_bitmap, start, start + num) != start + num) {
+		error("attempted to reserve already reserved block");
+		return -1;
 	}
 
+	bitmap_set_range(bg->block_bitmap, start, num);
+
 	bg->free_blocks -= num;
 	if (start == bg->first_free_block)
 		bg->first_free_block = start + num;
+	bg_index_update(bg);
 
 	return 0;
 }
 
 static void free_blocks(struct block_group_info *bg, u32 num_blocks)
 {
-	unsigned int i;
-	u32 block = bg->first_free_block - 1;
-	for (i = 0; i < num_blocks; i++, block--)
-		bg->block_bitmap[block / 8] &= ~(1 << (block % 8));
+	bitmap_clear_range(bg->block_bitmap, bg->first_free_block - num_blocks, num_blocks);
 	bg->free_blocks += num_blocks;
 	bg->first_free_block -= num_blocks;
+	bg_index_update(bg);
 }
 
 /* Reduces an existing allocation by len blocks by return the last blocks
@@ -275,7 +514,7 @@ void reduce_allocation(struct block_allocation *alloc, u32 len)
 				alloc->list.iter = NULL;
 				alloc->list.partial_iter = 0;
 			}
-			free(last_reg);
+			release_region(last_reg);
 		}
 	}
 }
@@ -325,12 +564,22 @@ void block_allocator_init()
 	if (aux_info.bgs == NULL)
 		critical_error_errno("calloc");
 
+	free(bg_index.max_free_blocks);
+	bg_index.max_free_blocks = NULL;
+	memset(&inode_table_cache, 0, sizeof(inode_table_cache));
+
 	for (i = 0; i < aux_info.groups; i++)
 		init_bg(&aux_info.bgs[i], i);
+
+	bg_index_init();
 }
 
+/* Frees everything the allocator holds, including the bitmaps, inode tables
+   and xattr blocks queued in info.sparse_file, so it must only be called once
+   the image has been written */
 void block_allocator_free()
 {
+	struct xattr_list_element *element;
 	unsigned int i;
 
 	for (i = 0; i < aux_info.groups; i++) {
@@ -338,11 +587,20 @@ void block_allocator_free()
 		free(aux_info.bgs[i].inode_table);
 	}
 	free(aux_info.bgs);
+	aux_info.bgs = NULL;
+	free(bg_index.max_free_blocks);
+	bg_index.max_free_blocks = NULL;
+
+	for (element = aux_info.xattrs; element != NULL; element = element->next)
+		free(element->header);
+	aux_info.xattrs = NULL;
+
+	arena_free_all();
 }
 
 static u32 ext4_allocate_blocks_from_block_group(u32 len, int bg_num)
 {
-	if (get_free_blocks(bg_num) < len)
+	if (aux_info.bgs[bg_num].free_blocks < len)
 		return EXT4_ALLOCATE_FAILED;
 
 	u32 block = aux_info.bgs[bg_num].first_free_block;
@@ -359,14 +617,14 @@ static u32 ext4_allocate_blocks_from_block_group(u32 len, int bg_num)
 
 static struct region *ext4_allocate_contiguous_blocks(u32 len)
 {
-	unsigned int i;
+	int i;
 	struct region *reg;
 
-	for (i = 0; i < aux_info.groups; i++) {
+	for (i = bg_index_find_free(0, len); i >= 0; i = bg_index_find_free(i + 1, len)) {
 		u32 block = ext4_allocate_blocks_from_block_group(len, i);
 
 		if (block != EXT4_ALLOCATE_FAILED) {
-			reg = malloc(sizeof(struct region));
+			reg = new_region();
 			reg->block = block;
 			reg->len = len;
 			reg->next = NULL;
@@ -382,8 +640,8 @@ static struct region *ext4_allocate_contiguous_blocks(u32 len)
 /* Allocate a single block and return its block number */
 u32 allocate_block()
 {
-	unsigned int i;
-	for (i = 0; i < aux_info.groups; i++) {
+	int i;
+	for (i = bg_index_find_free(0, 1); i >= 0; i = bg_index_find_free(i + 1, 1)) {
 		u32 block = ext4_allocate_blocks_from_block_group(1, i);
 
 		if (block != EXT4_ALLOCATE_FAILED)
@@ -393,13 +651,76 @@ u32 allocate_block()
 	return EXT4_ALLOCATE_FAILED;
 }
 
+/* Marks len blocks starting at block as used, so that a file can be put back
+   where a previous image had it.  Blocks are only allocated from the end of
+   the used part of a block group, so the blocks must all be in that part of
+   one block group, and the free blocks between it and block are skipped.
+   Blocks have to be pinned in increasing order for the skipped blocks to be
+   few.  Returns -1 if the blocks can't be pinned. */
+int pin_blocks(u32 block, u32 len)
+{
+	struct block_group_info *bg;
+	u32 start;
+	u32 skipped;
+
+	if (len == 0 || block < aux_info.first_data_block ||
+			block + len < block || block + len > aux_info.len_blocks)
+		return -1;
+
+	bg = &aux_info.bgs[(block - aux_info.first_data_block) / info.blocks_per_group];
+	start = block - bg->first_block;
+	if (start < bg->first_free_block || start + len > info.blocks_per_group)
+		return -1;
+
+	skipped = start - bg->first_free_block;
+	if (skipped + len > bg->free_blocks)
+		return -1;
+
+	bitmap_set_range(bg->block_bitmap, start, len);
+	bg->free_blocks -= skipped + len;
+	bg->skipped_blocks += skipped;
+	bg->first_free_block = start + len;
+	bg->data_blocks_used += len;
+	bg_index_update(bg);
+
+	return 0;
+}
+
+/* Frees blocks marked by pin_blocks() that turned out not to be needed.  They
+   stay skipped by the allocator, so the block group is still counted as
+   used: data_blocks_used is left alone, which keeps first_unused_bg from
+   having passed a group that is empty again. */
+void unpin_blocks(u32 block, u32 len)
+{
+	struct block_group_info *bg;
+
+	bg = &aux_info.bgs[(block - aux_info.first_data_block) / info.blocks_per_group];
+	bitmap_clear_range(bg->block_bitmap, block - bg->first_block, len);
+	bg->skipped_blocks += len;
+}
+
+/* Frees the blocks of an allocation that is not needed after all, and the
+   allocation itself.  The blocks stay skipped, as with unpin_blocks(). */
+void release_allocation(struct block_allocation *alloc)
+{
+	struct region *reg;
+
+	for (reg = alloc->list.first; reg; reg = reg->next)
+		unpin_blocks(reg->block, reg->len);
+	for (reg = alloc->oob_list.first; reg; reg = reg->next)
+		unpin_blocks(reg->block, reg->len);
+
+	free_alloc(alloc);
+}
+
 static struct region *ext4_allocate_partial(u32 len)
 {
 	unsigned int i;
 	struct region *reg;
 
-	for (i = 0; i < aux_info.groups; i++) {
+	for (i = bg_index.first_unused_bg; i < aux_info.groups; i++) {
 		if (aux_info.bgs[i].data_blocks_used == 0) {
+			bg_index.first_unused_bg = i;
 			u32 bg_len = aux_info.bgs[i].free_blocks;
 			u32 block;
 
@@ -417,7 +738,7 @@ static struct region *ext4_allocate_partial(u32 len)
 					return NULL;
 				}
 
-				reg = malloc(sizeof(struct region));
+				reg = new_region();
 				reg->block = block;
 				reg->len = bg_len;
 				reg->next = NULL;
@@ -558,7 +879,7 @@ void get_next_region(struct block_allocation *alloc)
 /* Returns the number of free blocks in a block group */
 u32 get_free_blocks(u32 bg)
 {
-	return aux_info.bgs[bg].free_blocks;
+	return aux_info.bgs[bg].free_blocks + aux_info.bgs[bg].skipped_blocks;
 }
 
 int last_region(struct block_allocation *alloc)
@@ -587,7 +908,7 @@ static struct region *do_split_allocation(struct block_allocation *alloc, u32 le
 		return NULL;
 
 	if (len > 0) {
-		new = malloc(sizeof(struct region));
+		new = new_region();
 
 		new->bg = reg->bg;
 		new->block = reg->block + len;
@@ -671,6 +992,42 @@ int advance_oob_blocks(struct block_allocation *alloc, int blocks)
 	return advance_list_ptr(&alloc->oob_list, blocks);
 }
 
+void append_oob_region(struct block_allocation *alloc,
+		u32 block, u32 len, int bg_num)
+{
+	struct region *reg;
+	reg = new_region();
+	reg->block = block;
+	reg->len = len;
+	reg->bg = bg_num;
+	reg->next = NULL;
+
+	region_list_append(&alloc->oob_list, reg);
+}
+
+/* Allocates len more blocks at the end of alloc */
+int extend_allocation(struct block_allocation *alloc, u32 len)
+{
+	struct region *reg = do_allocate(len);
+	struct region *next;
+
+	if (reg == NULL) {
+		error("failed to allocate %d blocks", len);
+		return -1;
+	}
+
+	/* allocate_blocks() only points list.last at the first region */
+	while (alloc->list.last && alloc->list.last->next)
+		alloc->list.last = alloc->list.last->next;
+
+	for (; reg; reg = next) {
+		next = reg->next;
+		region_list_append(&alloc->list, reg);
+	}
+
+	return 0;
+}
+
 int append_oob_allocation(struct block_allocation *alloc, u32 len)
 {
 	struct region *reg = do_allocate(len);
@@ -698,9 +1055,10 @@ struct ext4_inode *get_inode(u32 inode)
 		info.inode_size);
 }
 
-struct ext4_xattr_header *get_xattr_block_for_inode(struct ext4_inode *inode)
+struct ext4_xattr_header *get_xattr_block_for_inode(u32 inode_num,
+		struct ext4_inode *inode)
 {
-	struct ext4_xattr_header *block = xattr_list_find(inode);
+	struct ext4_xattr_header *block = xattr_list_find(inode_num);
 	if (block != NULL)
 		return block;
 
@@ -723,23 +1081,20 @@ struct ext4_xattr_header *get_xattr_block_for_inode(struct ext4_inode *inode)
 		free(block);
 		return NULL;
 	}
-	xattr_list_insert(inode, block);
+	xattr_list_insert(inode_num, block);
 	return block;
 }
 
 /* Mark the first len inodes in a block group as used */
 u32 reserve_inodes(int bg, u32 num)
 {
-	unsigned int i;
 	u32 inode;
 
 	if (get_free_inodes(bg) < num)
 		return EXT4_ALLOCATE_FAILED;
 
-	for (i = 0; i < num; i++) {
-		inode = aux_info.bgs[bg].first_free_inode + i - 1;
-		aux_info.bgs[bg].inode_bitmap[inode / 8] |= 1 << (inode % 8);
-	}
+	bitmap_set_range(aux_info.bgs[bg].inode_bitmap,
+			aux_info.bgs[bg].first_free_inode - 1, num);
 
 	inode = aux_info.bgs[bg].first_free_inode;
 
@@ -756,10 +1111,12 @@ u32 allocate_inode()
 	unsigned int bg;
 	u32 inode;
 
-	for (bg = 0; bg < aux_info.groups; bg++) {
+	for (bg = bg_index.first_free_inode_bg; bg < aux_info.groups; bg++) {
 		inode = reserve_inodes(bg, 1);
-		if (inode != EXT4_ALLOCATE_FAILED)
+		if (inode != EXT4_ALLOCATE_FAILED) {
+			bg_index.first_free_inode_bg = bg;
 			return bg * info.inodes_per_group + inode;
+		}
 	}
 
 	return EXT4_ALLOCATE_FAILED;
@@ -790,7 +1147,7 @@ u16 get_bg_flags(int bg)
 	return aux_info.bgs[bg].flags;
 }
 
-/* Frees the memory used by a linked list of allocation regions */
+/* Returns an allocation and its regions to the arena's free lists */
 void free_alloc(struct block_allocation *alloc)
 {
 	struct region *reg;
@@ -798,16 +1155,17 @@ void free_alloc(struct block_allocation *alloc)
 	reg = alloc->list.first;
 	while (reg) {
 		struct region *next = reg->next;
-		free(reg);
+		release_region(reg);
 		reg = next;
 	}
 
 	reg = alloc->oob_list.first;
 	while (reg) {
 		struct region *next = reg->next;
-		free(reg);
+		release_region(reg);
 		reg = next;
 	}
 
-	free(alloc);
+	alloc->next = arena.free_allocs;
+	arena.free_allocs = alloc;
 }
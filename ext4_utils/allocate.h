@@ -32,7 +32,9 @@ struct block_allocation *allocate_blocks(u32 len);
 int block_allocation_num_regions(struct block_allocation *alloc);
 int block_allocation_len(struct block_allocation *alloc);
 struct ext4_inode *get_inode(u32 inode);
-struct ext4_xattr_header *get_xattr_block_for_inode(struct ext4_inode *inode);
+struct ext4_xattr_header *get_xattr_block_for_inode(u32 inode_num,
+	struct ext4_inode *inode);
+void flush_inode_tables(void);
 void reduce_allocation(struct block_allocation *alloc, u32 len);
 u32 get_block(struct block_allocation *alloc, u32 block);
 u32 get_oob_block(struct block_allocation *alloc, u32 block);
@@ -55,6 +57,12 @@ void rewind_alloc(struct block_allocation *alloc);
 void append_region(struct block_allocation *alloc,
 	u32 block, u32 len, int bg);
 struct block_allocation *create_allocation();
+void append_oob_region(struct block_allocation *alloc,
+	u32 block, u32 len, int bg);
+int extend_allocation(struct block_allocation *alloc, u32 len);
 int append_oob_allocation(struct block_allocation *alloc, u32 len);
+int pin_blocks(u32 block, u32 len);
+void unpin_blocks(u32 block, u32 len);
+void release_allocation(struct block_allocation *alloc);
 
 #endif
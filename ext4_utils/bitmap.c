@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "bitmap.h"
+
+#include <string.h>
+
+#define BITS_PER_WORD 64
+
+/* Words are loaded with memcpy() as bitmaps need not be aligned, and
+   byte swapped on big endian hosts so that bit n of a word is always bit
+   n of the bitmap */
+static inline u64 load_word(const u8 *bitmap, u32 word)
+{
+	u64 w;
+
+	memcpy(&w, bitmap + word * sizeof(u64), sizeof(u64));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+static inline void store_word(u8 *bitmap, u32 word, u64 w)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	memcpy(bitmap + word * sizeof(u64), &w, sizeof(u64));
+}
+
+/* Mask of the bits from bit % 64 up in bit's word */
+static inline u64 head_mask(u32 bit)
+{
+	return ~0ULL << (bit % BITS_PER_WORD);
+}
+
+/* Mask of the bits up to and including bit % 64 in bit's word */
+static inline u64 tail_mask(u32 bit)
+{
+	return ~0ULL >> (BITS_PER_WORD - 1 - bit % BITS_PER_WORD);
+}
+
+static void bitmap_fill_range(u8 *bitmap, u32 start, u32 len, int set)
+{
+	u32 first, last;
+	u64 mask;
+	u64 w;
+
+	if (len == 0)
+		return;
+
+	first = start / BITS_PER_WORD;
+	last = (start + len - 1) / BITS_PER_WORD;
+
+	mask = head_mask(start);
+	if (first == last)
+		mask &= tail_mask(start + len - 1);
+	w = load_word(bitmap, first);
+	store_word(bitmap, first, set ? w | mask : w & ~mask);
+	if (first == last)
+		return;
+
+	memset(bitmap + (first + 1) * sizeof(u64), set ? 0xff : 0,
+			(last - first - 1) * sizeof(u64));
+
+	mask = tail_mask(start + len - 1);
+	w = load_word(bitmap, last);
+	store_word(bitmap, last, set ? w | mask : w & ~mask);
+}
+
+void bitmap_set_range(u8 *bitmap, u32 start, u32 len)
+{
+	bitmap_fill_range(bitmap, start, len, 1);
+}
+
+void bitmap_clear_range(u8 *bitmap, u32 start, u32 len)
+{
+	bitmap_fill_range(bitmap, start, len, 0);
+}
+
+/* invert is 0 to find a set bit, or ~0 to find a clear one */
+static u32 bitmap_find_next(const u8 *bitmap, u32 start, u32 end, u64 invert)
+{
+	u32 word;
+	u32 bit;
+	u64 w;
+
+	if (start >= end)
+		return end;
+
+	word = start / BITS_PER_WORD;
+	w = (load_word(bitmap, word) ^ invert) & head_mask(start);
+	while (!w) {
+		word++;
+		if (word * BITS_PER_WORD >= end)
+			return end;
+		w = load_word(bitmap, word) ^ invert;
+	}
+
+	bit = word * BITS_PER_WORD + __builtin_ctzll(w);
+	return min(bit, end);
+}
+
+u32 bitmap_find_next_set(const u8 *bitmap, u32 start, u32 end)
+{
+	return bitmap_find_next(bitmap, start, end, 0);
+}
+
+u32 bitmap_find_next_clear(const u8 *bitmap, u32 start, u32 end)
+{
+	return bitmap_find_next(bitmap, start, end, ~0ULL);
+}
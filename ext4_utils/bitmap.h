@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include "ext4_utils.h"
+
+/* Block and inode bitmaps, in the on-disk layout: bit n is bit n % 8 of
+   byte n / 8.  The range functions work a 64 bit word at a time and may
+   read or write the whole word containing any bit in the range, so the
+   bitmap must be a multiple of 8 bytes long, as whole blocks always are. */
+
+static inline int bitmap_get_bit(const u8 *bitmap, u32 bit)
+{
+	return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+static inline void bitmap_set_bit(u8 *bitmap, u32 bit)
+{
+	bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void bitmap_clear_bit(u8 *bitmap, u32 bit)
+{
+	bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* Sets or clears the len bits starting at start */
+void bitmap_set_range(u8 *bitmap, u32 start, u32 len);
+void bitmap_clear_range(u8 *bitmap, u32 start, u32 len);
+
+/* Return the first set or clear bit in [start, end), or end if there is
+   none */
+u32 bitmap_find_next_set(const u8 *bitmap, u32 start, u32 end);
+u32 bitmap_find_next_clear(const u8 *bitmap, u32 start, u32 end);
+
+#endif
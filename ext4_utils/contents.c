@@ -172,6 +172,21 @@ u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 
 /* Creates a file on disk.  Returns the inode number of the new file */
 u32 make_file(const char *filename, u64 len)
+{
+	struct block_allocation *alloc = NULL;
+	u32 inode_num;
+
+	inode_num = make_file_at(filename, len, &alloc);
+	if (alloc)
+		free_alloc(alloc);
+
+	return inode_num;
+}
+
+/* Creates a file on disk in the blocks of *alloc, or in new blocks if *alloc
+   is NULL.  Returns the inode number of the new file, and sets *alloc to the
+   blocks used, which the caller frees. */
+u32 make_file_at(const char *filename, u64 len, struct block_allocation **alloc)
 {
 	struct ext4_inode *inode;
 	u32 inode_num;
@@ -189,7 +204,7 @@ u32 make_file(const char *filename, u64 len)
 	}
 
 	if (len > 0)
-		inode_allocate_file_extents(inode, len, filename);
+		*alloc = inode_place_file_extents(inode, len, filename, *alloc);
 
 	inode->i_mode = S_IFREG;
 	inode->i_links_count = 1;
@@ -234,6 +249,20 @@ u32 make_link(const char *link)
 	return inode_num;
 }
 
+/* Adds a directory entry to an existing inode.  Returns -1 if the inode
+   can't have any more links */
+int inode_add_link(u32 inode_num)
+{
+	struct ext4_inode *inode = get_inode(inode_num);
+
+	if (!inode || inode->i_links_count >= EXT4_LINK_MAX)
+		return -1;
+
+	inode->i_links_count++;
+
+	return 0;
+}
+
 int inode_set_permissions(u32 inode_num, u16 mode, u16 uid, u16 gid, u32 mtime)
 {
 	struct ext4_inode *inode = get_inode(inode_num);
@@ -414,10 +443,10 @@ static int xattr_addto_inode(struct ext4_inode *inode, int name_index,
 	return 0;
 }
 
-static int xattr_addto_block(struct ext4_inode *inode, int name_index,
-		const char *name, const void *value, size_t value_len)
+static int xattr_addto_block(u32 inode_num, struct ext4_inode *inode,
+		int name_index, const char *name, const void *value, size_t value_len)
 {
-	struct ext4_xattr_header *header = get_xattr_block_for_inode(inode);
+	struct ext4_xattr_header *header = get_xattr_block_for_inode(inode_num, inode);
 	if (!header)
 		return -1;
 
@@ -448,7 +477,8 @@ static int xattr_add(u32 inode_num, int name_index, const char *name,
 
 	int result = xattr_addto_inode(inode, name_index, name, value, value_len);
 	if (result != 0) {
-		result = xattr_addto_block(inode, name_index, name, value, value_len);
+		result = xattr_addto_block(inode_num, inode, name_index, name,
+				value, value_len);
 	}
 	return result;
 }
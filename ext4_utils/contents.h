@@ -17,6 +17,8 @@
 #ifndef _DIRECTORY_H_
 #define _DIRECTORY_H_
 
+struct block_allocation;
+
 struct dentry {
 	char *path;
 	char *full_path;
@@ -31,12 +33,20 @@ struct dentry {
 	u32 mtime;
 	char *secon;
 	uint64_t capabilities;
+	/* Identify regular files with more than one link on disk */
+	u64 dev;
+	u64 ino;
+	u32 nlink;
+	/* Blocks allocated for a regular file before the file is made */
+	struct block_allocation *alloc;
 };
 
 u32 make_directory(u32 dir_inode_num, u32 entries, struct dentry *dentries,
 	u32 dirs);
 u32 make_file(const char *filename, u64 len);
+u32 make_file_at(const char *filename, u64 len, struct block_allocation **alloc);
 u32 make_link(const char *link);
+int inode_add_link(u32 inode_num);
 int inode_set_permissions(u32 inode_num, u16 mode, u16 uid, u16 gid, u32 mtime);
 int inode_set_selinux(u32 inode_num, const char *secon);
 int inode_set_capabilities(u32 inode_num, uint64_t capabilities);
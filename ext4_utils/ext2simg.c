@@ -30,6 +30,7 @@
 #include "ext4_utils.h"
 #include "make_ext4fs.h"
 #include "allocate.h"
+#include "bitmap.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
 #define off64_t off_t
@@ -105,19 +106,11 @@ static int read_ext(int fd)
 	return 0;
 }
 
-static int bitmap_get_bit(u8 *bitmap, u32 bit)
-{
-	if (bitmap[bit / 8] & 1 << (bit % 8))
-		return 1;
-
-	return 0;
-}
-
 static int build_sparse_ext(int fd, const char *filename)
 {
 	unsigned int i;
-	unsigned int block;
-	int start_contiguous_block;
+	u32 start_block;
+	u32 end_block;
 	u8 *block_bitmap;
 	off64_t ret;
 
@@ -144,30 +137,14 @@ static int build_sparse_ext(int fd, const char *filename)
 		if (ret != (int)info.block_size)
 			critical_error("failed to read all of block group bitmap %d", i);
 
-		start_contiguous_block = -1;
-		for (block = 0; block < last_block; block++) {
-			if (start_contiguous_block >= 0) {
-				if (!bitmap_get_bit(block_bitmap, block)) {
-					u32 start_block = first_block + start_contiguous_block;
-					u32 len_blocks = block - start_contiguous_block;
-
-					sparse_file_add_file(info.sparse_file, filename,
-							(u64)info.block_size * start_block,
-							info.block_size * len_blocks, start_block);
-					start_contiguous_block = -1;
-				}
-			} else {
-				if (bitmap_get_bit(block_bitmap, block))
-					start_contiguous_block = block;
-			}
-		}
-
-		if (start_contiguous_block >= 0) {
-			u32 start_block = first_block + start_contiguous_block;
-			u32 len_blocks = last_block - start_contiguous_block;
+		start_block = bitmap_find_next_set(block_bitmap, 0, last_block);
+		while (start_block < last_block) {
+			end_block = bitmap_find_next_clear(block_bitmap, start_block, last_block);
 			sparse_file_add_file(info.sparse_file, filename,
-					(u64)info.block_size * start_block,
-					info.block_size * len_blocks, start_block);
+					(u64)info.block_size * (first_block + start_block),
+					info.block_size * (end_block - start_block),
+					first_block + start_block);
+			start_block = bitmap_find_next_set(block_bitmap, end_block, last_block);
 		}
 	}
 
@@ -19,6 +19,7 @@
 #include "allocate.h"
 #include "indirect.h"
 #include "extent.h"
+#include "gzip_image.h"
 
 #include <sparse/sparse.h>
 
@@ -84,6 +85,12 @@ int ext4_bg_has_super_block(int bg)
 /* Write the filesystem image to a file */
 void write_ext4_image(int fd, int gz, int sparse, int crc)
 {
+#ifndef USE_MINGW
+	if (gz && gzip_threads > 0) {
+		write_gzip_image(fd, sparse, crc);
+		return;
+	}
+#endif
 	sparse_file_write(info.sparse_file, fd, gz, sparse, crc);
 }
 
@@ -337,9 +344,13 @@ void ext4_create_journal_inode()
 		return;
 	}
 
+	/* In low memory mode only the journal superblock is queued, and the
+	   rest of the journal is not written, as with mke2fs -E
+	   lazy_journal_init.  The journal is empty, so it is never replayed. */
 	u8 *journal_data = inode_allocate_data_extents(inode,
 			info.journal_blocks * info.block_size,
-			info.journal_blocks * info.block_size);
+			info.low_memory ? info.block_size :
+				info.journal_blocks * info.block_size);
 	if (!journal_data) {
 		error("failed to allocate extents for journal data");
 		return;
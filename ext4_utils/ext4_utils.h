@@ -55,6 +55,8 @@ static inline void *mmap64(void *addr, size_t length, int prot, int flags,
 #endif
 
 extern int force;
+extern int scan_threads;
+extern int gzip_threads;
 
 #define warn(fmt, args...) do { fprintf(stderr, "warning: %s: " fmt "\n", __func__, ## args); } while (0)
 #define error(fmt, args...) do { fprintf(stderr, "error: %s: " fmt "\n", __func__, ## args); if (!force) longjmp(setjmp_env, EXIT_FAILURE); } while (0)
@@ -69,6 +71,10 @@ extern int force;
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #define DIV_ROUND_UP(x, y) (((x) + (y) - 1)/(y))
 #define ALIGN(x, y) ((y) * DIV_ROUND_UP((x), (y)))
 
@@ -129,6 +135,14 @@ struct fs_info {
 	u32 bg_desc_reserve_blocks;
 	const char *label;
 	u8 no_journal;
+	u8 low_memory;
+	u8 detect_zeros;
+	/* Manifest of the files in the image to write, and of a previous
+	 * image whose file placement should be kept where possible */
+	const char *manifest;
+	const char *base_manifest;
+	/* List of files whose data is allocated first, in that order */
+	const char *order_file;
 
 	struct sparse_file *sparse_file;
 };
@@ -148,6 +162,8 @@ struct fs_aux_info {
 	u32 blocks_per_ind;
 	u32 blocks_per_dind;
 	u32 blocks_per_tind;
+	/* Backing for the inode tables in low memory mode */
+	int scratch_fd;
 };
 
 extern struct fs_info info;
@@ -17,6 +17,7 @@
 #include "make_ext4fs.h"
 #include "ext4_extents.h"
 #include "allocate.h"
+#include "bitmap.h"
 #include "ext4fixup.h"
 
 #include <sparse/sparse.h>
@@ -320,26 +321,11 @@ static int write_block(int fd, unsigned long long block_num, void *block)
     return 0;
 }
 
-static int bitmap_get_bit(u8 *bitmap, u32 bit)
-{
-        if (bitmap[bit / 8] & (1 << (bit % 8)))
-                return 1;
-
-        return 0;
-}
-
-static void bitmap_clear_bit(u8 *bitmap, u32 bit)
-{
-        bitmap[bit / 8] &= ~(1 << (bit % 8));
-
-        return;
-}
-
 static void check_inode_bitmap(int fd, unsigned int bg_num)
 {
     unsigned int inode_bitmap_block_num;
     unsigned char block[MAX_EXT4_BLOCK_SIZE];
-    int i, bitmap_updated = 0;
+    int bitmap_updated = 0;
 
     /* Using the bg_num, aux_info.bg_desc[], info.inodes_per_group and
      * new_inodes_per_group, retrieve the inode bitmap, and make sure
@@ -349,11 +335,11 @@ static void check_inode_bitmap(int fd, unsigned int bg_num)
 
     read_block(fd, inode_bitmap_block_num, block);
 
-    for (i = info.inodes_per_group; i < new_inodes_per_group; i++) {
-        if (bitmap_get_bit(block, i)) {
-            bitmap_clear_bit(block, i);
-            bitmap_updated = 1;
-        }
+    if (bitmap_find_next_set(block, info.inodes_per_group, new_inodes_per_group) <
+            (u32)new_inodes_per_group) {
+        bitmap_clear_range(block, info.inodes_per_group,
+                           new_inodes_per_group - info.inodes_per_group);
+        bitmap_updated = 1;
     }
 
     if (bitmap_updated) {
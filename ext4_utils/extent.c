@@ -21,9 +21,14 @@
 
 #include <sparse/sparse.h>
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifndef USE_MINGW /* O_BINARY is windows-specific flag */
+#define O_BINARY 0
+#endif
+
 
 /* Creates data buffers for the first backing_len bytes of a block allocation
    and queues them to be written */
@@ -51,12 +56,178 @@ static u8 *extent_create_backing(struct block_allocation *alloc,
 	return data;
 }
 
+/* Size of the reads used to look for zero blocks in a file */
+#define ZERO_SCAN_CHUNK (1024 * 1024)
+
+/* Longest run that fits in the length of a single sparse chunk */
+#define BACKING_RUN_MAX (UINT32_MAX / info.block_size * info.block_size)
+
+/* A run of blocks of a file that are either all zero or contain data */
+struct backing_run {
+	int zero;
+	off64_t offset;
+	u64 len;
+	u32 block;
+};
+
+static void queue_backing_run(struct backing_run *run, const char *filename)
+{
+	if (run->len == 0)
+		return;
+
+	if (run->zero)
+		sparse_file_add_fill(info.sparse_file, 0,
+				DIV_ROUND_UP(run->len, info.block_size) * info.block_size,
+				run->block);
+	else
+		sparse_file_add_file(info.sparse_file, filename, run->offset,
+				run->len, run->block);
+	run->len = 0;
+}
+
+/* Adds len bytes at offset in the file, which start at block, to the current
+   run, queueing the run first if it can't be extended */
+static void add_backing_run(struct backing_run *run, const char *filename,
+	int zero, off64_t offset, u64 len, u32 block)
+{
+	if (run->len > 0 && (run->zero != zero ||
+			run->block + run->len / info.block_size != block ||
+			run->len + len > BACKING_RUN_MAX))
+		queue_backing_run(run, filename);
+
+	if (run->len == 0) {
+		run->zero = zero;
+		run->offset = offset;
+		run->block = block;
+	}
+	run->len += len;
+}
+
+static int is_zero(const u8 *buf, u32 len)
+{
+	const u64 *words = (const u64 *)buf;
+	u64 acc = 0;
+	u32 i;
+
+	/* or-ing whole words lets the compiler vectorize the loop */
+	for (i = 0; i < len / sizeof(u64); i++)
+		acc |= words[i];
+	for (i = i * sizeof(u64); i < len; i++)
+		acc |= buf[i];
+
+	return acc == 0;
+}
+
+/* Returns the number of bytes from offset, at most len, that are known to be
+   in a hole, or -1 if offset is in data or holes can't be detected.  Sets
+   *data_len to the number of bytes before the next hole. */
+static s64 find_hole(int fd, off64_t offset, u64 len, u64 *data_len)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off64_t data = lseek64(fd, offset, SEEK_DATA);
+	if (data < 0) {
+		/* no data past offset */
+		if (errno == ENXIO)
+			return len;
+		*data_len = len;
+		return -1;
+	}
+	if (data > offset)
+		return min((u64)(data - offset), len);
+
+	off64_t hole = lseek64(fd, offset, SEEK_HOLE);
+	*data_len = hole > offset ? min((u64)(hole - offset), len) : len;
+	return -1;
+#else
+	*data_len = len;
+	return -1;
+#endif
+}
+
+static void read_file_chunk(int fd, u8 *buf, u32 len, off64_t offset,
+	const char *filename)
+{
+	u32 done;
+	ssize_t ret;
+
+	if (lseek64(fd, offset, SEEK_SET) < 0)
+		critical_error_errno("lseek64");
+
+	for (done = 0; done < len; done += ret) {
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0)
+			critical_error_errno("reading %s", filename);
+		else if (ret == 0)
+			critical_error("%s changed while reading", filename);
+	}
+}
+
+/* Queues a chunk of a file to be written to a contiguous data block region,
+   queueing zero fill chunks instead of the data for blocks that are zero */
+static void extent_create_backing_file_region(int fd, u8 *buf,
+	struct backing_run *run, const char *filename, off64_t offset, u64 len,
+	u32 block)
+{
+	u32 block_size = info.block_size;
+
+	while (len > 0) {
+		u64 data_len = len;
+		s64 hole_len = find_hole(fd, offset, len, &data_len);
+		u64 chunk_len;
+		u64 i;
+
+		/* only whole blocks in a hole can be filled, a block shared
+		   with data is read below */
+		if (hole_len >= 0) {
+			chunk_len = (u64)hole_len == len ? len :
+				(u64)hole_len / block_size * block_size;
+			if (chunk_len > 0) {
+				add_backing_run(run, filename, 1, offset,
+						chunk_len, block);
+				offset += chunk_len;
+				len -= chunk_len;
+				block += chunk_len / block_size;
+				continue;
+			}
+		}
+
+		chunk_len = min(DIV_ROUND_UP(data_len, block_size) * block_size,
+				ZERO_SCAN_CHUNK);
+		chunk_len = min(chunk_len, len);
+
+		read_file_chunk(fd, buf, chunk_len, offset, filename);
+
+		for (i = 0; i < chunk_len; i += block_size) {
+			u32 block_len = min(chunk_len - i, block_size);
+			add_backing_run(run, filename, is_zero(buf + i, block_len),
+					offset + i, block_len, block++);
+		}
+		offset += chunk_len;
+		len -= chunk_len;
+	}
+}
+
 /* Queues each chunk of a file to be written to contiguous data block
    regions */
 static void extent_create_backing_file(struct block_allocation *alloc,
 	u64 backing_len, const char *filename)
 {
 	off64_t offset = 0;
+	struct backing_run run = { 0 };
+	u8 *buf = NULL;
+	int fd = -1;
+
+	if (info.detect_zeros) {
+		fd = open(filename, O_RDONLY | O_BINARY);
+		if (fd < 0)
+			critical_error_errno("open %s", filename);
+		buf = malloc(ZERO_SCAN_CHUNK);
+		if (!buf)
+			critical_error_errno("malloc");
+	}
+
 	for (; alloc != NULL && backing_len > 0; get_next_region(alloc)) {
 		u32 region_block;
 		u32 region_len;
@@ -65,35 +236,37 @@ static void extent_create_backing_file(struct block_allocation *alloc,
 
 		len = min(region_len * info.block_size, backing_len);
 
-		sparse_file_add_file(info.sparse_file, filename, offset, len,
-				region_block);
+		if (fd >= 0)
+			extent_create_backing_file_region(fd, buf, &run,
+					filename, offset, len, region_block);
+		else
+			sparse_file_add_file(info.sparse_file, filename, offset,
+					len, region_block);
 		offset += len;
 		backing_len -= len;
 	}
+
+	if (fd >= 0) {
+		queue_backing_run(&run, filename);
+		free(buf);
+		close(fd);
+	}
 }
 
-static struct block_allocation *do_inode_allocate_extents(
-	struct ext4_inode *inode, u64 len)
+/* Connects the blocks of alloc to an inode, using the out of band block of
+   alloc for the extents if it has one */
+static struct block_allocation *do_inode_attach_extents(
+	struct ext4_inode *inode, struct block_allocation *alloc,
+	int allocation_len, u64 len)
 {
 	u32 block_len = DIV_ROUND_UP(len, info.block_size);
-	struct block_allocation *alloc = allocate_blocks(block_len + 1);
-	u32 extent_block = 0;
+	u32 extent_block = get_oob_block(alloc, 0);
 	u32 file_block = 0;
 	struct ext4_extent *extent;
 	u64 blocks;
 
-	if (alloc == NULL) {
-		error("Failed to allocate %d blocks\n", block_len + 1);
-		return NULL;
-	}
-
-	int allocation_len = block_allocation_num_regions(alloc);
-	if (allocation_len <= 3) {
-		reduce_allocation(alloc, 1);
-	} else {
-		reserve_oob_blocks(alloc, 1);
-		extent_block = get_oob_block(alloc, 0);
-	}
+	if (extent_block == EXT4_ALLOCATE_FAILED)
+		extent_block = 0;
 
 	if (!extent_block) {
 		struct ext4_extent_header *hdr =
@@ -175,6 +348,26 @@ static struct block_allocation *do_inode_allocate_extents(
 	return alloc;
 }
 
+static struct block_allocation *do_inode_allocate_extents(
+	struct ext4_inode *inode, u64 len)
+{
+	u32 block_len = DIV_ROUND_UP(len, info.block_size);
+	struct block_allocation *alloc = allocate_blocks(block_len + 1);
+
+	if (alloc == NULL) {
+		error("Failed to allocate %d blocks\n", block_len + 1);
+		return NULL;
+	}
+
+	int allocation_len = block_allocation_num_regions(alloc);
+	if (allocation_len <= 3)
+		reduce_allocation(alloc, 1);
+	else
+		reserve_oob_blocks(alloc, 1);
+
+	return do_inode_attach_extents(inode, alloc, allocation_len, len);
+}
+
 /* Allocates enough blocks to hold len bytes, with backing_len bytes in a data
    buffer, and connects them to an inode.  Returns a pointer to the data
    buffer. */
@@ -208,15 +401,42 @@ void inode_allocate_file_extents(struct ext4_inode *inode, u64 len,
 {
 	struct block_allocation *alloc;
 
-	alloc = do_inode_allocate_extents(inode, len);
+	alloc = inode_place_file_extents(inode, len, filename, NULL);
+	if (alloc)
+		free_alloc(alloc);
+}
+
+/* Same as inode_allocate_file_extents, but starts with the blocks in alloc
+   if it is set, and uses its out of band block for the extents if it has
+   one.  Blocks are added to alloc if it is too short.  Returns the
+   allocation, which the caller frees. */
+struct block_allocation *inode_place_file_extents(struct ext4_inode *inode,
+	u64 len, const char *filename, struct block_allocation *alloc)
+{
+	u32 block_len = DIV_ROUND_UP(len, info.block_size);
+	u32 alloc_len;
+
+	if (alloc) {
+		alloc_len = block_allocation_len(alloc);
+		if (alloc_len < block_len &&
+				extend_allocation(alloc, block_len - alloc_len) < 0)
+			return NULL;
+		if (block_allocation_num_regions(alloc) > 3 &&
+				get_oob_block(alloc, 0) == EXT4_ALLOCATE_FAILED &&
+				append_oob_allocation(alloc, 1) < 0)
+			return NULL;
+		alloc = do_inode_attach_extents(inode, alloc,
+				block_allocation_num_regions(alloc), len);
+	} else
+		alloc = do_inode_allocate_extents(inode, len);
 	if (alloc == NULL) {
 		error("failed to allocate extents for %llu bytes", len);
-		return;
+		return NULL;
 	}
 
 	extent_create_backing_file(alloc, len, filename);
 
-	free_alloc(alloc);
+	return alloc;
 }
 
 /* Allocates enough blocks to hold len bytes and connects them to an inode */
@@ -23,6 +23,8 @@
 void inode_allocate_extents(struct ext4_inode *inode, u64 len);
 void inode_allocate_file_extents(struct ext4_inode *inode, u64 len,
 	const char *filename);
+struct block_allocation *inode_place_file_extents(struct ext4_inode *inode,
+	u64 len, const char *filename, struct block_allocation *alloc);
 u8 *inode_allocate_data_extents(struct ext4_inode *inode, u64 len,
 	u64 backing_len);
 void free_extent_blocks();
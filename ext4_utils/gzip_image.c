@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "gzip_image.h"
+
+#include <sparse/sparse.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Number of threads used to compress a gzipped image, or 0 to let libsparse
+   compress it on the calling thread */
+int gzip_threads = 0;
+
+#ifndef USE_MINGW
+
+#include <pthread.h>
+
+/* The image is compressed the way pigz does it.  libsparse streams the
+   sparse or raw image to write_callback() on the calling thread, which cuts
+   it into blocks of GZIP_BLOCK_SIZE bytes and queues them for the
+   compression threads.  Each block is deflated on its own, with the 32 KiB
+   before it as the dictionary, and ends with a sync flush, except for the
+   last which finishes the stream.  The calling thread writes the compressed
+   blocks in order as they complete, and combines their CRCs for the gzip
+   trailer.
+
+   The output is a single gzip member that only depends on the image and
+   GZIP_LEVEL, not on the number of threads or the order they finish in.
+   It differs from what libsparse writes by itself, so it is only used
+   when gzip_threads is set. */
+
+#define GZIP_BLOCK_SIZE (256 * 1024)
+#define GZIP_DICT_SIZE 32768
+/* Same as libsparse */
+#define GZIP_LEVEL 9
+
+struct gzip_block {
+	u8 *in;
+	u32 in_len;
+	u8 dict[GZIP_DICT_SIZE];
+	u32 dict_len;
+	int last;
+
+	u8 *out;
+	u32 out_len;
+	uLong crc;
+	int done;
+	int failed;
+
+	/* Next block to compress, and next block to write */
+	struct gzip_block *next_work;
+	struct gzip_block *next_out;
+};
+
+struct gzip_image {
+	int fd;
+	int failed;
+	int write_errno;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct gzip_block *work_head;
+	struct gzip_block *work_tail;
+	int stop;
+
+	/* Blocks queued and not written yet, oldest first */
+	struct gzip_block *out_head;
+	struct gzip_block *out_tail;
+	int in_flight;
+	int max_in_flight;
+
+	/* Block being filled by write_callback() */
+	struct gzip_block *cur;
+
+	uLong crc;
+	u64 len;
+};
+
+static void free_block(struct gzip_block *block)
+{
+	free(block->in);
+	free(block->out);
+	free(block);
+}
+
+static struct gzip_block *new_block(struct gzip_block *prev)
+{
+	struct gzip_block *block = calloc(1, sizeof(struct gzip_block));
+	if (block == NULL)
+		return NULL;
+
+	block->in = malloc(GZIP_BLOCK_SIZE);
+	if (block->in == NULL) {
+		free(block);
+		return NULL;
+	}
+
+	if (prev) {
+		block->dict_len = min(prev->in_len, GZIP_DICT_SIZE);
+		memcpy(block->dict, prev->in + prev->in_len - block->dict_len,
+				block->dict_len);
+	}
+
+	return block;
+}
+
+static int compress_block(struct gzip_block *block)
+{
+	z_stream strm;
+	u32 size = deflateBound(NULL, block->in_len) + 64;
+	int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, GZIP_LEVEL, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	if (block->dict_len &&
+			deflateSetDictionary(&strm, block->dict, block->dict_len) != Z_OK)
+		goto fail;
+
+	block->out = malloc(size);
+	if (block->out == NULL)
+		goto fail;
+
+	strm.next_in = block->in;
+	strm.avail_in = block->in_len;
+	strm.next_out = block->out;
+	strm.avail_out = size;
+
+	while (1) {
+		ret = deflate(&strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (ret == Z_STREAM_ERROR)
+			goto fail;
+		if (block->last ? ret == Z_STREAM_END :
+				(strm.avail_in == 0 && strm.avail_out > 0))
+			break;
+
+		u8 *out = realloc(block->out, size * 2);
+		if (out == NULL)
+			goto fail;
+		block->out = out;
+		strm.next_out = out + size;
+		strm.avail_out = size;
+		size *= 2;
+	}
+
+	block->out_len = size - strm.avail_out;
+	block->crc = crc32(crc32(0L, Z_NULL, 0), block->in, block->in_len);
+	deflateEnd(&strm);
+	return 0;
+
+fail:
+	deflateEnd(&strm);
+	return -1;
+}
+
+static void *compress_worker(void *arg)
+{
+	struct gzip_image *gz = arg;
+	struct gzip_block *block;
+
+	pthread_mutex_lock(&gz->lock);
+	while (1) {
+		while (!gz->work_head && !gz->stop)
+			pthread_cond_wait(&gz->work_cond, &gz->lock);
+		if (!gz->work_head)
+			break;
+
+		block = gz->work_head;
+		gz->work_head = block->next_work;
+		if (!gz->work_head)
+			gz->work_tail = NULL;
+		pthread_mutex_unlock(&gz->lock);
+
+		int failed = compress_block(block) < 0;
+
+		pthread_mutex_lock(&gz->lock);
+		block->failed = failed;
+		block->done = 1;
+		pthread_cond_broadcast(&gz->done_cond);
+	}
+	pthread_mutex_unlock(&gz->lock);
+
+	return NULL;
+}
+
+static int write_all(struct gzip_image *gz, const void *data, size_t len)
+{
+	const u8 *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(gz->fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			gz->write_errno = ret < 0 ? errno : EIO;
+			gz->failed = 1;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Writes the oldest queued block, waiting for it to be compressed if wait
+   is set.  Returns 1 if a block was written. */
+static int write_oldest_block(struct gzip_image *gz, int wait)
+{
+	struct gzip_block *block;
+
+	pthread_mutex_lock(&gz->lock);
+	block = gz->out_head;
+	while (block && !block->done && wait)
+		pthread_cond_wait(&gz->done_cond, &gz->lock);
+	if (!block || !block->done) {
+		pthread_mutex_unlock(&gz->lock);
+		return 0;
+	}
+	gz->out_head = block->next_out;
+	if (!gz->out_head)
+		gz->out_tail = NULL;
+	gz->in_flight--;
+	pthread_mutex_unlock(&gz->lock);
+
+	if (block->failed)
+		gz->failed = 1;
+	if (!gz->failed) {
+		write_all(gz, block->out, block->out_len);
+		gz->crc = crc32_combine(gz->crc, block->crc, block->in_len);
+		gz->len += block->in_len;
+	}
+	free_block(block);
+
+	return 1;
+}
+
+static void queue_block(struct gzip_image *gz, struct gzip_block *block)
+{
+	pthread_mutex_lock(&gz->lock);
+	if (gz->work_tail)
+		gz->work_tail->next_work = block;
+	else
+		gz->work_head = block;
+	gz->work_tail = block;
+
+	if (gz->out_tail)
+		gz->out_tail->next_out = block;
+	else
+		gz->out_head = block;
+	gz->out_tail = block;
+	gz->in_flight++;
+
+	pthread_cond_signal(&gz->work_cond);
+	pthread_mutex_unlock(&gz->lock);
+
+	/* Write what is ready, and keep the number of blocks in memory bounded */
+	while (write_oldest_block(gz, gz->in_flight >= gz->max_in_flight))
+		;
+}
+
+/* Called by libsparse with the image, data is NULL for len zero bytes */
+static int write_callback(void *priv, const void *data, int len)
+{
+	struct gzip_image *gz = priv;
+	struct gzip_block *block;
+	u32 n;
+
+	while (len > 0 && !gz->failed) {
+		if (gz->cur->in_len == GZIP_BLOCK_SIZE) {
+			block = new_block(gz->cur);
+			if (block == NULL) {
+				gz->failed = 1;
+				break;
+			}
+			queue_block(gz, gz->cur);
+			gz->cur = block;
+		}
+
+		n = min((u32)len, GZIP_BLOCK_SIZE - gz->cur->in_len);
+		if (data) {
+			memcpy(gz->cur->in + gz->cur->in_len, data, n);
+			data = (const u8 *)data + n;
+		} else {
+			memset(gz->cur->in + gz->cur->in_len, 0, n);
+		}
+		gz->cur->in_len += n;
+		len -= n;
+	}
+
+	return gz->failed ? -1 : 0;
+}
+
+static void put_le32(u8 *p, u32 val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+/* Writes the image gzipped, compressing on gzip_threads threads */
+int write_gzip_image(int fd, int sparse, int crc)
+{
+	static const u8 header[10] = {
+		0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 2 /* best compression */, 3 /* unix */
+	};
+	struct gzip_image gz;
+	pthread_t *threads;
+	int nthreads = gzip_threads;
+	u8 trailer[8];
+	int ret;
+	int i;
+
+	memset(&gz, 0, sizeof(gz));
+	gz.fd = fd;
+	gz.crc = crc32(0L, Z_NULL, 0);
+	gz.max_in_flight = 2 * nthreads;
+	pthread_mutex_init(&gz.lock, NULL);
+	pthread_cond_init(&gz.work_cond, NULL);
+	pthread_cond_init(&gz.done_cond, NULL);
+
+	threads = calloc(nthreads, sizeof(pthread_t));
+	gz.cur = new_block(NULL);
+	if (threads == NULL || gz.cur == NULL)
+		critical_error_errno("calloc");
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, compress_worker, &gz)) {
+			if (i == 0)
+				critical_error("failed to start compression thread");
+			nthreads = i;
+			break;
+		}
+	}
+
+	write_all(&gz, header, sizeof(header));
+
+	ret = sparse_file_callback(info.sparse_file, sparse, crc, write_callback, &gz);
+	if (ret < 0)
+		gz.failed = 1;
+
+	/* The last block finishes the stream, even if it is empty */
+	gz.cur->last = 1;
+	queue_block(&gz, gz.cur);
+	while (write_oldest_block(&gz, 1))
+		;
+
+	pthread_mutex_lock(&gz.lock);
+	gz.stop = 1;
+	pthread_cond_broadcast(&gz.work_cond);
+	pthread_mutex_unlock(&gz.lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	pthread_cond_destroy(&gz.done_cond);
+	pthread_cond_destroy(&gz.work_cond);
+	pthread_mutex_destroy(&gz.lock);
+
+	if (!gz.failed) {
+		put_le32(trailer, gz.crc);
+		put_le32(trailer + 4, gz.len);
+		write_all(&gz, trailer, sizeof(trailer));
+	}
+
+	if (gz.write_errno) {
+		errno = gz.write_errno;
+		error_errno("write");
+		return -1;
+	}
+	if (gz.failed) {
+		error("failed to compress image");
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif
@@ -18,6 +18,7 @@
 #include "ext4_utils.h"
 #include "allocate.h"
 #include "contents.h"
+#include "manifest.h"
 #include "uuid.h"
 #include "wipe.h"
 
@@ -27,6 +28,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -63,6 +65,8 @@
 #include <selinux/label.h>
 #include <selinux/android.h>
 
+#include <pthread.h>
+
 #define O_BINARY 0
 
 #endif
@@ -99,166 +103,739 @@ static u32 build_default_directory_structure()
 	return root_inode;
 }
 
+/* Number of threads used to scan the source directory, or 0 to use one per
+   online cpu */
+int scan_threads = 0;
+
 #ifndef USE_MINGW
-/* Read a local directory and create the same tree in the generated filesystem.
-   Calls itself recursively with each directory in the given directory.
-   full_path is an absolute or relative path, with a trailing slash, to the
-   directory on disk that should be copied, or NULL if this is a directory
-   that does not exist on disk (e.g. lost+found).
-   dir_path is an absolute path, with trailing slash, to the same directory
-   if the image were mounted at the specified mount point */
-static u32 build_directory_structure(const char *full_path, const char *dir_path,
-		u32 dir_inode, fs_config_func_t fs_config_func,
-		struct selabel_handle *sehnd, int verbose)
-{
-	int entries = 0;
+/* The source directory is copied in two passes.  The scan pass reads the
+   whole tree into scan_dirs using a pool of threads, doing the scandir,
+   lstat, readlink, fs_config and selabel_lookup calls that dominate the
+   time on a cold tree.  The layout pass then walks the result on a single
+   thread in the same order as the directories were always read in, and
+   allocates inodes and blocks for it, so the image does not depend on the
+   number of threads or the order they finish in.
+
+   Nothing in the scan pass can call error(), as longjmp() can only return
+   to setjmp_env on the thread that called make_ext4fs_internal().  Errors
+   are recorded in the scan_dir and reported by the layout pass instead. */
+
+struct scan_status {
+	int lstat_errno;
+	bool unknown_type;
+	bool label_failed;
+};
+
+struct scan_dir {
+	/* Same as the arguments of the old build_directory_structure():
+	   full_path is the directory on disk with a trailing slash, or NULL
+	   if it does not exist on disk (lost+found), and dir_path is where it
+	   will be in the mounted image, also with a trailing slash. */
+	char *full_path;
+	char *dir_path;
+	bool root;
+
+	int scandir_errno;
+	int entries;
+	u32 dirs;
 	struct dentry *dentries;
+	struct scan_status *status;
+	/* The scan of dentries[i] if it is a directory, else NULL */
+	struct scan_dir **subdirs;
+
+	struct scan_dir *next;
+};
+
+struct scan_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Directories waiting to be scanned */
+	struct scan_dir *head;
+	/* Directories queued or being scanned */
+	int pending;
+
+	fs_config_func_t fs_config_func;
+	struct selabel_handle *sehnd;
+};
+
+/* selabel_lookup() updates statistics in the handle, so lookups are made one
+   at a time.  fs_config() only reads static tables and is called without a
+   lock. */
+static pthread_mutex_t selabel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define scan_fatal(s) do { fprintf(stderr, "critical error: %s: %s: %s\n", \
+		__func__, s, strerror(errno)); exit(EXIT_FAILURE); } while (0)
+
+static struct scan_dir *new_scan_dir(char *full_path, char *dir_path, bool root)
+{
+	struct scan_dir *dir = calloc(1, sizeof(struct scan_dir));
+	if (dir == NULL)
+		scan_fatal("calloc");
+
+	dir->full_path = full_path;
+	dir->dir_path = dir_path;
+	dir->root = root;
+
+	return dir;
+}
+
+static void free_scan_dir(struct scan_dir *dir)
+{
+	free(dir->full_path);
+	free(dir->dir_path);
+	free(dir->dentries);
+	free(dir->status);
+	free(dir->subdirs);
+	free(dir);
+}
+
+static void free_dentry(struct dentry *dentry)
+{
+	free(dentry->path);
+	free(dentry->full_path);
+	free(dentry->link);
+	free((void *)dentry->filename);
+	free(dentry->secon);
+}
+
+static void scan_label(struct scan_queue *queue, struct dentry *dentry,
+		struct scan_status *status, int mode)
+{
+	if (!queue->sehnd)
+		return;
+
+	pthread_mutex_lock(&selabel_lock);
+	if (selabel_lookup(queue->sehnd, &dentry->secon, dentry->path, mode) < 0)
+		status->label_failed = true;
+	pthread_mutex_unlock(&selabel_lock);
+}
+
+/* Fills in dir from the disk, and queues its subdirectories */
+static void scan_directory(struct scan_queue *queue, struct scan_dir *dir)
+{
 	struct dirent **namelist = NULL;
+	struct dentry *dentry;
+	struct scan_status *status;
+	struct scan_dir *subdir;
+	struct scan_dir *subdirs = NULL;
 	struct stat stat;
-	int ret;
+	int queued = 0;
+	int entries = 0;
+	int first = 0;
 	int i;
-	u32 inode;
-	u32 entry_inode;
-	u32 dirs = 0;
-	bool needs_lost_and_found = false;
 
-	if (full_path) {
-		entries = scandir(full_path, &namelist, filter_dot, (void*)alphasort);
+	if (dir->full_path) {
+		entries = scandir(dir->full_path, &namelist, filter_dot, (void*)alphasort);
 		if (entries < 0) {
-			error_errno("scandir");
-			return EXT4_ALLOCATE_FAILED;
+			dir->scandir_errno = errno;
+			return;
 		}
 	}
 
-	if (dir_inode == 0) {
+	if (dir->root) {
 		/* root directory, check if lost+found already exists */
 		for (i = 0; i < entries; i++)
 			if (strcmp(namelist[i]->d_name, "lost+found") == 0)
 				break;
 		if (i == entries)
-			needs_lost_and_found = true;
+			first = 1;
 	}
 
-	dentries = calloc(entries, sizeof(struct dentry));
-	if (dentries == NULL)
-		critical_error_errno("malloc");
+	dir->entries = entries + first;
+	dir->dentries = calloc(dir->entries, sizeof(struct dentry));
+	dir->status = calloc(dir->entries, sizeof(struct scan_status));
+	dir->subdirs = calloc(dir->entries, sizeof(struct scan_dir *));
+	if (dir->entries && (!dir->dentries || !dir->status || !dir->subdirs))
+		scan_fatal("calloc");
+
+	if (first) {
+		/* insert a lost+found directory at the beginning of the dentries */
+		dentry = &dir->dentries[0];
+		dentry->filename = strdup("lost+found");
+		if (dentry->filename == NULL)
+			scan_fatal("strdup");
+		if (asprintf(&dentry->path, "%slost+found", dir->dir_path) < 0)
+			scan_fatal("asprintf");
+		dentry->mode = S_IRWXU;
+		dentry->file_type = EXT4_FT_DIR;
+		scan_label(queue, dentry, &dir->status[0], dentry->mode);
+		dir->dirs++;
+	}
 
 	for (i = 0; i < entries; i++) {
-		dentries[i].filename = strdup(namelist[i]->d_name);
-		if (dentries[i].filename == NULL)
-			critical_error_errno("strdup");
+		dentry = &dir->dentries[first + i];
+		status = &dir->status[first + i];
 
-		asprintf(&dentries[i].path, "%s%s", dir_path, namelist[i]->d_name);
-		asprintf(&dentries[i].full_path, "%s%s", full_path, namelist[i]->d_name);
+		dentry->filename = strdup(namelist[i]->d_name);
+		if (dentry->filename == NULL)
+			scan_fatal("strdup");
+
+		if (asprintf(&dentry->path, "%s%s", dir->dir_path, namelist[i]->d_name) < 0 ||
+				asprintf(&dentry->full_path, "%s%s", dir->full_path, namelist[i]->d_name) < 0)
+			scan_fatal("asprintf");
 
 		free(namelist[i]);
 
-		ret = lstat(dentries[i].full_path, &stat);
-		if (ret < 0) {
-			error_errno("lstat");
-			i--;
-			entries--;
+		if (lstat(dentry->full_path, &stat) < 0) {
+			status->lstat_errno = errno;
 			continue;
 		}
 
-		dentries[i].size = stat.st_size;
-		dentries[i].mode = stat.st_mode & (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
-		dentries[i].mtime = stat.st_mtime;
-		uint64_t capabilities;
-		if (fs_config_func != NULL) {
+		dentry->size = stat.st_size;
+		dentry->mode = stat.st_mode & (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
+		dentry->mtime = stat.st_mtime;
 #ifdef ANDROID
+		if (queue->fs_config_func != NULL) {
 			unsigned int mode = 0;
 			unsigned int uid = 0;
 			unsigned int gid = 0;
+			uint64_t capabilities;
 			int dir = S_ISDIR(stat.st_mode);
-			fs_config_func(dentries[i].path, dir, &uid, &gid, &mode, &capabilities);
-			dentries[i].mode = mode;
-			dentries[i].uid = uid;
-			dentries[i].gid = gid;
-			dentries[i].capabilities = capabilities;
-#else
-			error("can't set android permissions - built without android support");
-#endif
-		}
-#ifndef USE_MINGW
-		if (sehnd) {
-			if (selabel_lookup(sehnd, &dentries[i].secon, dentries[i].path, stat.st_mode) < 0) {
-				error("cannot lookup security context for %s", dentries[i].path);
-			}
-
-			if (dentries[i].secon && verbose)
-				printf("Labeling %s as %s\n", dentries[i].path, dentries[i].secon);
+			queue->fs_config_func(dentry->path, dir, &uid, &gid, &mode, &capabilities);
+			dentry->mode = mode;
+			dentry->uid = uid;
+			dentry->gid = gid;
+			dentry->capabilities = capabilities;
 		}
 #endif
+		scan_label(queue, dentry, status, stat.st_mode);
 
 		if (S_ISREG(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_REG_FILE;
+			dentry->file_type = EXT4_FT_REG_FILE;
+			dentry->dev = stat.st_dev;
+			dentry->ino = stat.st_ino;
+			dentry->nlink = stat.st_nlink;
 		} else if (S_ISDIR(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_DIR;
-			dirs++;
+			dentry->file_type = EXT4_FT_DIR;
+			dir->dirs++;
 		} else if (S_ISCHR(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_CHRDEV;
+			dentry->file_type = EXT4_FT_CHRDEV;
 		} else if (S_ISBLK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_BLKDEV;
+			dentry->file_type = EXT4_FT_BLKDEV;
 		} else if (S_ISFIFO(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_FIFO;
+			dentry->file_type = EXT4_FT_FIFO;
 		} else if (S_ISSOCK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_SOCK;
+			dentry->file_type = EXT4_FT_SOCK;
 		} else if (S_ISLNK(stat.st_mode)) {
-			dentries[i].file_type = EXT4_FT_SYMLINK;
-			dentries[i].link = calloc(info.block_size, 1);
-			readlink(dentries[i].full_path, dentries[i].link, info.block_size - 1);
+			dentry->file_type = EXT4_FT_SYMLINK;
+			dentry->link = calloc(info.block_size, 1);
+			if (dentry->link == NULL)
+				scan_fatal("calloc");
+			readlink(dentry->full_path, dentry->link, info.block_size - 1);
 		} else {
-			error("unknown file type on %s", dentries[i].path);
-			i--;
-			entries--;
+			status->unknown_type = true;
 		}
 	}
 	free(namelist);
 
-	if (needs_lost_and_found) {
-		/* insert a lost+found directory at the beginning of the dentries */
-		struct dentry *tmp = calloc(entries + 1, sizeof(struct dentry));
-		memset(tmp, 0, sizeof(struct dentry));
-		memcpy(tmp + 1, dentries, entries * sizeof(struct dentry));
-		dentries = tmp;
-
-		dentries[0].filename = strdup("lost+found");
-		asprintf(&dentries[0].path, "%slost+found", dir_path);
-		dentries[0].full_path = NULL;
-		dentries[0].size = 0;
-		dentries[0].mode = S_IRWXU;
-		dentries[0].file_type = EXT4_FT_DIR;
-		dentries[0].uid = 0;
-		dentries[0].gid = 0;
-		if (sehnd) {
-			if (selabel_lookup(sehnd, &dentries[0].secon, dentries[0].path, dentries[0].mode) < 0)
-				error("cannot lookup security context for %s", dentries[0].path);
+	for (i = 0; i < dir->entries; i++) {
+		char *subdir_full_path = NULL;
+		char *subdir_dir_path;
+
+		dentry = &dir->dentries[i];
+		if (dentry->file_type != EXT4_FT_DIR)
+			continue;
+
+		if (dentry->full_path && asprintf(&subdir_full_path, "%s/", dentry->full_path) < 0)
+			scan_fatal("asprintf");
+		if (asprintf(&subdir_dir_path, "%s/", dentry->path) < 0)
+			scan_fatal("asprintf");
+
+		subdir = new_scan_dir(subdir_full_path, subdir_dir_path, false);
+		dir->subdirs[i] = subdir;
+		subdir->next = subdirs;
+		subdirs = subdir;
+		queued++;
+	}
+
+	if (queued) {
+		/* subdirs is in reverse order, so the queue is popped in
+		   directory order and the scan stays close to depth first */
+		pthread_mutex_lock(&queue->lock);
+		while (subdirs) {
+			subdir = subdirs;
+			subdirs = subdir->next;
+			subdir->next = queue->head;
+			queue->head = subdir;
+		}
+		queue->pending += queued;
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+	}
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_queue *queue = arg;
+	struct scan_dir *dir;
+
+	pthread_mutex_lock(&queue->lock);
+	while (1) {
+		while (!queue->head && queue->pending)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		if (!queue->head)
+			break;
+
+		dir = queue->head;
+		queue->head = dir->next;
+		pthread_mutex_unlock(&queue->lock);
+
+		scan_directory(queue, dir);
+
+		pthread_mutex_lock(&queue->lock);
+		if (--queue->pending == 0)
+			pthread_cond_broadcast(&queue->cond);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+/* Reads the tree at full_path into memory, using scan_threads threads */
+static struct scan_dir *scan_directory_tree(const char *full_path, const char *dir_path,
+		fs_config_func_t fs_config_func, struct selabel_handle *sehnd)
+{
+	struct scan_queue queue;
+	struct scan_dir *root;
+	pthread_t *threads;
+	int nthreads = scan_threads;
+	int i;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (threads == NULL)
+		critical_error_errno("calloc");
+
+	root = new_scan_dir(strdup(full_path), strdup(dir_path), true);
+	if (root->full_path == NULL || root->dir_path == NULL)
+		critical_error_errno("strdup");
+
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+	queue.head = root;
+	queue.pending = 1;
+	queue.fs_config_func = fs_config_func;
+	queue.sehnd = sehnd;
+
+	/* The calling thread is the first worker */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, &queue)) {
+			nthreads = i;
+			break;
+		}
+	}
+	scan_worker(&queue);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+	free(threads);
+
+	return root;
+}
+
+/* Regular files with more than one link in the source tree share a single
+   inode in the image, as long as every link would get the same owner,
+   permissions, capabilities and security context.  The table is only used
+   by the layout pass, so the first link in directory order always creates
+   the inode. */
+
+#define HARD_LINK_HASH_SIZE 4096
+
+struct hard_link {
+	u64 dev;
+	u64 ino;
+	u32 inode;
+	u16 mode;
+	u16 uid;
+	u16 gid;
+	uint64_t capabilities;
+	char *secon;
+	struct hard_link *next;
+};
+
+static struct hard_link *hard_links[HARD_LINK_HASH_SIZE];
+
+static struct hard_link **hard_link_bucket(u64 dev, u64 ino)
+{
+	return &hard_links[(ino ^ (dev * 31)) % HARD_LINK_HASH_SIZE];
+}
+
+static bool hard_link_matches(struct hard_link *link, struct dentry *dentry)
+{
+	if (link->mode != dentry->mode || link->uid != dentry->uid ||
+			link->gid != dentry->gid ||
+			link->capabilities != dentry->capabilities)
+		return false;
+
+	if (!link->secon || !dentry->secon)
+		return link->secon == dentry->secon;
+
+	return strcmp(link->secon, dentry->secon) == 0;
+}
+
+/* Returns the inode already made for another link to dentry, or 0 */
+static u32 find_hard_link(struct dentry *dentry)
+{
+	struct hard_link *link;
+
+	for (link = *hard_link_bucket(dentry->dev, dentry->ino); link; link = link->next)
+		if (link->dev == dentry->dev && link->ino == dentry->ino &&
+				hard_link_matches(link, dentry))
+			return link->inode;
+
+	return 0;
+}
+
+/* Records that inode was made for dentry, so that the other links to the same
+   file can share it */
+static void add_hard_link(struct dentry *dentry, u32 inode)
+{
+	struct hard_link **bucket = hard_link_bucket(dentry->dev, dentry->ino);
+	struct hard_link *link;
+
+	for (link = *bucket; link; link = link->next) {
+		if (link->dev == dentry->dev && link->ino == dentry->ino &&
+				hard_link_matches(link, dentry)) {
+			/* the previous inode ran out of links */
+			link->inode = inode;
+			return;
+		}
+	}
+
+	link = calloc(1, sizeof(struct hard_link));
+	if (link == NULL)
+		critical_error_errno("calloc");
+
+	link->dev = dentry->dev;
+	link->ino = dentry->ino;
+	link->inode = inode;
+	link->mode = dentry->mode;
+	link->uid = dentry->uid;
+	link->gid = dentry->gid;
+	link->capabilities = dentry->capabilities;
+	if (dentry->secon) {
+		link->secon = strdup(dentry->secon);
+		if (link->secon == NULL)
+			critical_error_errno("strdup");
+	}
+	link->next = *bucket;
+	*bucket = link;
+}
+
+static void free_hard_links(void)
+{
+	struct hard_link *link;
+	int i;
+
+	for (i = 0; i < HARD_LINK_HASH_SIZE; i++) {
+		while ((link = hard_links[i])) {
+			hard_links[i] = link->next;
+			free(link->secon);
+			free(link);
+		}
+	}
+}
+
+/* Files listed in the order file have their data allocated before anything
+   else in the tree, in the order they are listed, so that files read one
+   after the other at boot are read sequentially.  A line of the order file
+   is a path as seen on the device, optionally followed by the offset and
+   length of the part of the file that is read.  Only the start of such a
+   file, up to the end of the last part listed, is allocated early, so that
+   its extents stay in file order. */
+
+struct order_entry {
+	char *path;
+	u32 index;
+	/* End of the part of the file to place early */
+	u64 end;
+	struct dentry *dentry;
+};
+
+static struct order_entry *order_entries;
+static u32 order_count;
+
+static int order_path_cmp(const void *a, const void *b)
+{
+	const struct order_entry *ea = a;
+	const struct order_entry *eb = b;
+
+	return strcmp(ea->path, eb->path);
+}
+
+static int order_index_cmp(const void *a, const void *b)
+{
+	const struct order_entry *ea = a;
+	const struct order_entry *eb = b;
+
+	return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
+/* Splits the offset and length off the end of line, if it has them */
+static int parse_order_range(char *line, u64 *end)
+{
+	unsigned long long offset;
+	unsigned long long length;
+	char *len_str;
+	char *off_str;
+	char *p;
+
+	len_str = strrchr(line, ' ');
+	if (len_str == NULL)
+		return 0;
+	*len_str = '\0';
+	off_str = strrchr(line, ' ');
+	*len_str = ' ';
+	if (off_str == NULL)
+		return 0;
+
+	offset = strtoull(off_str + 1, &p, 0);
+	if (p != len_str || p == off_str + 1)
+		return 0;
+	length = strtoull(len_str + 1, &p, 0);
+	if (*p != '\0' || p == len_str + 1)
+		return 0;
+
+	*off_str = '\0';
+	*end = offset + length;
+	return 1;
+}
+
+static void load_order_file(const char *filename)
+{
+	char line[PATH_MAX + 64];
+	u32 allocated = 0;
+	u32 index = 0;
+	u32 i, j;
+	u64 end;
+	size_t len;
+	char *path;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		error_errno("fopen %s", filename);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		else if (!feof(f))
+			critical_error("%s: line %u is too long", filename, index + 1);
+		index++;
+
+		if (line[0] == '#')
+			continue;
+
+		end = ~0ULL;
+		parse_order_range(line, &end);
+		for (path = line; *path == '/'; path++)
+			;
+		if (*path == '\0')
+			continue;
+
+		if (order_count == allocated) {
+			allocated = allocated ? allocated * 2 : 256;
+			order_entries = realloc(order_entries,
+					allocated * sizeof(struct order_entry));
+			if (order_entries == NULL)
+				critical_error_errno("realloc");
+		}
+		order_entries[order_count].path = strdup(path);
+		if (order_entries[order_count].path == NULL)
+			critical_error_errno("strdup");
+		order_entries[order_count].index = index;
+		order_entries[order_count].end = end;
+		order_entries[order_count].dentry = NULL;
+		order_count++;
+	}
+	fclose(f);
+
+	/* A file listed more than once goes where it is first listed, with
+	   every part listed placed early */
+	qsort(order_entries, order_count, sizeof(struct order_entry), order_path_cmp);
+	for (i = 0, j = 0; i < order_count; i++) {
+		if (j && strcmp(order_entries[j - 1].path, order_entries[i].path) == 0) {
+			order_entries[j - 1].index = min(order_entries[j - 1].index,
+					order_entries[i].index);
+			order_entries[j - 1].end = max(order_entries[j - 1].end,
+					order_entries[i].end);
+			free(order_entries[i].path);
+		} else {
+			order_entries[j++] = order_entries[i];
+		}
+	}
+	order_count = j;
+}
+
+static void free_order_entries(void)
+{
+	u32 i;
+
+	for (i = 0; i < order_count; i++)
+		free(order_entries[i].path);
+	free(order_entries);
+	order_entries = NULL;
+	order_count = 0;
+}
+
+/* Finds the files of dir and its subdirectories in the order file.  Like
+   the paths in the order file, the paths of the files are looked up without
+   their leading '/', which they have when there is a mountpoint. */
+static void find_ordered_files(struct scan_dir *dir)
+{
+	struct order_entry key;
+	struct order_entry *entry;
+	int i;
+
+	for (i = 0; i < dir->entries; i++) {
+		if (dir->dentries[i].file_type == EXT4_FT_REG_FILE) {
+			for (key.path = dir->dentries[i].path; *key.path == '/'; key.path++)
+				;
+			entry = bsearch(&key, order_entries, order_count,
+					sizeof(struct order_entry), order_path_cmp);
+			if (entry)
+				entry->dentry = &dir->dentries[i];
+		} else if (dir->subdirs[i]) {
+			find_ordered_files(dir->subdirs[i]);
 		}
+	}
+}
+
+/* Allocates the blocks of the files in the order file, in order */
+static void allocate_ordered_files(void)
+{
+	struct order_entry *entry;
+	struct dentry *dentry;
+	u32 blocks;
+	u32 i;
+
+	qsort(order_entries, order_count, sizeof(struct order_entry), order_index_cmp);
+
+	for (i = 0; i < order_count; i++) {
+		entry = &order_entries[i];
+		dentry = entry->dentry;
+
+		/* Files kept where they were in the base image stay there */
+		if (dentry == NULL || manifest_has_placement(dentry->path))
+			continue;
+
+		blocks = DIV_ROUND_UP(min((u64)dentry->size, entry->end), info.block_size);
+		if (blocks == 0)
+			continue;
+
+		dentry->alloc = allocate_blocks(blocks);
+		if (dentry->alloc == NULL)
+			error("failed to allocate %u blocks for %s", blocks, dentry->path);
+	}
+
+	free_order_entries();
+}
+
+/* Marks the files in dir and its subdirectories that haven't changed since
+   the base image to be put back where they were */
+static void keep_unchanged_files(struct scan_dir *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->entries; i++) {
+		if (dir->dentries[i].file_type == EXT4_FT_REG_FILE)
+			manifest_keep_file(&dir->dentries[i]);
+		else if (dir->subdirs[i])
+			keep_unchanged_files(dir->subdirs[i]);
+	}
+}
+
+/* Create the scanned directory dir in the generated filesystem.  Calls itself
+   recursively with each directory in the given directory, and frees dir. */
+static u32 build_directory_structure(struct scan_dir *dir, u32 dir_inode,
+		fs_config_func_t fs_config_func, int verbose)
+{
+	struct dentry *dentries = dir->dentries;
+	struct block_allocation *alloc;
+	struct scan_status *status;
+	int entries = 0;
+	int ret;
+	int i;
+	u32 inode;
+	u32 entry_inode;
+
+	if (dir->scandir_errno) {
+		errno = dir->scandir_errno;
+		free_scan_dir(dir);
+		error_errno("scandir");
+		return EXT4_ALLOCATE_FAILED;
+	}
+
+	/* Report what went wrong in the scan, in directory order, and drop
+	   the entries that can't be copied */
+	for (i = 0; i < dir->entries; i++) {
+		status = &dir->status[i];
+		if (status->lstat_errno) {
+			errno = status->lstat_errno;
+			error_errno("lstat");
+			free_dentry(&dentries[i]);
+			continue;
+		}
+
+#ifndef ANDROID
+		if (fs_config_func != NULL && dentries[i].full_path)
+			error("can't set android permissions - built without android support");
+#endif
+
+		if (status->label_failed)
+			error("cannot lookup security context for %s", dentries[i].path);
+		if (dentries[i].secon && verbose && dentries[i].full_path)
+			printf("Labeling %s as %s\n", dentries[i].path, dentries[i].secon);
+
+		if (status->unknown_type) {
+			error("unknown file type on %s", dentries[i].path);
+			free_dentry(&dentries[i]);
+			continue;
+		}
+
+		dentries[entries] = dentries[i];
+		dir->subdirs[entries] = dir->subdirs[i];
 		entries++;
-		dirs++;
 	}
 
-	inode = make_directory(dir_inode, entries, dentries, dirs);
+	inode = make_directory(dir_inode, entries, dentries, dir->dirs);
 
 	for (i = 0; i < entries; i++) {
+		if (dentries[i].file_type == EXT4_FT_REG_FILE && dentries[i].nlink > 1) {
+			entry_inode = find_hard_link(&dentries[i]);
+			if (entry_inode && inode_add_link(entry_inode) == 0) {
+				*dentries[i].inode = entry_inode;
+				if (dentries[i].alloc)
+					release_allocation(dentries[i].alloc);
+				free_dentry(&dentries[i]);
+				continue;
+			}
+		}
+
 		if (dentries[i].file_type == EXT4_FT_REG_FILE) {
-			entry_inode = make_file(dentries[i].full_path, dentries[i].size);
+			alloc = dentries[i].alloc;
+			if (alloc == NULL)
+				alloc = manifest_get_placement(dentries[i].path);
+			entry_inode = make_file_at(dentries[i].full_path, dentries[i].size,
+					&alloc);
+			if (dentries[i].nlink > 1)
+				add_hard_link(&dentries[i], entry_inode);
+			manifest_add_file(&dentries[i], entry_inode, alloc);
+			if (alloc)
+				free_alloc(alloc);
 		} else if (dentries[i].file_type == EXT4_FT_DIR) {
-			char *subdir_full_path = NULL;
-			char *subdir_dir_path;
-			if (dentries[i].full_path) {
-				ret = asprintf(&subdir_full_path, "%s/", dentries[i].full_path);
-				if (ret < 0)
-					critical_error_errno("asprintf");
-			}
-			ret = asprintf(&subdir_dir_path, "%s/", dentries[i].path);
-			if (ret < 0)
-				critical_error_errno("asprintf");
-			entry_inode = build_directory_structure(subdir_full_path,
-					subdir_dir_path, inode, fs_config_func, sehnd, verbose);
-			free(subdir_full_path);
-			free(subdir_dir_path);
+			entry_inode = build_directory_structure(dir->subdirs[i], inode,
+					fs_config_func, verbose);
+			dir->subdirs[i] = NULL;
 		} else if (dentries[i].file_type == EXT4_FT_SYMLINK) {
 			entry_inode = make_link(dentries[i].link);
 		} else {
@@ -287,18 +864,43 @@ static u32 build_directory_structure(const char *full_path, const char *dir_path
 		if (ret)
 			error("failed to set capability on %s\n", dentries[i].path);
 
-		free(dentries[i].path);
-		free(dentries[i].full_path);
-		free(dentries[i].link);
-		free((void *)dentries[i].filename);
-		free(dentries[i].secon);
+		free_dentry(&dentries[i]);
 	}
 
-	free(dentries);
+	free_scan_dir(dir);
 	return inode;
 }
 #endif
 
+/* Opens an unlinked file in $TMPDIR to hold the inode tables in low
+   memory mode */
+static int open_scratch_file(void)
+{
+#ifdef USE_MINGW
+	error("low memory mode is not supported on windows");
+	return -1;
+#else
+	const char *tmpdir = getenv("TMPDIR");
+	char *path;
+	int fd;
+
+	if (tmpdir == NULL)
+		tmpdir = "/tmp";
+
+	if (asprintf(&path, "%s/make_ext4fs-XXXXXX", tmpdir) < 0)
+		critical_error_errno("asprintf");
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		error_errno("mkstemp %s", path);
+	else
+		unlink(path);
+
+	free(path);
+	return fd;
+#endif
+}
+
 static u32 compute_block_size()
 {
 	return 4096;
@@ -455,6 +1057,48 @@ static char *canonicalize_rel_slashes(const char *str)
 	return canonicalize_slashes(str, false);
 }
 
+#ifndef USE_MINGW
+/* Lays out directory, or an empty root directory if there is none, and
+   returns the inode of the root.  Kept out of make_ext4fs_internal() so that
+   nothing here is live across its setjmp(). */
+static u32 build_tree(const char *directory, const char *mountpoint,
+	fs_config_func_t fs_config_func, struct selabel_handle *sehnd,
+	int verbose)
+{
+	struct scan_dir *root = NULL;
+	u32 root_inode_num;
+
+	if (directory) {
+		root = scan_directory_tree(directory, mountpoint, fs_config_func, sehnd);
+		if (info.base_manifest && manifest_load_base(info.base_manifest) == 0) {
+			keep_unchanged_files(root);
+			manifest_pin_kept_files();
+		}
+		if (info.order_file) {
+			load_order_file(info.order_file);
+			find_ordered_files(root);
+			allocate_ordered_files();
+		}
+	}
+
+	/* Opened after the base manifest is read, as they can be the same file */
+	if (info.manifest)
+		manifest_open(info.manifest);
+
+	if (directory) {
+		root_inode_num = build_directory_structure(root, 0, fs_config_func,
+				verbose);
+		free_hard_links();
+		manifest_free_base();
+	} else
+		root_inode_num = build_default_directory_structure();
+
+	manifest_close();
+
+	return root_inode_num;
+}
+#endif
+
 int make_ext4fs_internal(int fd, const char *_directory,
                          const char *_mountpoint, fs_config_func_t fs_config_func, int gzip,
                          int sparse, int crc, int wipe,
@@ -468,6 +1112,13 @@ int make_ext4fs_internal(int fd, const char *_directory,
 	if (setjmp(setjmp_env))
 		return EXIT_FAILURE; /* Handle a call to longjmp() */
 
+#ifndef USE_MINGW
+	/* A previous call that failed part way may have left links and order
+	   file entries behind */
+	free_hard_links();
+	free_order_entries();
+#endif
+
 	if (_mountpoint == NULL) {
 		mountpoint = strdup("");
 	} else {
@@ -547,6 +1198,12 @@ int make_ext4fs_internal(int fd, const char *_directory,
 
 	info.sparse_file = sparse_file_new(info.block_size, info.len);
 
+	if (info.low_memory) {
+		aux_info.scratch_fd = open_scratch_file();
+		if (aux_info.scratch_fd < 0)
+			return EXIT_FAILURE;
+	}
+
 	block_allocator_init();
 
 	ext4_fill_in_sb();
@@ -565,11 +1222,8 @@ int make_ext4fs_internal(int fd, const char *_directory,
 	assert(!directory);
 	root_inode_num = build_default_directory_structure();
 #else
-	if (directory)
-		root_inode_num = build_directory_structure(directory, mountpoint, 0,
-                        fs_config_func, sehnd, verbose);
-	else
-		root_inode_num = build_default_directory_structure();
+	root_inode_num = build_tree(directory, mountpoint, fs_config_func, sehnd,
+			verbose);
 #endif
 
 	root_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
@@ -605,11 +1259,19 @@ int make_ext4fs_internal(int fd, const char *_directory,
 	if (wipe)
 		wipe_block_device(fd, info.len);
 
+	if (info.low_memory)
+		flush_inode_tables();
+
 	write_ext4_image(fd, gzip, sparse, crc);
 
 	sparse_file_destroy(info.sparse_file);
 	info.sparse_file = NULL;
 
+	block_allocator_free();
+
+	if (info.low_memory)
+		close(aux_info.scratch_fd);
+
 	free(mountpoint);
 	free(directory);
 
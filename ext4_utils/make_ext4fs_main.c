@@ -52,8 +52,10 @@ static void usage(char *path)
 	fprintf(stderr, "%s [ -l <len> ] [ -j <journal size> ] [ -b <block_size> ]\n", basename(path));
 	fprintf(stderr, "    [ -g <blocks per group> ] [ -i <inodes> ] [ -I <inode size> ]\n");
 	fprintf(stderr, "    [ -L <label> ] [ -f ] [ -a <android mountpoint> ]\n");
-	fprintf(stderr, "    [ -S file_contexts ]\n");
-	fprintf(stderr, "    [ -z | -s ] [ -w ] [ -c ] [ -J ] [ -v ]\n");
+	fprintf(stderr, "    [ -S file_contexts ] [ -M <manifest> ] [ -B <base manifest> ]\n");
+	fprintf(stderr, "    [ -O <order file> ]\n");
+	fprintf(stderr, "    [ -z | -s ] [ -w ] [ -c ] [ -J ] [ -v ] [ -P <scan threads> ] [ -m ] [ -Z ]\n");
+	fprintf(stderr, "    [ -T <compression threads, with -z> ]\n");
 	fprintf(stderr, "    <filename> [<directory>]\n");
 }
 
@@ -76,7 +78,7 @@ int main(int argc, char **argv)
 	struct selinux_opt seopts[] = { { SELABEL_OPT_PATH, "" } };
 #endif
 
-	while ((opt = getopt(argc, argv, "l:j:b:g:i:I:L:a:S:fwzJsctv")) != -1) {
+	while ((opt = getopt(argc, argv, "l:j:b:g:i:I:L:a:S:P:T:M:B:O:fwzJmZsctv")) != -1) {
 		switch (opt) {
 		case 'l':
 			info.len = parse_num(optarg);
@@ -121,6 +123,21 @@ int main(int argc, char **argv)
 		case 'J':
 			info.no_journal = 1;
 			break;
+		case 'm':
+			info.low_memory = 1;
+			break;
+		case 'M':
+			info.manifest = optarg;
+			break;
+		case 'B':
+			info.base_manifest = optarg;
+			break;
+		case 'O':
+			info.order_file = optarg;
+			break;
+		case 'Z':
+			info.detect_zeros = 1;
+			break;
 		case 'c':
 			crc = 1;
 			break;
@@ -143,6 +160,12 @@ int main(int argc, char **argv)
 		case 'v':
 			verbose = 1;
 			break;
+		case 'P':
+			scan_threads = parse_num(optarg);
+			break;
+		case 'T':
+			gzip_threads = parse_num(optarg);
+			break;
 		default: /* '?' */
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
@@ -173,6 +196,12 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (gzip_threads && !gzip) {
+		fprintf(stderr, "Compression threads only apply to gzip output\n");
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (optind >= argc) {
 		fprintf(stderr, "Expected filename after options\n");
 		usage(argv[0]);
@@ -0,0 +1,563 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ext4_utils.h"
+#include "allocate.h"
+#include "contents.h"
+#include "manifest.h"
+#include "sha1.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef USE_MINGW /* O_BINARY is windows-specific flag */
+#define O_BINARY 0
+#endif
+
+/* A manifest lists the regular files in an image, after a line describing
+   the layout of the filesystem, one file per line:
+
+     <size> <mtime> <sha1> <inode> <extent block> <extents> <block>+<len>...\t<path>
+
+   where <extent block> is the block holding the extents of a file with too
+   many to fit in its inode, or 0.
+
+   When an image is made with the manifest of a previous image as its base,
+   every file that is the same size and has the same mtime or contents as in
+   the base is put back in the same blocks, before anything else is
+   allocated.  Only new and changed files, and directories, get new blocks,
+   so the two images differ in few blocks.  The data is still read from the
+   source files, as the previous image may be sparse or compressed. */
+
+#define MANIFEST_MAGIC "make_ext4fs manifest 1"
+
+enum manifest_state {
+	MANIFEST_UNUSED,
+	/* Unchanged, to be pinned */
+	MANIFEST_KEPT,
+	/* Unchanged, with its blocks pinned */
+	MANIFEST_PINNED,
+	/* Put back in its blocks */
+	MANIFEST_PLACED,
+};
+
+struct manifest_extent {
+	u32 block;
+	u32 len;
+};
+
+struct manifest_file {
+	char *path;
+	u64 size;
+	u32 mtime;
+	u8 sha1[SHA1_DIGEST_LENGTH];
+	/* Set once sha1 has been checked against the source file */
+	int sha1_checked;
+	u32 extent_block;
+	u32 extents;
+	struct manifest_extent *extent;
+	enum manifest_state state;
+	struct manifest_file *next;
+};
+
+struct manifest_pin {
+	u32 block;
+	u32 len;
+	struct manifest_file *file;
+	int pinned;
+};
+
+static struct manifest_file **base_files;
+static u32 base_buckets;
+static FILE *manifest_out;
+
+static u32 hash_path(const char *path)
+{
+	u32 hash = 5381;
+
+	while (*path)
+		hash = hash * 33 + (u8)*path++;
+
+	return hash;
+}
+
+static struct manifest_file *find_file(const char *path)
+{
+	struct manifest_file *file;
+
+	if (!base_buckets)
+		return NULL;
+
+	for (file = base_files[hash_path(path) & (base_buckets - 1)]; file; file = file->next)
+		if (strcmp(file->path, path) == 0)
+			return file;
+
+	return NULL;
+}
+
+static int block_group_of(u32 block)
+{
+	return (block - aux_info.first_data_block) / info.blocks_per_group;
+}
+
+static void sha1_to_hex(const u8 sha1[SHA1_DIGEST_LENGTH], char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+		sprintf(hex + 2 * i, "%02x", sha1[i]);
+}
+
+static int hex_to_sha1(const char *hex, u8 sha1[SHA1_DIGEST_LENGTH])
+{
+	unsigned int byte;
+	int i;
+
+	if (strlen(hex) != 2 * SHA1_DIGEST_LENGTH)
+		return -1;
+
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		sha1[i] = byte;
+	}
+
+	return 0;
+}
+
+static int sha1_file(const char *filename, u8 sha1[SHA1_DIGEST_LENGTH])
+{
+	u8 buf[65536];
+	SHA1_CTX ctx;
+	ssize_t ret;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		error_errno("open %s", filename);
+		return -1;
+	}
+
+	SHA1Init(&ctx);
+	while ((ret = read(fd, buf, sizeof(buf))) != 0) {
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			error_errno("read %s", filename);
+			close(fd);
+			return -1;
+		}
+		SHA1Update(&ctx, buf, ret);
+	}
+	SHA1Final(sha1, &ctx);
+
+	close(fd);
+	return 0;
+}
+
+/* Formats the line describing the filesystem that follows MANIFEST_MAGIC */
+static void format_layout(char *buf, size_t len)
+{
+	snprintf(buf, len, "%u %llu %u %u %u %u %u\n", info.block_size,
+			aux_info.len_blocks, info.blocks_per_group,
+			info.inodes_per_group, info.inode_size,
+			info.journal_blocks, info.bg_desc_reserve_blocks);
+}
+
+static void free_file(struct manifest_file *file)
+{
+	free(file->path);
+	free(file->extent);
+	free(file);
+}
+
+/* Reads one file from a manifest.  Returns NULL at the end of the manifest,
+   and sets *bad if the entry can't be read */
+static struct manifest_file *read_file(FILE *f, int *bad)
+{
+	struct manifest_file *file;
+	char path[PATH_MAX + 2];
+	char hex[2 * SHA1_DIGEST_LENGTH + 1];
+	size_t len;
+	u32 inode;
+	u32 i;
+
+	file = calloc(1, sizeof(struct manifest_file));
+	if (file == NULL)
+		critical_error_errno("calloc");
+
+	if (fscanf(f, "%llu %u %40s %u %u %u", &file->size, &file->mtime, hex,
+			&inode, &file->extent_block, &file->extents) != 6) {
+		*bad = !feof(f);
+		free(file);
+		return NULL;
+	}
+
+	if (hex_to_sha1(hex, file->sha1) < 0)
+		goto bad;
+
+	if (file->extents > info.block_size / sizeof(struct manifest_extent))
+		goto bad;
+
+	file->extent = calloc(file->extents, sizeof(struct manifest_extent));
+	if (file->extents && file->extent == NULL)
+		critical_error_errno("calloc");
+
+	for (i = 0; i < file->extents; i++)
+		if (fscanf(f, " %u+%u", &file->extent[i].block, &file->extent[i].len) != 2)
+			goto bad;
+
+	if (fgetc(f) != '\t' || fgets(path, sizeof(path), f) == NULL)
+		goto bad;
+	len = strlen(path);
+	if (len == 0 || path[len - 1] != '\n')
+		goto bad;
+	path[len - 1] = '\0';
+
+	file->path = strdup(path);
+	if (file->path == NULL)
+		critical_error_errno("strdup");
+
+	return file;
+
+bad:
+	*bad = 1;
+	free_file(file);
+	return NULL;
+}
+
+/* Reads the manifest of a previous image, whose files are put back in the
+   same place if they haven't changed.  A missing manifest, or one for a
+   filesystem with a different layout, is ignored. */
+int manifest_load_base(const char *filename)
+{
+	struct manifest_file *files = NULL;
+	struct manifest_file *file;
+	char layout[256];
+	char line[256];
+	u32 count = 0;
+	int bad = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			warn("%s does not exist, placing all files", filename);
+			return 0;
+		}
+		error_errno("fopen %s", filename);
+		return -1;
+	}
+
+	if (fgets(line, sizeof(line), f) == NULL ||
+			strcmp(line, MANIFEST_MAGIC "\n")) {
+		fclose(f);
+		error("%s is not a manifest", filename);
+		return -1;
+	}
+
+	format_layout(layout, sizeof(layout));
+	if (fgets(line, sizeof(line), f) == NULL || strcmp(line, layout)) {
+		warn("%s is for a different filesystem layout, placing all files",
+				filename);
+		fclose(f);
+		return 0;
+	}
+
+	while ((file = read_file(f, &bad)) != NULL) {
+		file->next = files;
+		files = file;
+		count++;
+	}
+	fclose(f);
+
+	if (bad) {
+		while ((file = files) != NULL) {
+			files = file->next;
+			free_file(file);
+		}
+		error("%s: bad entry after %u files", filename, count);
+		return -1;
+	}
+
+	for (base_buckets = 64; base_buckets < 2 * count; base_buckets *= 2)
+		;
+	base_files = calloc(base_buckets, sizeof(struct manifest_file *));
+	if (base_files == NULL)
+		critical_error_errno("calloc");
+
+	while ((file = files) != NULL) {
+		struct manifest_file **bucket =
+			&base_files[hash_path(file->path) & (base_buckets - 1)];
+		files = file->next;
+		file->next = *bucket;
+		*bucket = file;
+	}
+
+	return 0;
+}
+
+/* Marks the file in dentry to be put back where it was in the base image,
+   if it is the same as it was then */
+void manifest_keep_file(struct dentry *dentry)
+{
+	struct manifest_file *file = find_file(dentry->path);
+	u8 sha1[SHA1_DIGEST_LENGTH];
+	u64 blocks = 0;
+	u32 i;
+
+	if (file == NULL || file->state != MANIFEST_UNUSED ||
+			file->size != dentry->size || file->extents == 0)
+		return;
+
+	/* The extents have to be ones that make_file() could have made */
+	if (file->extents > 3 && file->extent_block == 0)
+		return;
+	for (i = 0; i < file->extents; i++)
+		blocks += file->extent[i].len;
+	if (blocks != DIV_ROUND_UP(file->size, info.block_size))
+		return;
+
+	if (file->mtime != dentry->mtime) {
+		if (sha1_file(dentry->full_path, sha1) < 0 ||
+				memcmp(sha1, file->sha1, SHA1_DIGEST_LENGTH))
+			return;
+		file->sha1_checked = 1;
+	}
+
+	file->state = MANIFEST_KEPT;
+}
+
+static int pin_cmp(const void *a, const void *b)
+{
+	const struct manifest_pin *pa = a;
+	const struct manifest_pin *pb = b;
+
+	if (pa->block != pb->block)
+		return pa->block < pb->block ? -1 : 1;
+	if (pa->len != pb->len)
+		return pa->len < pb->len ? -1 : 1;
+	return strcmp(pa->file->path, pb->file->path);
+}
+
+static void unpin_file(struct manifest_pin *pins, u32 count,
+	struct manifest_file *file)
+{
+	u32 i;
+
+	for (i = 0; i < count; i++) {
+		if (pins[i].file == file && pins[i].pinned) {
+			unpin_blocks(pins[i].block, pins[i].len);
+			pins[i].pinned = 0;
+		}
+	}
+}
+
+/* Reserves the blocks of every kept file, in block order.  A file that
+   overlaps a block that is already used is allocated new blocks instead. */
+void manifest_pin_kept_files(void)
+{
+	struct manifest_pin *pins;
+	struct manifest_file *file;
+	u32 count = 0;
+	u32 i, j;
+
+	for (i = 0; i < base_buckets; i++)
+		for (file = base_files[i]; file; file = file->next)
+			if (file->state == MANIFEST_KEPT)
+				count += file->extents + (file->extent_block ? 1 : 0);
+
+	if (count == 0)
+		return;
+
+	pins = calloc(count, sizeof(struct manifest_pin));
+	if (pins == NULL)
+		critical_error_errno("calloc");
+
+	count = 0;
+	for (i = 0; i < base_buckets; i++) {
+		for (file = base_files[i]; file; file = file->next) {
+			if (file->state != MANIFEST_KEPT)
+				continue;
+			for (j = 0; j < file->extents; j++) {
+				pins[count].block = file->extent[j].block;
+				pins[count].len = file->extent[j].len;
+				pins[count++].file = file;
+			}
+			if (file->extent_block) {
+				pins[count].block = file->extent_block;
+				pins[count].len = 1;
+				pins[count++].file = file;
+			}
+		}
+	}
+
+	qsort(pins, count, sizeof(struct manifest_pin), pin_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (pins[i].file->state != MANIFEST_KEPT)
+			continue;
+		if (pin_blocks(pins[i].block, pins[i].len) == 0) {
+			pins[i].pinned = 1;
+		} else {
+			pins[i].file->state = MANIFEST_UNUSED;
+			unpin_file(pins, i, pins[i].file);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		if (pins[i].file->state == MANIFEST_KEPT)
+			pins[i].file->state = MANIFEST_PINNED;
+
+	free(pins);
+}
+
+/* Returns 1 if the file at path will be put back where it was in the base
+   image */
+int manifest_has_placement(const char *path)
+{
+	struct manifest_file *file = find_file(path);
+
+	return file && file->state == MANIFEST_PINNED;
+}
+
+/* Returns the blocks the file at path had in the base image, if they have
+   been pinned for it, or NULL to allocate new blocks */
+struct block_allocation *manifest_get_placement(const char *path)
+{
+	struct manifest_file *file = find_file(path);
+	struct block_allocation *alloc;
+	u32 i;
+
+	if (file == NULL || file->state != MANIFEST_PINNED)
+		return NULL;
+
+	alloc = create_allocation();
+	for (i = 0; i < file->extents; i++)
+		append_region(alloc, file->extent[i].block, file->extent[i].len,
+				block_group_of(file->extent[i].block));
+	if (file->extent_block)
+		append_oob_region(alloc, file->extent_block, 1,
+				block_group_of(file->extent_block));
+
+	file->state = MANIFEST_PLACED;
+
+	return alloc;
+}
+
+/* Frees the base manifest, and the blocks pinned for files that were not
+   made after all */
+void manifest_free_base(void)
+{
+	struct manifest_file *file;
+	u32 i, j;
+
+	for (i = 0; i < base_buckets; i++) {
+		while ((file = base_files[i]) != NULL) {
+			if (file->state == MANIFEST_PINNED) {
+				for (j = 0; j < file->extents; j++)
+					unpin_blocks(file->extent[j].block,
+							file->extent[j].len);
+				if (file->extent_block)
+					unpin_blocks(file->extent_block, 1);
+			}
+			base_files[i] = file->next;
+			free_file(file);
+		}
+	}
+
+	free(base_files);
+	base_files = NULL;
+	base_buckets = 0;
+}
+
+int manifest_open(const char *filename)
+{
+	char layout[256];
+
+	manifest_out = fopen(filename, "w");
+	if (manifest_out == NULL) {
+		error_errno("fopen %s", filename);
+		return -1;
+	}
+
+	format_layout(layout, sizeof(layout));
+	fprintf(manifest_out, "%s\n%s", MANIFEST_MAGIC, layout);
+
+	return 0;
+}
+
+/* Adds the file in dentry, made at inode in the blocks of alloc, to the
+   manifest being written */
+void manifest_add_file(struct dentry *dentry, u32 inode,
+	struct block_allocation *alloc)
+{
+	struct manifest_file *file = find_file(dentry->path);
+	char hex[2 * SHA1_DIGEST_LENGTH + 1];
+	u8 sha1[SHA1_DIGEST_LENGTH];
+	u32 extent_block = 0;
+	u32 region_block;
+	u32 region_len;
+
+	if (manifest_out == NULL)
+		return;
+
+	if (strchr(dentry->path, '\n')) {
+		warn("can't add %s to the manifest", dentry->path);
+		return;
+	}
+
+	/* A file with the same size and mtime can still have new contents */
+	if (file && file->sha1_checked)
+		memcpy(sha1, file->sha1, SHA1_DIGEST_LENGTH);
+	else if (sha1_file(dentry->full_path, sha1) < 0)
+		return;
+	sha1_to_hex(sha1, hex);
+
+	if (alloc) {
+		extent_block = get_oob_block(alloc, 0);
+		if (extent_block == EXT4_ALLOCATE_FAILED)
+			extent_block = 0;
+	}
+
+	fprintf(manifest_out, "%lu %u %s %u %u %d", dentry->size, dentry->mtime,
+			hex, inode, extent_block,
+			alloc ? block_allocation_num_regions(alloc) : 0);
+
+	if (alloc) {
+		for (rewind_alloc(alloc); !last_region(alloc); get_next_region(alloc)) {
+			get_region(alloc, &region_block, &region_len);
+			fprintf(manifest_out, " %u+%u", region_block, region_len);
+		}
+	}
+
+	fprintf(manifest_out, "\t%s\n", dentry->path);
+}
+
+void manifest_close(void)
+{
+	FILE *f = manifest_out;
+
+	if (f == NULL)
+		return;
+
+	manifest_out = NULL;
+	if (ferror(f) | fclose(f))
+		error_errno("writing manifest");
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include "ext4_utils.h"
+#include "contents.h"
+
+struct block_allocation;
+
+int manifest_load_base(const char *filename);
+void manifest_keep_file(struct dentry *dentry);
+void manifest_pin_kept_files(void);
+int manifest_has_placement(const char *path);
+struct block_allocation *manifest_get_placement(const char *path);
+void manifest_free_base(void);
+
+int manifest_open(const char *filename);
+void manifest_add_file(struct dentry *dentry, u32 inode,
+	struct block_allocation *alloc);
+void manifest_close(void);
+
+#endif
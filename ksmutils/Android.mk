@@ -15,7 +15,7 @@
 LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := ksminfo.c lookup3.c
+LOCAL_SRC_FILES := ksminfo.c ksm_estimate.c ksm_hash.c ksm_pages.c lookup3.c
 
 LOCAL_C_INCLUDES := $(call include-path-for, libpagemap)
 
@@ -28,3 +28,15 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
 LOCAL_MODULE_TAGS := debug
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := ksm_bench.c ksm_hash.c ksm_pages.c lookup3.c
+
+LOCAL_MODULE := ksminfo_bench
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
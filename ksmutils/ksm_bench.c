@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Micro-benchmarks for the data structures and page scanning used by
+ * ksminfo, run over synthetic data so the results don't depend on what the
+ * system happens to be running.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ksm_hash.h"
+#include "ksm_pages.h"
+
+#define PAGE_SIZE_BENCH 4096
+
+/* Times each page buffer is scanned by the throughput benchmarks. */
+#define SCAN_PASSES 8
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift, good enough to spread synthetic pages around. */
+static uint32_t next_rand(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/*
+ * Look up num_pages pages whose contents hash to one of num_distinct
+ * values, the way read_pages() does, optionally recording the addresses.
+ */
+static int bench_pages(size_t num_pages, size_t num_distinct, int verbose) {
+    struct ksm_pages kp;
+    struct ksm_page *page;
+    uint32_t state = 0x12345678;
+    uint64_t start, elapsed;
+    size_t i;
+
+    memset(&kp, 0, sizeof(kp));
+
+    start = now_ns();
+    for (i = 0; i < num_pages; i++) {
+        /* Half the references go to a small set of popular pages. */
+        uint32_t r = next_rand(&state);
+        uint32_t hash = (r & 1) ? (r >> 1) % 64 : (r >> 1) % num_distinct;
+
+        hash = hash * 2654435761U;
+        page = ksm_pages_find(&kp, hash);
+        if (page == NULL) {
+            page = ksm_pages_add(&kp, hash);
+            if (page == NULL) {
+                fprintf(stderr, "not enough memory\n");
+                ksm_pages_free(&kp);
+                return -1;
+            }
+            page->pattern = NO_PATTERN;
+        }
+        if (verbose &&
+            ksm_page_add_vaddr(&kp, page, i * PAGE_SIZE_BENCH, PAGE_SIZE_BENCH, 1) < 0) {
+            fprintf(stderr, "not enough memory\n");
+            ksm_pages_free(&kp);
+            return -1;
+        }
+        page->vaddr_count++;
+    }
+    elapsed = now_ns() - start;
+
+    printf("pages%s: %zu pages, %zu distinct: %.3f ms, %.1f ns/page\n",
+           verbose ? " -v" : "", num_pages, kp.len, elapsed / 1e6,
+           (double)elapsed / num_pages);
+
+    ksm_pages_free(&kp);
+    return 0;
+}
+
+static double gb_per_s(size_t bytes, uint64_t ns) {
+    return ns ? (double)bytes / ns : 0;
+}
+
+/*
+ * Check num_pages pages filled with a single byte value, the worst case for
+ * is_pattern() since all of each page has to be read.
+ */
+static int bench_pattern(size_t num_pages) {
+    uint8_t *data;
+    uint64_t start, scalar_ns, vector_ns;
+    size_t i, pass, found_scalar = 0, found_vector = 0;
+    size_t bytes = num_pages * PAGE_SIZE_BENCH;
+
+    data = malloc(bytes);
+    if (data == NULL) {
+        fprintf(stderr, "not enough memory\n");
+        return -1;
+    }
+    memset(data, 0x5a, bytes);
+    /* A few pages differ in their last byte, so that both results matter. */
+    for (i = 0; i < num_pages; i += 7)
+        data[i * PAGE_SIZE_BENCH + PAGE_SIZE_BENCH - 1] = 0;
+
+    start = now_ns();
+    for (pass = 0; pass < SCAN_PASSES; pass++) {
+        for (i = 0; i < num_pages; i++)
+            found_scalar += is_pattern_scalar(data + i * PAGE_SIZE_BENCH, PAGE_SIZE_BENCH);
+    }
+    scalar_ns = now_ns() - start;
+
+    start = now_ns();
+    for (pass = 0; pass < SCAN_PASSES; pass++) {
+        for (i = 0; i < num_pages; i++)
+            found_vector += is_pattern(data + i * PAGE_SIZE_BENCH, PAGE_SIZE_BENCH);
+    }
+    vector_ns = now_ns() - start;
+
+    free(data);
+
+    printf("pattern: %zu pages: scalar %.2f GB/s, vector %.2f GB/s\n", num_pages,
+           gb_per_s(bytes * SCAN_PASSES, scalar_ns), gb_per_s(bytes * SCAN_PASSES, vector_ns));
+    if (found_scalar != found_vector) {
+        fprintf(stderr, "error: pattern results differ (%zu vs %zu)\n",
+                found_scalar, found_vector);
+        return -1;
+    }
+    return 0;
+}
+
+/* Hash num_pages pages of random data one at a time and HASH_LANES at a time. */
+static int bench_hash(size_t num_pages) {
+    uint8_t *data;
+    const uint8_t **pages;
+    uint32_t *c_scalar, *b_scalar, *c_vector, *b_vector;
+    uint32_t state = 0x9e3779b9;
+    uint64_t start, scalar_ns, vector_ns;
+    size_t i, pass;
+    size_t bytes = num_pages * PAGE_SIZE_BENCH;
+    int rc = -1;
+
+    data = malloc(bytes);
+    pages = malloc(num_pages * sizeof(*pages));
+    c_scalar = malloc(num_pages * sizeof(uint32_t));
+    b_scalar = malloc(num_pages * sizeof(uint32_t));
+    c_vector = malloc(num_pages * sizeof(uint32_t));
+    b_vector = malloc(num_pages * sizeof(uint32_t));
+    if (!data || !pages || !c_scalar || !b_scalar || !c_vector || !b_vector) {
+        fprintf(stderr, "not enough memory\n");
+        goto out;
+    }
+    for (i = 0; i < bytes / sizeof(uint32_t); i++)
+        ((uint32_t *)data)[i] = next_rand(&state);
+    for (i = 0; i < num_pages; i++)
+        pages[i] = data + i * PAGE_SIZE_BENCH;
+
+    start = now_ns();
+    for (pass = 0; pass < SCAN_PASSES; pass++)
+        hash_pages_scalar(pages, num_pages, PAGE_SIZE_BENCH, 17, c_scalar, b_scalar);
+    scalar_ns = now_ns() - start;
+
+    start = now_ns();
+    for (pass = 0; pass < SCAN_PASSES; pass++)
+        hash_pages(pages, num_pages, PAGE_SIZE_BENCH, 17, c_vector, b_vector);
+    vector_ns = now_ns() - start;
+
+    printf("hash: %zu pages: scalar %.2f GB/s, %d lanes %.2f GB/s\n", num_pages,
+           gb_per_s(bytes * SCAN_PASSES, scalar_ns), HASH_LANES,
+           gb_per_s(bytes * SCAN_PASSES, vector_ns));
+
+    for (i = 0; i < num_pages; i++) {
+        if (c_scalar[i] != c_vector[i] || b_scalar[i] != b_vector[i]) {
+            fprintf(stderr, "error: hashes of page %zu differ\n", i);
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    free(b_vector);
+    free(c_vector);
+    free(b_scalar);
+    free(c_scalar);
+    free(pages);
+    free(data);
+    return rc;
+}
+
+static void usage(char *myname) {
+    fprintf(stderr, "Usage: %s [-n <pages>] [-d <distinct pages>] [-s <scan pages>] [-h]\n"
+                    "    -n  Number of synthetic KSM pages to look up.\n"
+                    "    -d  Number of distinct page contents among them.\n"
+                    "    -s  Number of pages checked for patterns and hashed.\n"
+                    "    -h  Display this help screen.\n",
+    myname);
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_pages = 4 * 1024 * 1024;
+    size_t num_distinct = 256 * 1024;
+    size_t num_scan = 16 * 1024;
+
+    opterr = 0;
+    do {
+        int c = getopt(argc, argv, "hn:d:s:");
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'n':
+                num_pages = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                num_distinct = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                num_scan = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            case '?':
+                fprintf(stderr, "unknown option: %c\n", optopt);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    } while (1);
+
+    if (num_pages == 0 || num_distinct == 0 || num_scan == 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench_pages(num_pages, num_distinct, 0) < 0 ||
+        bench_pages(num_pages, num_distinct, 1) < 0 ||
+        bench_pattern(num_scan) < 0 || bench_hash(num_scan) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
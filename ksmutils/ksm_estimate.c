@@ -0,0 +1,836 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <pagemap/pagemap.h>
+
+#include "ksm_estimate.h"
+#include "ksm_hash.h"
+
+#define MAX_FILENAME  64
+#define MAX_CMDLINE   256
+
+/* Pages handed to a worker at a time. */
+#define CHUNK_PAGES   1024
+
+/* Maximum number of pages read from /proc/PID/mem at once. */
+#define READ_BATCH_PAGES 64
+
+/* Number of records read from a spilled run at a time. */
+#define RUN_BUFFER_RECORDS 4096
+
+/*
+ * Runs merged at once. With more runs than this, groups of them are first
+ * merged into longer runs, so that the read buffers stay bounded however
+ * small the -m budget is compared to the scan.
+ */
+#define MERGE_FAN_IN  64
+
+/*
+ * Different page contents with the same hash that are told apart when
+ * looking for duplicates. Past this, further contents are counted as unique,
+ * which only underestimates the savings on an extremely unlikely collision.
+ */
+#define MAX_CONTENTS  4
+
+extern int getprocname(pid_t pid, char *buf, int len);
+
+struct est_proc {
+    pm_process_t *proc;
+    pid_t pid;
+    int mem_fd;
+    char cmdline[MAX_CMDLINE];
+};
+
+struct est_map {
+    pm_map_t *map;
+    struct est_proc *proc;
+    /* Updated by the workers with atomic adds. */
+    size_t scanned;
+    size_t zero;
+    /* Pages that would be freed by merging them with an identical page. */
+    size_t dup;
+};
+
+/* A hashed page, identified by its mapping and page index in the mapping. */
+struct page_record {
+    uint64_t hash;
+    uint32_t map;
+    uint32_t page;
+};
+
+/*
+ * A sorted run of records, either kept in memory or spilled to the spill
+ * file at offset and read back through buf.
+ */
+struct run {
+    /* Descriptor of the spill file, or -1 for a run kept in memory. */
+    int fd;
+    off64_t offset;
+    /* Records of a spilled run that are still in the file. */
+    size_t remaining;
+    bool failed;
+    struct page_record *buf;
+    size_t len, pos;
+};
+
+struct estimator {
+    pm_kernel_t *ker;
+    size_t pagesize;
+
+    struct est_proc *procs;
+    size_t num_procs;
+    struct est_map *maps;
+    size_t num_maps;
+
+    pthread_mutex_t lock;
+    /* Next chunk of work, protected by lock. */
+    size_t next_map;
+    unsigned long next_page;
+    /* Sorted runs produced by the workers, protected by lock. */
+    struct run *runs;
+    size_t num_runs, runs_size;
+    int error;
+
+    /*
+     * Every spilled run is written to this one file, so that the number of
+     * runs does not run into the open file limit. spill_end is protected by
+     * lock.
+     */
+    FILE *spill_file;
+    off64_t spill_end;
+
+    /* Number of records each worker can hold before spilling. */
+    size_t worker_records;
+};
+
+struct worker {
+    struct estimator *est;
+    pthread_t thread;
+    uint8_t *data;
+    uint64_t *flags;
+    uint64_t *counts;
+    struct page_record *records;
+    size_t num_records;
+};
+
+static int cmp_records(const void *a, const void *b) {
+    const struct page_record *ra = a;
+    const struct page_record *rb = b;
+
+    if (ra->hash != rb->hash)
+        return (ra->hash < rb->hash) ? -1 : 1;
+    if (ra->map != rb->map)
+        return (ra->map < rb->map) ? -1 : 1;
+    if (ra->page != rb->page)
+        return (ra->page < rb->page) ? -1 : 1;
+    return 0;
+}
+
+static int add_run(struct estimator *est, struct run *run) {
+    int rc = 0;
+
+    pthread_mutex_lock(&est->lock);
+    if (est->num_runs == est->runs_size) {
+        size_t new_size = est->runs_size ? est->runs_size * 2 : 16;
+        struct run *tmp = realloc(est->runs, new_size * sizeof(*est->runs));
+        if (tmp == NULL) {
+            rc = -1;
+            goto out;
+        }
+        est->runs = tmp;
+        est->runs_size = new_size;
+    }
+    est->runs[est->num_runs++] = *run;
+out:
+    pthread_mutex_unlock(&est->lock);
+    return rc;
+}
+
+/*
+ * Reserve space for len records at the end of the spill file, creating it
+ * the first time, and return its offset.
+ */
+static int reserve_spill(struct estimator *est, size_t len, off64_t *offset) {
+    int rc = 0;
+
+    pthread_mutex_lock(&est->lock);
+    if (est->spill_file == NULL) {
+        est->spill_file = tmpfile();
+        if (est->spill_file == NULL) {
+            fprintf(stderr, "error: could not create temporary file: %s\n", strerror(errno));
+            rc = -1;
+            goto out;
+        }
+    }
+    *offset = est->spill_end;
+    est->spill_end += (off64_t)len * sizeof(struct page_record);
+out:
+    pthread_mutex_unlock(&est->lock);
+    return rc;
+}
+
+static int write_spill(struct estimator *est, const struct page_record *recs, size_t len,
+                       off64_t offset) {
+    const char *p = (const char *)recs;
+    size_t size = len * sizeof(*recs);
+    ssize_t n;
+
+    while (size > 0) {
+        n = pwrite64(fileno(est->spill_file), p, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "error: could not write temporary file: %s\n",
+                    n < 0 ? strerror(errno) : "short write");
+            return -1;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Sort the records of the worker and write them out as a new run. */
+static int spill_records(struct worker *w) {
+    struct run run;
+
+    qsort(w->records, w->num_records, sizeof(*w->records), cmp_records);
+
+    memset(&run, 0, sizeof(run));
+    run.remaining = w->num_records;
+    if (reserve_spill(w->est, w->num_records, &run.offset) < 0 ||
+            write_spill(w->est, w->records, w->num_records, run.offset) < 0)
+        return -1;
+    run.fd = fileno(w->est->spill_file);
+
+    if (add_run(w->est, &run) < 0) {
+        fprintf(stderr, "error: not enough memory for runs\n");
+        return -1;
+    }
+
+    w->num_records = 0;
+    return 0;
+}
+
+/* Hand out the next chunk of pages of a private mapping to scan. */
+static bool next_work(struct estimator *est, size_t *map, unsigned long *first, size_t *count) {
+    bool found = false;
+    unsigned long pages;
+
+    pthread_mutex_lock(&est->lock);
+    while (!est->error && est->next_map < est->num_maps) {
+        pm_map_t *m = est->maps[est->next_map].map;
+
+        pages = (pm_map_end(m) - pm_map_start(m)) / est->pagesize;
+        if (!(pm_map_flags(m) & PM_MAP_PRIVATE) || est->next_page >= pages) {
+            est->next_map++;
+            est->next_page = 0;
+            continue;
+        }
+
+        *map = est->next_map;
+        *first = est->next_page;
+        *count = (pages - est->next_page < CHUNK_PAGES) ? pages - est->next_page : CHUNK_PAGES;
+        est->next_page += *count;
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&est->lock);
+
+    return found;
+}
+
+/*
+ * Read the flags and map counts of every present page in pagemap, with one
+ * read of each for every run of physically contiguous pages.
+ */
+static void read_page_info(pm_kernel_t *ker, uint64_t *pagemap, size_t len,
+                           uint64_t *flags, uint64_t *counts) {
+    size_t j, run;
+    unsigned long pfn;
+
+    j = 0;
+    while (j < len) {
+        if (!PM_PAGEMAP_PRESENT(pagemap[j]) || PM_PAGEMAP_SWAPPED(pagemap[j])) {
+            flags[j] = 0;
+            counts[j++] = 0;
+            continue;
+        }
+        pfn = PM_PAGEMAP_PFN(pagemap[j]);
+        for (run = 1; j + run < len; run++) {
+            if (!PM_PAGEMAP_PRESENT(pagemap[j + run]) || PM_PAGEMAP_SWAPPED(pagemap[j + run]) ||
+                    PM_PAGEMAP_PFN(pagemap[j + run]) != pfn + run) {
+                break;
+            }
+        }
+        if (pm_kernel_flags_range(ker, pfn, run, &flags[j]) ||
+                pm_kernel_count_range(ker, pfn, run, &counts[j])) {
+            memset(&flags[j], 0, run * sizeof(*flags));
+            memset(&counts[j], 0, run * sizeof(*counts));
+        }
+        j += run;
+    }
+}
+
+static inline bool is_candidate(uint64_t flags, uint64_t count) {
+    /* Anonymous pages mapped only once, and not already merged by KSM. */
+    return (flags & PM_PAGE_ANON) && !(flags & PM_PAGE_KSM) && count == 1;
+}
+
+static int scan_chunk(struct worker *w, size_t map_index, unsigned long first, size_t count) {
+    struct estimator *est = w->est;
+    struct est_map *map = &est->maps[map_index];
+    size_t pagesize = est->pagesize;
+    unsigned long start = pm_map_start(map->map) + first * pagesize;
+    uint64_t *pagemap;
+    size_t len, j, k, run, num_read, num_hashed;
+    size_t scanned = 0, zero = 0;
+    const uint8_t *pages[READ_BATCH_PAGES];
+    size_t offsets[READ_BATCH_PAGES];
+    uint32_t c[READ_BATCH_PAGES], b[READ_BATCH_PAGES];
+    ssize_t bytes;
+    int error;
+
+    error = pm_process_pagemap_range(map->proc->proc, start, start + count * pagesize,
+                                     &pagemap, &len);
+    if (error || len == 0)
+        return 0;
+
+    read_page_info(est->ker, pagemap, len, w->flags, w->counts);
+
+    j = 0;
+    while (j < len) {
+        if (!is_candidate(w->flags[j], w->counts[j])) {
+            j++;
+            continue;
+        }
+        for (run = 1; run < READ_BATCH_PAGES && j + run < len; run++) {
+            if (!is_candidate(w->flags[j + run], w->counts[j + run]))
+                break;
+        }
+
+        bytes = pread64(map->proc->mem_fd, w->data, run * pagesize,
+                        (off64_t)(start + j * pagesize));
+        num_read = (bytes < 0) ? 0 : (size_t)bytes / pagesize;
+
+        /* Zero pages need no hash, the others are hashed together. */
+        num_hashed = 0;
+        for (k = 0; k < num_read; k++) {
+            const uint8_t *page = w->data + k * pagesize;
+
+            if (page[0] == 0 && is_pattern(page, pagesize)) {
+                zero++;
+                continue;
+            }
+            pages[num_hashed] = page;
+            offsets[num_hashed] = k;
+            num_hashed++;
+        }
+        scanned += num_read;
+        hash_pages(pages, num_hashed, pagesize, 17, c, b);
+
+        for (k = 0; k < num_hashed; k++) {
+            if (w->num_records == est->worker_records && spill_records(w) < 0) {
+                free(pagemap);
+                return -1;
+            }
+            w->records[w->num_records].hash = ((uint64_t)b[k] << 32) | c[k];
+            w->records[w->num_records].map = map_index;
+            w->records[w->num_records].page = first + j + offsets[k];
+            w->num_records++;
+        }
+        j += run;
+    }
+    free(pagemap);
+
+    __sync_fetch_and_add(&map->scanned, scanned);
+    __sync_fetch_and_add(&map->zero, zero);
+    return 0;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    struct estimator *est = w->est;
+    size_t map, count;
+    unsigned long first;
+    struct run run;
+
+    while (next_work(est, &map, &first, &count)) {
+        if (scan_chunk(w, map, first, count) < 0)
+            goto err;
+    }
+
+    /* Whatever is left becomes an in-memory run. */
+    qsort(w->records, w->num_records, sizeof(*w->records), cmp_records);
+    memset(&run, 0, sizeof(run));
+    run.fd = -1;
+    run.buf = w->records;
+    run.len = w->num_records;
+    if (add_run(est, &run) < 0)
+        goto err;
+    w->records = NULL;
+    return NULL;
+
+err:
+    pthread_mutex_lock(&est->lock);
+    est->error = -1;
+    pthread_mutex_unlock(&est->lock);
+    return NULL;
+}
+
+/* Make sure the current record of run is in its buffer. */
+static bool run_peek(struct run *run, struct page_record **rec) {
+    size_t len;
+
+    if (run->pos == run->len) {
+        if (run->fd < 0 || run->remaining == 0)
+            return false;
+        len = run->remaining < RUN_BUFFER_RECORDS ? run->remaining : RUN_BUFFER_RECORDS;
+        if (pread64(run->fd, run->buf, len * sizeof(*run->buf), run->offset) !=
+                (ssize_t)(len * sizeof(*run->buf))) {
+            run->failed = true;
+            run->remaining = 0;
+            return false;
+        }
+        run->offset += len * sizeof(*run->buf);
+        run->remaining -= len;
+        run->len = len;
+        run->pos = 0;
+    }
+    *rec = &run->buf[run->pos];
+    return true;
+}
+
+/*
+ * Min-heap of run indices ordered by their current record, used to merge
+ * the runs.
+ */
+struct run_heap {
+    struct run *runs;
+    size_t *heap;
+    size_t len;
+};
+
+static bool heap_less(struct run_heap *h, size_t a, size_t b) {
+    struct page_record *ra, *rb;
+
+    run_peek(&h->runs[h->heap[a]], &ra);
+    run_peek(&h->runs[h->heap[b]], &rb);
+    return cmp_records(ra, rb) < 0;
+}
+
+static void heap_sift_down(struct run_heap *h, size_t i) {
+    size_t child, tmp;
+
+    while ((child = 2 * i + 1) < h->len) {
+        if (child + 1 < h->len && heap_less(h, child + 1, child))
+            child++;
+        if (!heap_less(h, child, i))
+            break;
+        tmp = h->heap[i];
+        h->heap[i] = h->heap[child];
+        h->heap[child] = tmp;
+        i = child;
+    }
+}
+
+/* Remove the smallest record from the heap and return it through rec. */
+static bool heap_pop(struct run_heap *h, struct page_record *rec) {
+    struct run *run;
+    struct page_record *top;
+
+    if (h->len == 0)
+        return false;
+
+    run = &h->runs[h->heap[0]];
+    run_peek(run, &top);
+    *rec = *top;
+    run->pos++;
+
+    if (!run_peek(run, &top)) {
+        h->heap[0] = h->heap[--h->len];
+    }
+    heap_sift_down(h, 0);
+    return true;
+}
+
+/* Give the spilled runs a read buffer and build a heap over them. */
+static int heap_init(struct run_heap *h, struct run *runs, size_t num_runs) {
+    struct page_record *next;
+    size_t i;
+
+    h->runs = runs;
+    h->len = 0;
+    h->heap = malloc(num_runs * sizeof(*h->heap));
+    if (h->heap == NULL)
+        return -1;
+
+    for (i = 0; i < num_runs; i++) {
+        if (runs[i].fd >= 0 && runs[i].buf == NULL) {
+            runs[i].buf = malloc(RUN_BUFFER_RECORDS * sizeof(*runs[i].buf));
+            if (runs[i].buf == NULL) {
+                free(h->heap);
+                h->heap = NULL;
+                return -1;
+            }
+        }
+        if (run_peek(&runs[i], &next))
+            h->heap[h->len++] = i;
+    }
+    for (i = h->len / 2; i-- > 0;)
+        heap_sift_down(h, i);
+    return 0;
+}
+
+static bool runs_failed(struct run *runs, size_t num_runs) {
+    size_t i;
+
+    for (i = 0; i < num_runs; i++) {
+        if (runs[i].failed) {
+            fprintf(stderr, "error: could not read temporary file\n");
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Merge the first MERGE_FAN_IN runs into a single spilled run, which goes
+ * to the end of the list so that the next merges take the other runs first.
+ */
+static int merge_runs(struct estimator *est) {
+    struct run_heap h;
+    struct run run;
+    struct page_record *out;
+    size_t total = 0, len = 0;
+    off64_t offset;
+    size_t i;
+    int rc = -1;
+
+    out = malloc(RUN_BUFFER_RECORDS * sizeof(*out));
+    if (out == NULL || heap_init(&h, est->runs, MERGE_FAN_IN) < 0) {
+        fprintf(stderr, "error: not enough memory to merge the page hashes\n");
+        free(out);
+        return -1;
+    }
+
+    for (i = 0; i < MERGE_FAN_IN; i++)
+        total += est->runs[i].remaining + est->runs[i].len - est->runs[i].pos;
+    if (reserve_spill(est, total, &offset) < 0)
+        goto out;
+
+    memset(&run, 0, sizeof(run));
+    run.fd = fileno(est->spill_file);
+    run.offset = offset;
+    run.remaining = total;
+    while (heap_pop(&h, &out[len])) {
+        if (++len < RUN_BUFFER_RECORDS)
+            continue;
+        if (write_spill(est, out, len, offset) < 0)
+            goto out;
+        offset += len * sizeof(*out);
+        len = 0;
+    }
+    if (len > 0 && write_spill(est, out, len, offset) < 0)
+        goto out;
+    if (runs_failed(est->runs, MERGE_FAN_IN))
+        goto out;
+
+    for (i = 0; i < MERGE_FAN_IN; i++)
+        free(est->runs[i].buf);
+    est->num_runs -= MERGE_FAN_IN;
+    memmove(est->runs, est->runs + MERGE_FAN_IN, est->num_runs * sizeof(*est->runs));
+    est->runs[est->num_runs++] = run;
+    rc = 0;
+
+out:
+    free(h.heap);
+    free(out);
+    return rc;
+}
+
+static bool read_page(struct estimator *est, const struct page_record *rec, uint8_t *buf) {
+    struct est_map *map = &est->maps[rec->map];
+    unsigned long addr = pm_map_start(map->map) + (unsigned long)rec->page * est->pagesize;
+
+    return pread64(map->proc->mem_fd, buf, est->pagesize, (off64_t)addr) ==
+            (ssize_t)est->pagesize;
+}
+
+/*
+ * Merge all of the runs, and compare the pages of every group of records
+ * with the same hash, counting the copies of each distinct content after
+ * the first one as savings of their mapping.
+ */
+static int find_duplicates(struct estimator *est, size_t *num_groups) {
+    struct run_heap h;
+    struct page_record rec, *next;
+    uint8_t *contents, *buf;
+    size_t copies[MAX_CONTENTS];
+    size_t num_contents = 0;
+    uint64_t group_hash = 0;
+    bool in_group = false;
+    size_t i;
+
+    *num_groups = 0;
+
+    while (est->num_runs > MERGE_FAN_IN) {
+        if (merge_runs(est) < 0)
+            return -1;
+    }
+
+    contents = malloc((MAX_CONTENTS + 1) * est->pagesize);
+    if (contents == NULL || heap_init(&h, est->runs, est->num_runs) < 0) {
+        fprintf(stderr, "error: not enough memory to merge the page hashes\n");
+        free(contents);
+        return -1;
+    }
+    buf = contents + MAX_CONTENTS * est->pagesize;
+
+    while (heap_pop(&h, &rec)) {
+        if (!in_group || rec.hash != group_hash) {
+            /* A page with a hash nobody else has can't be a duplicate. */
+            if (h.len == 0 || (run_peek(&h.runs[h.heap[0]], &next), next->hash != rec.hash)) {
+                in_group = false;
+                continue;
+            }
+            in_group = true;
+            group_hash = rec.hash;
+            num_contents = 0;
+        }
+
+        /* The page may have changed or gone away since it was hashed. */
+        if (!read_page(est, &rec, buf))
+            continue;
+
+        for (i = 0; i < num_contents; i++) {
+            if (!memcmp(buf, contents + i * est->pagesize, est->pagesize))
+                break;
+        }
+        if (i < num_contents) {
+            if (copies[i]++ == 1)
+                (*num_groups)++;
+            est->maps[rec.map].dup++;
+        } else if (num_contents < MAX_CONTENTS) {
+            memcpy(contents + num_contents * est->pagesize, buf, est->pagesize);
+            copies[num_contents++] = 1;
+        }
+    }
+
+    free(h.heap);
+    free(contents);
+    return runs_failed(est->runs, est->num_runs) ? -1 : 0;
+}
+
+static void print_results(struct estimator *est, size_t num_groups, bool verbose) {
+    size_t kb = est->pagesize / 1024;
+    size_t total_scanned = 0, total_zero = 0, total_dup = 0;
+    size_t scanned, zero, dup;
+    size_t i, m;
+
+    printf("\n%8s %10s %10s %10s %10s  %s\n",
+           "PID", "Scanned", "Zero", "Dup", "Savings", "cmdline");
+    m = 0;
+    for (i = 0; i < est->num_procs; i++) {
+        struct est_proc *proc = &est->procs[i];
+        size_t first_map = m;
+
+        scanned = zero = dup = 0;
+        for (; m < est->num_maps && est->maps[m].proc == proc; m++) {
+            scanned += est->maps[m].scanned;
+            zero += est->maps[m].zero;
+            dup += est->maps[m].dup;
+        }
+        total_scanned += scanned;
+        total_zero += zero;
+        total_dup += dup;
+
+        if (scanned == 0)
+            continue;
+        printf("%8d %9zuK %9zuK %9zuK %9zuK  %s\n", proc->pid, scanned * kb,
+               zero * kb, dup * kb, (zero + dup) * kb, proc->cmdline);
+
+        if (!verbose)
+            continue;
+        for (; first_map < m; first_map++) {
+            struct est_map *map = &est->maps[first_map];
+
+            if (map->zero + map->dup == 0)
+                continue;
+            printf("%8s %9zuK %9zuK %9zuK %9zuK    %08lx-%08lx %s\n", "",
+                   map->scanned * kb, map->zero * kb, map->dup * kb,
+                   (map->zero + map->dup) * kb, pm_map_start(map->map),
+                   pm_map_end(map->map), pm_map_name(map->map));
+        }
+    }
+
+    printf("\nScanned %zuK of private anonymous pages in %zu processes\n",
+           total_scanned * kb, est->num_procs);
+    printf("Zero-filled pages: %zuK\n", total_zero * kb);
+    printf("Duplicate pages: %zuK that could be merged into %zu pages\n",
+           total_dup * kb, num_groups);
+    printf("Estimated savings: %zuK\n", (total_zero + total_dup) * kb);
+}
+
+static void free_estimator(struct estimator *est) {
+    size_t i;
+
+    for (i = 0; i < est->num_runs; i++)
+        free(est->runs[i].buf);
+    free(est->runs);
+    if (est->spill_file)
+        fclose(est->spill_file);
+    for (i = 0; i < est->num_procs; i++) {
+        if (est->procs[i].mem_fd >= 0)
+            close(est->procs[i].mem_fd);
+        if (est->procs[i].proc)
+            pm_process_destroy(est->procs[i].proc);
+    }
+    free(est->procs);
+    free(est->maps);
+    pthread_mutex_destroy(&est->lock);
+}
+
+static int add_process(struct estimator *est, pid_t pid) {
+    struct est_proc *proc = &est->procs[est->num_procs];
+    char filename[MAX_FILENAME];
+    pm_map_t **maps;
+    size_t num_maps, i;
+    struct est_map *tmp;
+
+    memset(proc, 0, sizeof(*proc));
+    proc->pid = pid;
+    proc->mem_fd = -1;
+
+    if (pm_process_create(est->ker, pid, &proc->proc)) {
+        fprintf(stderr, "warning: could not create process interface for %d\n", pid);
+        return -1;
+    }
+    snprintf(filename, MAX_FILENAME, "/proc/%d/mem", pid);
+    proc->mem_fd = open(filename, O_RDONLY);
+    if (proc->mem_fd < 0 || pm_process_maps(proc->proc, &maps, &num_maps)) {
+        fprintf(stderr, "warning: could not read the memory of %d\n", pid);
+        if (proc->mem_fd >= 0)
+            close(proc->mem_fd);
+        pm_process_destroy(proc->proc);
+        return -1;
+    }
+    if (getprocname(pid, proc->cmdline, sizeof(proc->cmdline)) < 0)
+        proc->cmdline[0] = '\0';
+
+    tmp = realloc(est->maps, (est->num_maps + num_maps) * sizeof(*est->maps));
+    if (num_maps && tmp == NULL) {
+        free(maps);
+        close(proc->mem_fd);
+        pm_process_destroy(proc->proc);
+        return -1;
+    }
+    est->maps = tmp;
+    for (i = 0; i < num_maps; i++) {
+        memset(&est->maps[est->num_maps], 0, sizeof(*est->maps));
+        est->maps[est->num_maps].map = maps[i];
+        est->maps[est->num_maps].proc = proc;
+        est->num_maps++;
+    }
+    free(maps);
+
+    est->num_procs++;
+    return 0;
+}
+
+int estimate_savings(pm_kernel_t *ker, pid_t *pids, size_t num_pids,
+                     size_t num_threads, size_t mem_limit, bool verbose) {
+    struct estimator est;
+    struct worker *workers;
+    size_t i, started, num_groups;
+    int rc = -1;
+
+    memset(&est, 0, sizeof(est));
+    est.ker = ker;
+    est.pagesize = pm_kernel_pagesize(ker);
+    pthread_mutex_init(&est.lock, NULL);
+
+    if (num_threads == 0)
+        num_threads = 1;
+    est.worker_records = mem_limit / num_threads / sizeof(struct page_record);
+    if (est.worker_records < RUN_BUFFER_RECORDS)
+        est.worker_records = RUN_BUFFER_RECORDS;
+
+    est.procs = calloc(num_pids, sizeof(*est.procs));
+    workers = calloc(num_threads, sizeof(*workers));
+    if (est.procs == NULL || workers == NULL) {
+        fprintf(stderr, "error: not enough memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < num_pids; i++) {
+        /* Processes that went away are simply skipped. */
+        add_process(&est, pids[i]);
+    }
+    for (started = 0; started < num_threads; started++) {
+        struct worker *w = &workers[started];
+
+        w->est = &est;
+        w->data = malloc(READ_BATCH_PAGES * est.pagesize);
+        w->flags = malloc(CHUNK_PAGES * sizeof(*w->flags));
+        w->counts = malloc(CHUNK_PAGES * sizeof(*w->counts));
+        w->records = malloc(est.worker_records * sizeof(*w->records));
+        if (w->data == NULL || w->flags == NULL || w->counts == NULL || w->records == NULL) {
+            fprintf(stderr, "error: not enough memory for worker buffers\n");
+            est.error = -1;
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+            fprintf(stderr, "error: could not start worker thread\n");
+            est.error = -1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (est.error)
+        goto out;
+
+    if (find_duplicates(&est, &num_groups) < 0)
+        goto out;
+    print_results(&est, num_groups, verbose);
+    rc = 0;
+
+out:
+    if (workers) {
+        for (i = 0; i < num_threads; i++) {
+            free(workers[i].data);
+            free(workers[i].flags);
+            free(workers[i].counts);
+            free(workers[i].records);
+        }
+        free(workers);
+    }
+    free_estimator(&est);
+    return rc;
+}
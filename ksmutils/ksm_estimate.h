@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _KSM_ESTIMATE_H_
+#define _KSM_ESTIMATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <pagemap/pagemap.h>
+
+/* Default amount of memory used to hold page hashes before spilling. */
+#define ESTIMATE_DEFAULT_MEM_MB 64
+
+/*
+ * Estimate how much memory KSM would save by merging the present, private,
+ * anonymous pages of the given processes that have not been merged yet,
+ * and print the result per process, and also per mapping if verbose.
+ *
+ * Pages are hashed by num_threads threads. Up to mem_limit bytes of hashes
+ * are kept in memory; past that they are sorted and spilled to temporary
+ * files, which are merged at the end. Pages with the same hash are compared
+ * in full before being counted as duplicates.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int estimate_savings(pm_kernel_t *ker, pid_t *pids, size_t num_pids,
+                     size_t num_threads, size_t mem_limit, bool verbose);
+
+#endif
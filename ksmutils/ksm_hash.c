@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "ksm_hash.h"
+
+extern void hashword2(const uint32_t *, size_t, uint32_t *, uint32_t *);
+
+/*
+ * GCC vector extension, which turns into NEON or SSE instructions where they
+ * are available and into plain scalar code elsewhere.
+ */
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+/* Same mixing as lookup3.c. */
+#define rot(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
+
+#define mix(a,b,c) \
+{ \
+  a -= c;  a ^= rot(c, 4);  c += b; \
+  b -= a;  b ^= rot(a, 6);  a += c; \
+  c -= b;  c ^= rot(b, 8);  b += a; \
+  a -= c;  a ^= rot(c,16);  c += b; \
+  b -= a;  b ^= rot(a,19);  a += c; \
+  c -= b;  c ^= rot(b, 4);  b += a; \
+}
+
+#define final(a,b,c) \
+{ \
+  c ^= b; c -= rot(b,14); \
+  a ^= c; a -= rot(c,11); \
+  b ^= a; b -= rot(a,25); \
+  c ^= b; c -= rot(b,16); \
+  a ^= c; a -= rot(c,4);  \
+  b ^= a; b -= rot(a,14); \
+  c ^= b; c -= rot(b,24); \
+}
+
+bool is_pattern_scalar(const uint8_t *data, size_t len) {
+    size_t i;
+    uint8_t first_byte = data[0];
+
+    for (i = 1; i < len; i++) {
+        if (first_byte != data[i]) return false;
+    }
+
+    return true;
+}
+
+bool is_pattern(const uint8_t *data, size_t len) {
+    v16u8 pattern, w0, w1, w2, w3, diff;
+    uint64_t words[2];
+    size_t i;
+
+    memset(&pattern, data[0], sizeof(pattern));
+
+    /* Compare 64 bytes at a time, memcpy makes the loads alignment safe. */
+    for (i = 0; i + 4 * sizeof(v16u8) <= len; i += 4 * sizeof(v16u8)) {
+        memcpy(&w0, data + i, sizeof(w0));
+        memcpy(&w1, data + i + sizeof(v16u8), sizeof(w1));
+        memcpy(&w2, data + i + 2 * sizeof(v16u8), sizeof(w2));
+        memcpy(&w3, data + i + 3 * sizeof(v16u8), sizeof(w3));
+        diff = (w0 ^ pattern) | (w1 ^ pattern) | (w2 ^ pattern) | (w3 ^ pattern);
+        memcpy(words, &diff, sizeof(words));
+        if (words[0] | words[1])
+            return false;
+    }
+
+    for (; i < len; i++) {
+        if (data[i] != data[0]) return false;
+    }
+
+    return true;
+}
+
+void hash_pages_scalar(const uint8_t *const *pages, size_t num_pages, size_t pagesize,
+                       uint32_t seed, uint32_t *c_out, uint32_t *b_out) {
+    size_t i;
+    uint32_t c, b;
+
+    for (i = 0; i < num_pages; i++) {
+        c = seed;
+        b = 0;
+        hashword2((const uint32_t *)pages[i], pagesize / sizeof(uint32_t), &c, &b);
+        c_out[i] = c;
+        if (b_out)
+            b_out[i] = b;
+    }
+}
+
+/* Runs op for each of the HASH_LANES lanes, l being the lane number. */
+#define FOR_LANES(op) { op(0) op(1) op(2) op(3) }
+
+/*
+ * hashword2() of HASH_LANES keys of the same length at once. Every lane has
+ * its own a, b and c, so the mixing of the different keys, each a long chain
+ * of dependent operations, overlaps in the pipeline instead of running one
+ * after the other.
+ */
+static void hashword2_lanes(const uint32_t *const *k, size_t length, uint32_t seed,
+                            uint32_t *c_out, uint32_t *b_out) {
+    const uint32_t *k0 = k[0], *k1 = k[1], *k2 = k[2], *k3 = k[3];
+    uint32_t a0, b0, c0, a1, b1, c1, a2, b2, c2, a3, b3, c3;
+    size_t i = 0;
+
+    /* Set up the internal state, exactly as hashword2() with *pb == 0. */
+#define INIT(l) a##l = b##l = c##l = 0xdeadbeef + ((uint32_t)length << 2) + seed;
+    FOR_LANES(INIT)
+#undef INIT
+
+#define STEP(l) a##l += k##l[i]; b##l += k##l[i + 1]; c##l += k##l[i + 2]; \
+                mix(a##l, b##l, c##l)
+    while (length - i > 3) {
+        FOR_LANES(STEP)
+        i += 3;
+    }
+#undef STEP
+
+    /* Handle the last 3 uint32_t's, all the cases fall through. */
+#define LAST_C(l) c##l += k##l[i + 2];
+#define LAST_B(l) b##l += k##l[i + 1];
+#define LAST_A(l) a##l += k##l[i]; final(a##l, b##l, c##l)
+    switch (length - i) {
+    case 3:
+        FOR_LANES(LAST_C)
+    case 2:
+        FOR_LANES(LAST_B)
+    case 1:
+        FOR_LANES(LAST_A)
+    case 0:
+        break;
+    }
+#undef LAST_A
+#undef LAST_B
+#undef LAST_C
+
+#define OUT(l) c_out[l] = c##l; if (b_out) b_out[l] = b##l;
+    FOR_LANES(OUT)
+#undef OUT
+}
+
+void hash_pages(const uint8_t *const *pages, size_t num_pages, size_t pagesize,
+                uint32_t seed, uint32_t *c_out, uint32_t *b_out) {
+    size_t i;
+
+    for (i = 0; i + HASH_LANES <= num_pages; i += HASH_LANES) {
+        hashword2_lanes((const uint32_t *const *)(pages + i), pagesize / sizeof(uint32_t),
+                        seed, c_out + i, b_out ? b_out + i : NULL);
+    }
+
+    hash_pages_scalar(pages + i, num_pages - i, pagesize, seed, c_out + i,
+                      b_out ? b_out + i : NULL);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _KSM_HASH_H_
+#define _KSM_HASH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of pages hash_pages() hashes side by side. */
+#define HASH_LANES 4
+
+/* Whether all len bytes of data are equal to the first one. */
+bool is_pattern(const uint8_t *data, size_t len);
+
+/* Byte at a time version of is_pattern(), for comparison. */
+bool is_pattern_scalar(const uint8_t *data, size_t len);
+
+/*
+ * Hash num_pages pages of pagesize bytes, which must be a multiple of 4 and
+ * each page 4-byte aligned. The results are exactly those of
+ *
+ *   c = seed; b = 0;
+ *   hashword2((uint32_t *)pages[i], pagesize / 4, &c, &b);
+ *
+ * so c_out[i] is also hashword((uint32_t *)pages[i], pagesize / 4, seed).
+ * b_out may be NULL if only c is wanted.
+ *
+ * Groups of HASH_LANES pages are hashed at once, interleaved so the CPU can
+ * work on all of them in parallel; any remaining pages are hashed one at a
+ * time.
+ */
+void hash_pages(const uint8_t *const *pages, size_t num_pages, size_t pagesize,
+                uint32_t seed, uint32_t *c_out, uint32_t *b_out);
+
+/* One page at a time version of hash_pages(), for comparison. */
+void hash_pages_scalar(const uint8_t *const *pages, size_t num_pages, size_t pagesize,
+                       uint32_t seed, uint32_t *c_out, uint32_t *b_out);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksm_pages.h"
+
+#define INITIAL_PAGES      64
+#define INITIAL_INDEX      128
+
+/* Smallest vaddr array, size class 0. */
+#define VADDR_MIN_ENTRIES  4
+#define VADDR_CHUNK_SIZE   (64 * 1024)
+
+/*
+ * The content hashes are already well mixed, but pages that only differ in
+ * a few bits can still share low bits, so stir them a little.
+ */
+static inline size_t index_slot(uint32_t hash, size_t mask) {
+    return (hash * 0x9e3779b1U) & mask;
+}
+
+static int grow_index(struct ksm_pages *kp) {
+    size_t new_size = kp->index_size ? kp->index_size * 2 : INITIAL_INDEX;
+    size_t mask = new_size - 1;
+    uint32_t *index;
+    size_t i, slot;
+
+    index = calloc(new_size, sizeof(*index));
+    if (index == NULL)
+        return -1;
+
+    /* Re-insert every page, the old index isn't needed for that. */
+    for (i = 0; i < kp->len; i++) {
+        slot = index_slot(kp->pages[i].hash, mask);
+        while (index[slot])
+            slot = (slot + 1) & mask;
+        index[slot] = i + 1;
+    }
+
+    free(kp->index);
+    kp->index = index;
+    kp->index_size = new_size;
+    return 0;
+}
+
+struct ksm_page *ksm_pages_find(struct ksm_pages *kp, uint32_t hash) {
+    size_t mask, slot;
+    uint32_t entry;
+
+    if (kp->index_size == 0)
+        return NULL;
+
+    mask = kp->index_size - 1;
+    for (slot = index_slot(hash, mask); (entry = kp->index[slot]) != 0;
+         slot = (slot + 1) & mask) {
+        if (kp->pages[entry - 1].hash == hash)
+            return &kp->pages[entry - 1];
+    }
+    return NULL;
+}
+
+struct ksm_page *ksm_pages_add(struct ksm_pages *kp, uint32_t hash) {
+    struct ksm_page *page;
+    size_t mask, slot;
+
+    if (kp->len == kp->size) {
+        size_t new_size = kp->size ? kp->size * 2 : INITIAL_PAGES;
+        struct ksm_page *tmp = realloc(kp->pages, new_size * sizeof(*kp->pages));
+        if (tmp == NULL)
+            return NULL;
+        kp->pages = tmp;
+        kp->size = new_size;
+    }
+
+    /* Keep the index at most half full. */
+    if ((kp->len + 1) * 2 > kp->index_size) {
+        if (grow_index(kp) < 0)
+            return NULL;
+    }
+
+    page = &kp->pages[kp->len];
+    memset(page, 0, sizeof(*page));
+    page->hash = hash;
+
+    mask = kp->index_size - 1;
+    slot = index_slot(hash, mask);
+    while (kp->index[slot])
+        slot = (slot + 1) & mask;
+    kp->index[slot] = ++kp->len;
+
+    return page;
+}
+
+static void *pool_chunk(struct vaddr_pool *pool, size_t size) {
+    char *chunk;
+
+    if (pool->num_chunks == pool->chunks_size) {
+        size_t new_size = pool->chunks_size ? pool->chunks_size * 2 : 16;
+        char **tmp = realloc(pool->chunks, new_size * sizeof(*pool->chunks));
+        if (tmp == NULL)
+            return NULL;
+        pool->chunks = tmp;
+        pool->chunks_size = new_size;
+    }
+
+    chunk = malloc(size);
+    if (chunk == NULL)
+        return NULL;
+    pool->chunks[pool->num_chunks++] = chunk;
+    return chunk;
+}
+
+static struct vaddr *pool_alloc(struct vaddr_pool *pool, unsigned int class) {
+    size_t bytes = (VADDR_MIN_ENTRIES * sizeof(struct vaddr)) << class;
+    void *block;
+
+    if (pool->free_list[class] != NULL) {
+        block = pool->free_list[class];
+        pool->free_list[class] = *(void **)block;
+        return block;
+    }
+
+    if (bytes > VADDR_CHUNK_SIZE / 4) {
+        /* Big arrays are rare, give them a chunk of their own. */
+        return pool_chunk(pool, bytes);
+    }
+
+    if (pool->cur_left < bytes) {
+        /* The tail of the old chunk is simply wasted. */
+        pool->cur = pool_chunk(pool, VADDR_CHUNK_SIZE);
+        if (pool->cur == NULL) {
+            pool->cur_left = 0;
+            return NULL;
+        }
+        pool->cur_left = VADDR_CHUNK_SIZE;
+    }
+
+    block = pool->cur;
+    pool->cur += bytes;
+    pool->cur_left -= bytes;
+    return block;
+}
+
+static void pool_release(struct vaddr_pool *pool, struct vaddr *block,
+                         unsigned int class) {
+    *(void **)block = pool->free_list[class];
+    pool->free_list[class] = block;
+}
+
+static unsigned int size_class(size_t entries) {
+    unsigned int class = 0;
+
+    while ((size_t)VADDR_MIN_ENTRIES << class < entries)
+        class++;
+    return class;
+}
+
+int ksm_page_add_vaddr(struct ksm_pages *kp, struct ksm_page *page,
+                       unsigned long addr, size_t pagesize, pid_t pid) {
+    struct vaddr *last;
+
+    if (page->vaddr_len > 0) {
+        last = &page->vaddr[page->vaddr_len - 1];
+        if (last->pid == pid && last->addr == addr - last->num_pages * pagesize) {
+            last->num_pages++;
+            return 0;
+        }
+    }
+
+    if (page->vaddr_len == page->vaddr_size) {
+        size_t new_size = page->vaddr_size ? page->vaddr_size * 2 : VADDR_MIN_ENTRIES;
+        unsigned int class = size_class(new_size);
+        struct vaddr *tmp;
+
+        if (class >= VADDR_POOL_CLASSES)
+            return -1;
+        tmp = pool_alloc(&kp->pool, class);
+        if (tmp == NULL)
+            return -1;
+        if (page->vaddr_len > 0) {
+            memcpy(tmp, page->vaddr, page->vaddr_len * sizeof(*tmp));
+            pool_release(&kp->pool, page->vaddr, class - 1);
+        }
+        page->vaddr = tmp;
+        page->vaddr_size = new_size;
+    }
+
+    page->vaddr[page->vaddr_len].addr = addr;
+    page->vaddr[page->vaddr_len].num_pages = 1;
+    page->vaddr[page->vaddr_len].pid = pid;
+    page->vaddr_len++;
+    return 0;
+}
+
+void ksm_pages_free(struct ksm_pages *kp) {
+    size_t i;
+
+    for (i = 0; i < kp->pool.num_chunks; i++) {
+        free(kp->pool.chunks[i]);
+    }
+    free(kp->pool.chunks);
+    free(kp->index);
+    free(kp->pages);
+    memset(kp, 0, sizeof(*kp));
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _KSM_PAGES_H_
+#define _KSM_PAGES_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define NO_PATTERN    0x100
+
+/* Number of power of two size classes of vaddr arrays in the pool. */
+#define VADDR_POOL_CLASSES 28
+
+struct vaddr {
+    unsigned long addr;
+    size_t num_pages;
+    pid_t pid;
+};
+
+struct ksm_page {
+    uint64_t count;
+    uint32_t hash;
+    struct vaddr *vaddr;
+    size_t vaddr_len, vaddr_size;
+    size_t vaddr_count;
+    uint16_t pattern;
+};
+
+/*
+ * Allocator for the vaddr arrays of all the pages. Arrays are carved out of
+ * large chunks in power of two sizes, arrays that are outgrown are kept on a
+ * free list for their size, and everything is released at once by
+ * ksm_pages_free().
+ */
+struct vaddr_pool {
+    void *free_list[VADDR_POOL_CLASSES];
+    char **chunks;
+    size_t num_chunks, chunks_size;
+    char *cur;
+    size_t cur_left;
+};
+
+struct ksm_pages {
+    struct ksm_page *pages;
+    size_t len, size;
+
+    /*
+     * Open addressing index from hash to (position in pages + 1), zero marks
+     * an empty slot. Only valid until pages is reordered, e.g. by sorting.
+     */
+    uint32_t *index;
+    size_t index_size;
+
+    struct vaddr_pool pool;
+};
+
+/* Return the page with the given hash, or NULL if there is none. */
+struct ksm_page *ksm_pages_find(struct ksm_pages *kp, uint32_t hash);
+
+/*
+ * Add a zeroed page with the given hash, which must not already be present.
+ * Returns NULL if out of memory. Pointers to pages are invalidated by the
+ * next call.
+ */
+struct ksm_page *ksm_pages_add(struct ksm_pages *kp, uint32_t hash);
+
+/*
+ * Record that page is mapped at addr in pid, merging with the previous
+ * range if it is contiguous. Returns 0 on success, -1 if out of memory.
+ */
+int ksm_page_add_vaddr(struct ksm_pages *kp, struct ksm_page *page,
+                       unsigned long addr, size_t pagesize, pid_t pid);
+
+/* Release all the memory held by kp. */
+void ksm_pages_free(struct ksm_pages *kp);
+
+#endif
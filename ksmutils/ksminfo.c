@@ -26,44 +26,24 @@
 
 #include <pagemap/pagemap.h>
 
-#define MAX_FILENAME  64
+#include "ksm_estimate.h"
+#include "ksm_hash.h"
+#include "ksm_pages.h"
 
-#define GROWTH_FACTOR 10
+#define MAX_FILENAME  64
 
-#define NO_PATTERN    0x100
+/* Maximum number of pages read from /proc/PID/mem at once. */
+#define READ_BATCH_PAGES 64
 
 #define PR_SORTED       1
 #define PR_VERBOSE      2
 #define PR_ALL          4
 
-struct vaddr {
-    unsigned long addr;
-    size_t num_pages;
-    pid_t pid;
-};
-
-struct ksm_page {
-    uint64_t count;
-    uint32_t hash;
-    struct vaddr *vaddr;
-    size_t vaddr_len, vaddr_size;
-    size_t vaddr_count;
-    uint16_t pattern;
-};
-
-struct ksm_pages {
-    struct ksm_page *pages;
-    size_t len, size;
-};
-
 static void usage(char *myname);
-static int getprocname(pid_t pid, char *buf, int len);
+int getprocname(pid_t pid, char *buf, int len);
 static int read_pages(struct ksm_pages *kp, pm_map_t **maps, size_t num_maps, uint8_t pr_flags);
 static void print_pages(struct ksm_pages *kp, uint8_t pr_flags);
-static void free_pages(struct ksm_pages *kp, uint8_t pr_flags);
-static bool is_pattern(uint8_t *data, size_t len);
 static int cmp_pages(const void *a, const void *b);
-extern uint32_t hashword(const uint32_t *, size_t, int32_t);
 
 int main(int argc, char *argv[]) {
     pm_kernel_t *ker;
@@ -78,16 +58,40 @@ int main(int argc, char *argv[]) {
     int rc = EXIT_SUCCESS;
     uint8_t pr_flags = 0;
     struct ksm_pages kp;
+    bool estimate = false;
+    long num_threads = 0;
+    size_t mem_limit = ESTIMATE_DEFAULT_MEM_MB * 1024 * 1024;
+    static const struct option long_options[] = {
+        { "estimate", no_argument, NULL, 'e' },
+        { NULL, 0, NULL, 0 },
+    };
 
     memset(&kp, 0, sizeof(kp));
 
     opterr = 0;
     do {
-        int c = getopt(argc, argv, "hvsa");
+        int c = getopt_long(argc, argv, "hvsaej:m:", long_options, NULL);
         if (c == -1)
             break;
 
         switch (c) {
+            case 'e':
+                estimate = true;
+                break;
+            case 'j':
+                num_threads = strtol(optarg, NULL, 10);
+                if (num_threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                mem_limit = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                if (mem_limit == 0) {
+                    fprintf(stderr, "Invalid memory limit\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'a':
                 pr_flags |= PR_ALL;
                 break;
@@ -120,6 +124,26 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Error listing processes.\n");
             exit(EXIT_FAILURE);
         }
+    } else if (estimate) {
+        if (optind == argc) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+
+        num_procs = argc - optind;
+        pids = malloc(num_procs * sizeof(*pids));
+        if (pids == NULL) {
+           fprintf(stderr, "Error allocating pid memory\n");
+           exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < num_procs; i++) {
+            pids[i] = strtoul(argv[optind + i], NULL, 10);
+            if (pids[i] == 0) {
+                fprintf(stderr, "Invalid PID\n");
+                rc = EXIT_FAILURE;
+                goto exit;
+            }
+        }
     } else {
         if (optind != argc - 1) {
             usage(argv[0]);
@@ -145,6 +169,19 @@ int main(int argc, char *argv[]) {
         printf("%s (%u):\n", cmdline, *pids);
     }
 
+    if (estimate) {
+        if (num_threads == 0) {
+            num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_threads <= 0)
+                num_threads = 1;
+        }
+        if (estimate_savings(ker, pids, num_procs, num_threads, mem_limit,
+                             pr_flags & PR_VERBOSE) < 0) {
+            rc = EXIT_FAILURE;
+        }
+        goto exit;
+    }
+
     printf("Warning: this tool only compares the KSM CRCs of pages, there is a chance of "
             "collisions\n");
 
@@ -181,25 +218,60 @@ int main(int argc, char *argv[]) {
     print_pages(&kp, pr_flags);
 
 exit:
-    free_pages(&kp, pr_flags);
+    ksm_pages_free(&kp);
     free(pids);
     return rc;
 }
 
+/*
+ * Read the kpageflags of every page in pagemap into flags, with one read for
+ * each run of physically contiguous pages. Pages that are not present get no
+ * flags.
+ */
+static void read_flags(pm_kernel_t *ker, uint64_t *pagemap, size_t len, uint64_t *flags) {
+    size_t j, run;
+    unsigned long pfn;
+
+    j = 0;
+    while (j < len) {
+        if (!PM_PAGEMAP_PRESENT(pagemap[j]) || PM_PAGEMAP_SWAPPED(pagemap[j])) {
+            flags[j++] = 0;
+            continue;
+        }
+        pfn = PM_PAGEMAP_PFN(pagemap[j]);
+        for (run = 1; j + run < len; run++) {
+            if (!PM_PAGEMAP_PRESENT(pagemap[j + run]) || PM_PAGEMAP_SWAPPED(pagemap[j + run]) ||
+                    PM_PAGEMAP_PFN(pagemap[j + run]) != pfn + run) {
+                break;
+            }
+        }
+        if (pm_kernel_flags_range(ker, pfn, run, &flags[j])) {
+            fprintf(stderr, "warning: could not read flags for pfns 0x%lx-0x%lx\n",
+                    pfn, pfn + run - 1);
+            memset(&flags[j], 0, run * sizeof(*flags));
+        }
+        j += run;
+    }
+}
+
 static int read_pages(struct ksm_pages *kp, pm_map_t **maps, size_t num_maps, uint8_t pr_flags) {
     size_t i, j, k;
-    size_t len;
+    size_t run, num_read;
+    ssize_t len;
     uint64_t *pagemap;
     size_t map_len;
-    uint64_t flags;
+    uint64_t *flags = NULL;
+    size_t flags_size = 0;
     pm_kernel_t *ker;
+    size_t pagesize;
     int error;
     unsigned long vaddr;
     int fd;
-    off_t off;
     char filename[MAX_FILENAME];
-    uint32_t *data;
-    uint32_t hash;
+    uint8_t *data;
+    uint32_t *page_data;
+    const uint8_t *pages[READ_BATCH_PAGES];
+    uint32_t hashes[READ_BATCH_PAGES];
     int rc = 0;
     struct ksm_page *cur_page;
     pid_t pid;
@@ -209,12 +281,13 @@ static int read_pages(struct ksm_pages *kp, pm_map_t **maps, size_t num_maps, ui
 
     pid = pm_process_pid(maps[0]->proc);
     ker = maps[0]->proc->ker;
+    pagesize = pm_kernel_pagesize(ker);
     error = snprintf(filename, MAX_FILENAME, "/proc/%d/mem", pid);
     if (error < 0 || error >= MAX_FILENAME) {
         return -1;
     }
 
-    data = malloc(pm_kernel_pagesize(ker));
+    data = malloc(READ_BATCH_PAGES * pagesize);
     if (data == NULL) {
         fprintf(stderr, "warning: not enough memory to malloc data buffer\n");
         return -1;
@@ -234,108 +307,87 @@ static int read_pages(struct ksm_pages *kp, pm_map_t **maps, size_t num_maps, ui
                     pm_process_pid(maps[i]->proc));
             continue;
         }
-        for (j = 0; j < map_len; j++) {
-            error = pm_kernel_flags(ker, pagemap[j], &flags);
-            if (error) {
-                fprintf(stderr, "warning: could not read flags for pfn at address 0x%016llx\n",
-                        pagemap[i]);
-                continue;
+
+        if (map_len > flags_size) {
+            uint64_t *tmp = realloc(flags, map_len * sizeof(*flags));
+            if (tmp == NULL) {
+                fprintf(stderr, "warning: not enough memory to realloc flags array\n");
+                free(pagemap);
+                rc = -1;
+                goto err_realloc;
             }
-            if (!(flags & PM_PAGE_KSM)) {
+            flags = tmp;
+            flags_size = map_len;
+        }
+        read_flags(ker, pagemap, map_len, flags);
+
+        j = 0;
+        while (j < map_len) {
+            if (!(flags[j] & PM_PAGE_KSM)) {
+                j++;
                 continue;
             }
-            vaddr = pm_map_start(maps[i]) + j * pm_kernel_pagesize(ker);
-            off = lseek(fd, vaddr, SEEK_SET);
-            if (off == (off_t)-1) {
-                fprintf(stderr, "warning: could not lseek to 0x%08lx\n", vaddr);
-                continue;
+
+            /* Read a run of virtually contiguous KSM pages at once. */
+            for (run = 1; run < READ_BATCH_PAGES && j + run < map_len; run++) {
+                if (!(flags[j + run] & PM_PAGE_KSM))
+                    break;
             }
-            len = read(fd, data, pm_kernel_pagesize(ker));
-            if (len != pm_kernel_pagesize(ker)) {
-                fprintf(stderr, "warning: could not read page at 0x%08lx\n", vaddr);
-                continue;
+            vaddr = pm_map_start(maps[i]) + j * pagesize;
+            len = pread64(fd, data, run * pagesize, (off64_t)vaddr);
+            num_read = (len < 0) ? 0 : (size_t)len / pagesize;
+            if (num_read < run) {
+                fprintf(stderr, "warning: could not read page at 0x%08lx\n",
+                        vaddr + num_read * pagesize);
             }
 
-            hash = hashword(data, pm_kernel_pagesize(ker) / sizeof(*data), 17);
-
-            for (k = 0; k < kp->len; k++) {
-                if (kp->pages[k].hash == hash) break;
+            for (k = 0; k < num_read; k++) {
+                pages[k] = data + k * pagesize;
             }
-
-            if (k == kp->len) {
-                if (kp->len == kp->size) {
-                    struct ksm_page *tmp = realloc(kp->pages,
-                            (kp->size + GROWTH_FACTOR) * sizeof(*kp->pages));
-                    if (tmp == NULL) {
-                        fprintf(stderr, "warning: not enough memory to realloc pages struct\n");
+            hash_pages(pages, num_read, pagesize, 17, hashes, NULL);
+
+            for (k = 0; k < num_read; k++) {
+                page_data = (uint32_t *)(data + k * pagesize);
+                cur_page = ksm_pages_find(kp, hashes[k]);
+                if (cur_page == NULL) {
+                    cur_page = ksm_pages_add(kp, hashes[k]);
+                    if (cur_page == NULL) {
+                        fprintf(stderr, "warning: not enough memory to grow pages struct\n");
                         free(pagemap);
                         rc = -1;
                         goto err_realloc;
                     }
-                    memset(&tmp[k], 0, sizeof(tmp[k]) * GROWTH_FACTOR);
-                    kp->pages = tmp;
-                    kp->size += GROWTH_FACTOR;
-                }
-                rc = pm_kernel_count(ker, pagemap[j], &kp->pages[kp->len].count);
-                if (rc) {
-                    fprintf(stderr, "error reading page count\n");
-                    free(pagemap);
-                    goto err_count;
+                    rc = pm_kernel_count(ker, PM_PAGEMAP_PFN(pagemap[j + k]), &cur_page->count);
+                    if (rc) {
+                        fprintf(stderr, "error reading page count\n");
+                        free(pagemap);
+                        goto err_count;
+                    }
+                    cur_page->pattern = is_pattern((uint8_t *)page_data, pagesize) ?
+                            (page_data[0] & 0xFF) : NO_PATTERN;
                 }
-                kp->pages[kp->len].hash = hash;
-                kp->pages[kp->len].pattern =
-                        is_pattern((uint8_t *)data, pm_kernel_pagesize(ker)) ?
-                        (data[0] & 0xFF) : NO_PATTERN;
-                kp->len++;
-            }
 
-            cur_page = &kp->pages[k];
-
-            if (pr_flags & PR_VERBOSE) {
-                if (cur_page->vaddr_len > 0 &&
-                        cur_page->vaddr[cur_page->vaddr_len - 1].pid == pid &&
-                        cur_page->vaddr[cur_page->vaddr_len - 1].addr ==
-                        vaddr - (cur_page->vaddr[cur_page->vaddr_len - 1].num_pages *
-                        pm_kernel_pagesize(ker))) {
-                    cur_page->vaddr[cur_page->vaddr_len - 1].num_pages++;
-                } else {
-                    if (cur_page->vaddr_len == cur_page->vaddr_size) {
-                        struct vaddr *tmp = realloc(cur_page->vaddr,
-                                (cur_page->vaddr_size + GROWTH_FACTOR) * sizeof(*(cur_page->vaddr)));
-                        if (tmp == NULL) {
-                            fprintf(stderr, "warning: not enough memory to realloc vaddr array\n");
-                            free(pagemap);
-                            rc = -1;
-                            goto err_realloc;
-                        }
-                        memset(&tmp[cur_page->vaddr_len], 0, sizeof(tmp[cur_page->vaddr_len]) * GROWTH_FACTOR);
-                        cur_page->vaddr = tmp;
-                        cur_page->vaddr_size += GROWTH_FACTOR;
+                if (pr_flags & PR_VERBOSE) {
+                    if (ksm_page_add_vaddr(kp, cur_page, vaddr + k * pagesize, pagesize, pid) < 0) {
+                        fprintf(stderr, "warning: not enough memory to grow vaddr array\n");
+                        free(pagemap);
+                        rc = -1;
+                        goto err_realloc;
                     }
-                    cur_page->vaddr[cur_page->vaddr_len].addr = vaddr;
-                    cur_page->vaddr[cur_page->vaddr_len].num_pages = 1;
-                    cur_page->vaddr[cur_page->vaddr_len].pid = pid;
-                    cur_page->vaddr_len++;
                 }
+                cur_page->vaddr_count++;
             }
-            cur_page->vaddr_count++;
+            j += run;
         }
         free(pagemap);
     }
-    goto no_err;
 
+    /* On errors the pages found so far are released by the caller. */
 err_realloc:
 err_count:
-    if (pr_flags & PR_VERBOSE) {
-        for (i = 0; i < kp->len; i++) {
-            free(kp->pages[i].vaddr);
-        }
-    }
-    free(kp->pages);
-
-no_err:
     close(fd);
 err_open:
+    free(flags);
     free(data);
     return rc;
 }
@@ -385,24 +437,20 @@ static void print_pages(struct ksm_pages *kp, uint8_t pr_flags) {
     }
 }
 
-static void free_pages(struct ksm_pages *kp, uint8_t pr_flags) {
-    size_t i;
-
-    if (pr_flags & PR_VERBOSE) {
-        for (i = 0; i < kp->len; i++) {
-            free(kp->pages[i].vaddr);
-        }
-    }
-    free(kp->pages);
-}
-
 static void usage(char *myname) {
     fprintf(stderr, "Usage: %s [-s | -v | -a | -h ] <pid>\n"
+                    "       %s --estimate [-v] [-j <threads>] [-m <MB>] [-a | <pid>...]\n"
                     "    -s  Sort pages by usage count.\n"
-                    "    -v  Verbose: print virtual addresses.\n"
+                    "    -v  Verbose: print virtual addresses, or with --estimate the\n"
+                    "        savings of each mapping.\n"
                     "    -a  Display all the KSM pages in the system. Ignore the pid argument.\n"
-                    "    -h  Display this help screen.\n",
-    myname);
+                    "    -h  Display this help screen.\n"
+                    "    --estimate  Estimate the savings of enabling KSM for the private\n"
+                    "        anonymous pages of the processes that are not merged yet.\n"
+                    "    -j  Number of threads hashing pages. Defaults to the number of cpus.\n"
+                    "    -m  Megabytes of page hashes kept in memory before spilling them to\n"
+                    "        temporary files. Defaults to %d.\n",
+    myname, myname, ESTIMATE_DEFAULT_MEM_MB);
 }
 
 static int cmp_pages(const void *a, const void *b) {
@@ -413,17 +461,6 @@ static int cmp_pages(const void *a, const void *b) {
     return cmp ? cmp : pg_b->count - pg_a->count;
 }
 
-static bool is_pattern(uint8_t *data, size_t len) {
-    size_t i;
-    uint8_t first_byte = data[0];
-
-    for (i = 1; i < len; i++) {
-        if (first_byte != data[i]) return false;
-    }
-
-    return true;
-}
-
 /*
  * Get the process name for a given PID. Inserts the process name into buffer
  * buf of length len. The size of the buffer must be greater than zero to get
@@ -438,7 +475,7 @@ static bool is_pattern(uint8_t *data, size_t len) {
  *   2 on failure to open proc cmdline entry
  *   3 on failure to read proc cmdline entry
  */
-static int getprocname(pid_t pid, char *buf, int len) {
+int getprocname(pid_t pid, char *buf, int len) {
     char *filename;
     FILE *f;
     int rc = 0;
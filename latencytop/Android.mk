@@ -17,6 +17,10 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := latencytop.c
 
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libprocfile/include
+
+LOCAL_STATIC_LIBRARIES := libprocfile
+
 LOCAL_MODULE := latencytop
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
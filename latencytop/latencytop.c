@@ -17,13 +17,27 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <procfile/procfile.h>
+
+#include "latencytop_record.h"
 
 #define MAX_LINE 512
 #define MAX_FILENAME 64
+#define MAX_WORKERS 16
+#define ENTRY_POOL_SIZE 64
+#define INITIAL_BUCKETS 64
+#define TASK_BATCH 8
 
 const char *EXPECTED_VERSION = "Latency Top version : v0.1\n";
 const char *SYSCTL_FILE = "/proc/sys/kernel/latencytop";
@@ -32,27 +46,78 @@ const char *THREAD_STATS_FILE_FORMAT = "/proc/%d/task/%d/latency";
 
 struct latency_entry {
     struct latency_entry *next;
+    struct latency_entry *hash_next;
+    unsigned int hash;
+    /* Reason id in the log, for the reason tables of -o. */
+    uint32_t id;
     unsigned long count;
     unsigned long max;
     unsigned long total;
     char reason[MAX_LINE];
 };
 
-static inline void check_latencytop() { }
+/* Latency entries by reason, chained from a hash table and also kept in a
+ * list for printing. Entries are carved out of pools and go back to the
+ * table's free list when it's cleared, so refreshes don't allocate. */
+struct latency_table {
+    struct latency_entry **buckets;
+    unsigned int mask;
+    unsigned int count;
+    struct latency_entry *head;
+    struct latency_entry *free_entries;
+};
 
-static struct latency_entry *read_global_stats(struct latency_entry *list, int erase);
-static struct latency_entry *read_process_stats(struct latency_entry *list, int erase, int pid);
-static struct latency_entry *read_thread_stats(struct latency_entry *list, int erase, int pid, int tid, int fatal);
+struct task_id {
+    int pid;
+    int tid;
+};
 
-static struct latency_entry *alloc_latency_entry(void);
-static void free_latency_entry(struct latency_entry *e);
+/* A collector thread, with its own file buffer and table so workers never
+ * share anything but the task list. When recording, it also keeps the ids
+ * of the reasons it has seen, and the records of the current update. */
+struct worker {
+    pthread_t thread;
+    procfile_t file;
+    struct latency_table table;
+    struct latency_table ids;
+    struct latency_record *records;
+    size_t record_count;
+    size_t record_size;
+};
+
+static inline void check_latencytop() { }
+
+static void read_global_stats(struct latency_table *t, int erase);
+static void read_tasks_stats(struct latency_table *t, int erase, int pid);
+static int read_thread_stats(struct worker *w, struct latency_table *t, int erase, int pid, int tid, int fatal);
+static int erase_stats(const char *filename);
+
+static void list_tasks(int pid);
+static void add_process_tasks(int pid, int fatal);
+static void *collect_worker(void *arg);
+
+static void init_latency_table(struct latency_table *t);
+static void clear_latency_table(struct latency_table *t);
+static struct latency_entry *add_latency_entry(struct latency_table *t, const char *reason,
+                                              size_t len, unsigned long count,
+                                              unsigned long total, unsigned long max);
+static void merge_latency_table(struct latency_table *dst, struct latency_table *src);
+static struct latency_entry *alloc_latency_entry(struct latency_table *t);
+
+static void open_log(const char *filename);
+static void record_latency(struct worker *w, const char *reason, size_t len, const uint64_t *values,
+                           int pid, int tid);
+static void write_log_sample(void);
+static void replay_log(const char *filename, int pid, int tid, unsigned long begin,
+                       unsigned long end, unsigned long window);
 
 static void set_latencytop(int on);
-static struct latency_entry *read_latency_file(FILE *f, struct latency_entry *list);
+static void read_latency_file(procfile_t *f, struct latency_table *t, struct worker *w, int pid, int tid);
 static void erase_latency_file(FILE *f);
 
-static struct latency_entry *find_latency_entry(struct latency_entry *e, char *reason);
-static void print_latency_entries(struct latency_entry *head);
+static struct latency_entry *find_latency_entry(struct latency_table *t, unsigned int hash,
+                                                const char *reason, size_t len);
+static void print_latency_entries(struct latency_table *t);
 
 static void signal_handler(int sig);
 static void disable_latencytop(void);
@@ -63,18 +128,43 @@ static int lat_cmp(const void *a, const void *b);
 static void clear_screen(void);
 static void usage(const char *cmd);
 
-struct latency_entry *free_entries;
+/* The global stats file stays open between updates, thread files are read
+ * into the buffer of their worker. */
+static procfile_t global_file;
+
+/* The threads to read this refresh, taken TASK_BATCH at a time by the
+ * workers through next_task. */
+static struct task_id *tasks;
+static size_t task_count, task_size, next_task;
+static int collect_erase;
+static struct worker workers[MAX_WORKERS];
+static int worker_count;
+
+/* With -o, the log, and every reason seen by any worker with its id, of
+ * which the first reasons_written are already in the log. */
+static int log_fd = -1;
+static const char *log_filename;
+static struct latency_table reasons;
+static uint32_t reasons_written;
+static pthread_mutex_t reasons_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int main(int argc, char *argv[]) {
-    struct latency_entry *e;
+    struct latency_table table;
+    struct timespec start, end_time;
+    double refresh_ms;
     int delay, iterations;
-    int pid, tid;
+    int pid, tid, all_threads;
     int count, erase;
+    const char *replay_filename;
+    unsigned long begin, end, window;
     int i;
 
     delay = 1;
     iterations = 0;
-    pid = tid = 0;
+    pid = tid = all_threads = 0;
+    replay_filename = NULL;
+    begin = end = window = 0;
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
     
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-d")) {
@@ -113,6 +203,58 @@ int main(int argc, char *argv[]) {
             tid = atoi(argv[++i]);
             continue;
         }
+        if (!strcmp(argv[i], "-a")) {
+            all_threads = 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "-o")) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "Option -o expects an argument.\n");
+                exit(EXIT_FAILURE);
+            }
+            log_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-i")) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "Option -i expects an argument.\n");
+                exit(EXIT_FAILURE);
+            }
+            replay_filename = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-b")) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "Option -b expects an argument.\n");
+                exit(EXIT_FAILURE);
+            }
+            begin = strtoul(argv[++i], NULL, 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "-e")) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "Option -e expects an argument.\n");
+                exit(EXIT_FAILURE);
+            }
+            end = strtoul(argv[++i], NULL, 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "-w")) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "Option -w expects an argument.\n");
+                exit(EXIT_FAILURE);
+            }
+            window = strtoul(argv[++i], NULL, 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "-j")) {
+            if (i >= argc - 1) {
+                fprintf(stderr, "Option -j expects an argument.\n");
+                exit(EXIT_FAILURE);
+            }
+            worker_count = atoi(argv[++i]);
+            continue;
+        }
         fprintf(stderr, "Invalid argument \"%s\".\n", argv[i]);
         usage(argv[0]);
         exit(EXIT_FAILURE);
@@ -122,10 +264,37 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "If you provide a thread ID with -t, you must provide a process ID with -p.\n");
         exit(EXIT_FAILURE);
     }
+    if (all_threads && pid) {
+        fprintf(stderr, "Option -a can not be used with -p.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (worker_count < 1)
+        worker_count = 1;
+    if (worker_count > MAX_WORKERS)
+        worker_count = MAX_WORKERS;
+
+    if (replay_filename) {
+        if (log_filename || all_threads) {
+            fprintf(stderr, "Option -i can not be used with -o or -a.\n");
+            exit(EXIT_FAILURE);
+        }
+        replay_log(replay_filename, pid, tid, begin, end, window);
+        return 0;
+    }
 
     check_latencytop();
 
-    free_entries = NULL;
+    init_latency_table(&table);
+    procfile_init(&global_file);
+    for (i = 0; i < worker_count; i++) {
+        procfile_init(&workers[i].file);
+        init_latency_table(&workers[i].table);
+        init_latency_table(&workers[i].ids);
+    }
+    if (log_filename) {
+        init_latency_table(&reasons);
+        open_log(log_filename);
+    }
 
     signal(SIGINT, &signal_handler);
     signal(SIGTERM, &signal_handler);
@@ -141,17 +310,21 @@ int main(int argc, char *argv[]) {
 
         sleep(delay);
 
-        e = NULL;
-        if (pid) {
-            if (tid) {
-                e = read_thread_stats(e, erase, pid, tid, 1);
-            } else {
-                e = read_process_stats(e, erase, pid);
-            }
+        clear_latency_table(&table);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (pid && tid) {
+            read_thread_stats(&workers[0], &table, erase, pid, tid, 1);
+        } else if (pid || all_threads) {
+            read_tasks_stats(&table, erase, pid);
         } else {
-            e = read_global_stats(e, erase);
+            read_global_stats(&table, erase);
         }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        refresh_ms = (end_time.tv_sec - start.tv_sec) * 1e3 +
+                     (end_time.tv_nsec - start.tv_nsec) / 1e6;
         erase = 0;
+        if (log_fd >= 0)
+            write_log_sample();
 
         clear_screen();
         if (pid) {
@@ -160,10 +333,16 @@ int main(int argc, char *argv[]) {
             } else {
                 printf("Latencies for process %d:\n", pid);
             }
+        } else if (all_threads) {
+            printf("Latencies across all threads (%zu threads read in %.1f ms):\n",
+                   task_count, refresh_ms);
         } else {
             printf("Latencies across all processes:\n");
         }
-        print_latency_entries(e);
+        if (delay > 0 && refresh_ms > delay * 1e3)
+            printf("Warning: reading took %.1f ms, longer than the %d s delay.\n",
+                   refresh_ms, delay);
+        print_latency_entries(&table);
     }
 
     set_latencytop(0);
@@ -171,139 +350,600 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
-static struct latency_entry *read_global_stats(struct latency_entry *list, int erase) {
-    FILE *f;
-    struct latency_entry *e;
+static void read_global_stats(struct latency_table *t, int erase) {
 
-    if (erase) {
-        f = fopen(GLOBAL_STATS_FILE, "w");
-        if (!f) {
-            fprintf(stderr, "Could not open global latency stats file: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        fprintf(f, "erase\n");
-        fclose(f);
+    if (erase && erase_stats(GLOBAL_STATS_FILE)) {
+        fprintf(stderr, "Could not open global latency stats file: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
     }
-    
-    f = fopen(GLOBAL_STATS_FILE, "r");
-    if (!f) {
+
+    if (global_file.fd < 0 && procfile_open(&global_file, GLOBAL_STATS_FILE)) {
         fprintf(stderr, "Could not open global latency stats file: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    e = read_latency_file(f, list);
+    read_latency_file(&global_file, t, &workers[0], 0, 0);
+
+    /* Each record covers one update. */
+    if (log_fd >= 0)
+        erase_stats(GLOBAL_STATS_FILE);
+}
+
+/* Write "erase" to a latency file. Returns 0, or -1 with errno set. */
+static int erase_stats(const char *filename) {
+    FILE *f;
 
+    f = fopen(filename, "w");
+    if (!f)
+        return -1;
+    erase_latency_file(f);
     fclose(f);
 
-    return e;
+    return 0;
+}
+
+/* Read the stats of every thread of pid, or of every thread in the system
+ * for pid 0, with worker_count threads. */
+static void read_tasks_stats(struct latency_table *t, int erase, int pid) {
+    int i, err;
+
+    list_tasks(pid);
+
+    next_task = 0;
+    collect_erase = erase;
+    for (i = 1; i < worker_count; i++) {
+        err = pthread_create(&workers[i].thread, NULL, collect_worker, &workers[i]);
+        if (err) {
+            fprintf(stderr, "Could not start collector thread: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    collect_worker(&workers[0]);
+
+    for (i = 0; i < worker_count; i++) {
+        if (i)
+            pthread_join(workers[i].thread, NULL);
+        merge_latency_table(t, &workers[i].table);
+    }
 }
 
-static struct latency_entry *read_process_stats(struct latency_entry *list, int erase, int pid) {
+static void *collect_worker(void *arg) {
+    struct worker *w = arg;
+    size_t i, end;
+
+    clear_latency_table(&w->table);
+    while ((i = __sync_fetch_and_add(&next_task, TASK_BATCH)) < task_count) {
+        end = i + TASK_BATCH < task_count ? i + TASK_BATCH : task_count;
+        for (; i < end; i++)
+            read_thread_stats(w, &w->table, collect_erase, tasks[i].pid, tasks[i].tid, 0);
+    }
+
+    return NULL;
+}
+
+/* Fill tasks with the threads of pid, or of every process for pid 0. */
+static void list_tasks(int pid) {
+    DIR *dir;
+    struct dirent *ent;
+
+    task_count = 0;
+    if (pid) {
+        add_process_tasks(pid, 1);
+        return;
+    }
+
+    dir = opendir("/proc");
+    if (!dir) {
+        fprintf(stderr, "Could not open /proc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while ((ent = readdir(dir))) {
+        if (isdigit(ent->d_name[0]))
+            add_process_tasks(atoi(ent->d_name), 0);
+    }
+    closedir(dir);
+}
+
+static void add_process_tasks(int pid, int fatal) {
     char dirname[MAX_FILENAME];
     DIR *dir;
     struct dirent *ent;
-    struct latency_entry *e;
-    int tid;
+    struct task_id *tmp;
 
     sprintf(dirname, "/proc/%d/task", pid);
     dir = opendir(dirname);
     if (!dir) {
+        if (!fatal)
+            return;
         fprintf(stderr, "Could not open task dir for process %d.\n", pid);
         fprintf(stderr, "Perhaps the process has terminated?\n");
         exit(EXIT_FAILURE);
     }
 
-    e = list;
     while ((ent = readdir(dir))) {
         if (!isdigit(ent->d_name[0]))
             continue;
 
-        tid = atoi(ent->d_name);
-
-        e = read_thread_stats(e, erase, pid, tid, 0);
+        if (task_count == task_size) {
+            task_size = task_size ? task_size * 2 : 256;
+            tmp = realloc(tasks, task_size * sizeof(*tasks));
+            if (!tmp) {
+                fprintf(stderr, "Could not allocate task list: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            tasks = tmp;
+        }
+        tasks[task_count].pid = pid;
+        tasks[task_count].tid = atoi(ent->d_name);
+        task_count++;
     }
 
     closedir(dir);
-
-    return e;
 }
 
-static struct latency_entry *read_thread_stats(struct latency_entry *list, int erase, int pid, int tid, int fatal) {
+/* Returns 0, or -1 if the thread is gone and fatal isn't set. */
+static int read_thread_stats(struct worker *w, struct latency_table *t, int erase, int pid, int tid, int fatal) {
     char filename[MAX_FILENAME];
-    FILE *f;
-    struct latency_entry *e;
+    procfile_t *f = &w->file;
 
     sprintf(filename, THREAD_STATS_FILE_FORMAT, pid, tid);
 
-    if (erase) {
-        f = fopen(filename, "w");
-        if (!f) {
-            if (fatal) {
-                fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
-                fprintf(stderr, "Perhaps the process or thread has terminated?\n");
-                exit(EXIT_FAILURE);
-            } else {
-                return list;
-            }
+    if (erase && erase_stats(filename)) {
+        if (fatal) {
+            fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+            fprintf(stderr, "Perhaps the process or thread has terminated?\n");
+            exit(EXIT_FAILURE);
+        } else {
+            return -1;
         }
-        fprintf(f, "erase\n");
-        fclose(f);
     }
     
-    f = fopen(GLOBAL_STATS_FILE, "r");
-    if (!f) {
+    if (procfile_open(f, filename)) {
         if (fatal) {
             fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
             fprintf(stderr, "Perhaps the process or thread has terminated?\n");
             exit(EXIT_FAILURE);
         } else {
-            return list;
+            return -1;
         }
     }
 
-    e = read_latency_file(f, list);
+    read_latency_file(f, t, w, pid, tid);
 
-    fclose(f);
+    procfile_close(f);
 
-    return e;
+    /* Each record covers one update. */
+    if (log_fd >= 0)
+        erase_stats(filename);
+
+    return 0;
 }
 
-static struct latency_entry *alloc_latency_entry(void) {
-    struct latency_entry *e;
+static void init_latency_table(struct latency_table *t) {
+    t->mask = INITIAL_BUCKETS - 1;
+    t->buckets = calloc(INITIAL_BUCKETS, sizeof(*t->buckets));
+    if (!t->buckets) {
+        fprintf(stderr, "Could not allocate latency table: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    t->count = 0;
+    t->head = NULL;
+    t->free_entries = NULL;
+}
 
-    if (free_entries) {
-        e = free_entries;
-        free_entries = free_entries->next;
-    } else {
-        e = calloc(1, sizeof(struct latency_entry));
-        if (!e) {
+/* Empty the table, keeping its entries for reuse. */
+static void clear_latency_table(struct latency_table *t) {
+    struct latency_entry *e, *next;
+
+    for (e = t->head; e; e = next) {
+        next = e->next;
+        e->next = t->free_entries;
+        t->free_entries = e;
+    }
+    memset(t->buckets, 0, (t->mask + 1) * sizeof(*t->buckets));
+    t->count = 0;
+    t->head = NULL;
+}
+
+static struct latency_entry *alloc_latency_entry(struct latency_table *t) {
+    struct latency_entry *e, *pool;
+    int i;
+
+    if (!t->free_entries) {
+        pool = calloc(ENTRY_POOL_SIZE, sizeof(struct latency_entry));
+        if (!pool) {
             fprintf(stderr, "Could not allocate latency entry: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
+        for (i = 0; i < ENTRY_POOL_SIZE; i++) {
+            pool[i].next = t->free_entries;
+            t->free_entries = &pool[i];
+        }
     }
 
+    e = t->free_entries;
+    t->free_entries = e->next;
+
     return e;
 }
 
-static void free_latency_entry(struct latency_entry *e) {
-    e->next = free_entries;
-    free_entries = e;
+static unsigned int hash_reason(const char *reason, size_t len) {
+    unsigned int h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (unsigned char)*reason++) * 16777619u;
+
+    return h;
 }
 
-static struct latency_entry *find_latency_entry(struct latency_entry *head, char *reason) {
+static struct latency_entry *find_latency_entry(struct latency_table *t, unsigned int hash,
+                                                const char *reason, size_t len) {
     struct latency_entry *e;
 
-    e = head;
-
-    while (e) {
-        if (!strcmp(e->reason, reason))
+    for (e = t->buckets[hash & t->mask]; e; e = e->hash_next) {
+        if (e->hash == hash && !strncmp(e->reason, reason, len) && e->reason[len] == '\0')
             return e;
-        e = e->next;
     }
 
     return NULL;
 }
 
+/* Double the buckets once there are more entries than buckets. */
+static void grow_latency_table(struct latency_table *t) {
+    struct latency_entry **buckets, *e;
+    unsigned int mask = t->mask * 2 + 1;
+
+    buckets = calloc(mask + 1, sizeof(*buckets));
+    if (!buckets)
+        return;
+
+    for (e = t->head; e; e = e->next) {
+        e->hash_next = buckets[e->hash & mask];
+        buckets[e->hash & mask] = e;
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->mask = mask;
+}
+
+/* Add the latencies of a reason, len characters of reason, to the table.
+ * Returns the reason's entry. */
+static struct latency_entry *add_latency_entry(struct latency_table *t, const char *reason,
+                                              size_t len, unsigned long count,
+                                              unsigned long total, unsigned long max) {
+    struct latency_entry *e;
+    unsigned int hash;
+
+    if (len >= MAX_LINE)
+        len = MAX_LINE - 1;
+    hash = hash_reason(reason, len);
+
+    e = find_latency_entry(t, hash, reason, len);
+    if (e) {
+        e->count += count;
+        if (max > e->max)
+            e->max = max;
+        e->total += total;
+        return e;
+    }
+
+    e = alloc_latency_entry(t);
+    e->hash = hash;
+    e->count = count;
+    e->max = max;
+    e->total = total;
+    memcpy(e->reason, reason, len);
+    e->reason[len] = '\0';
+    e->next = t->head;
+    t->head = e;
+    e->hash_next = t->buckets[hash & t->mask];
+    t->buckets[hash & t->mask] = e;
+
+    if (++t->count > t->mask + 1)
+        grow_latency_table(t);
+
+    return e;
+}
+
+static void merge_latency_table(struct latency_table *dst, struct latency_table *src) {
+    struct latency_entry *e;
+
+    for (e = src->head; e; e = e->next)
+        add_latency_entry(dst, e->reason, strlen(e->reason), e->count, e->total, e->max);
+}
+
+static void write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Could not write to %s: %s\n", log_filename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        p += written;
+        len -= written;
+    }
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Open the log for appending and start a new run in it. */
+static void open_log(const char *filename) {
+    struct latency_block block;
+
+    log_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&block, 0, sizeof(block));
+    block.type = LATENCY_BLOCK_START;
+    block.value = LATENCY_LOG_MAGIC;
+    block.length = LATENCY_LOG_VERSION;
+    block.timestamp_ns = realtime_ns();
+    write_all(log_fd, &block, sizeof(block));
+}
+
+/* Get the log id of a reason, from the worker's own ids if it has seen the
+ * reason before, so the lock is only taken for reasons new to it. */
+static uint32_t get_reason_id(struct worker *w, const char *reason, size_t len) {
+    struct latency_entry *e;
+    uint32_t id;
+
+    e = find_latency_entry(&w->ids, hash_reason(reason, len), reason, len);
+    if (e)
+        return e->id;
+
+    pthread_mutex_lock(&reasons_lock);
+    e = find_latency_entry(&reasons, hash_reason(reason, len), reason, len);
+    if (!e) {
+        e = add_latency_entry(&reasons, reason, len, 0, 0, 0);
+        e->id = reasons.count - 1;
+    }
+    id = e->id;
+    pthread_mutex_unlock(&reasons_lock);
+
+    add_latency_entry(&w->ids, reason, len, 0, 0, 0)->id = id;
+
+    return id;
+}
+
+/* Add a line of a latency file to the worker's records. */
+static void record_latency(struct worker *w, const char *reason, size_t len, const uint64_t *values,
+                           int pid, int tid) {
+    struct latency_record *r;
+
+    if (len >= MAX_LINE)
+        len = MAX_LINE - 1;
+
+    if (w->record_count == w->record_size) {
+        w->record_size = w->record_size ? w->record_size * 2 : 256;
+        w->records = realloc(w->records, w->record_size * sizeof(*w->records));
+        if (!w->records) {
+            fprintf(stderr, "Could not allocate records: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    r = &w->records[w->record_count++];
+    memset(r, 0, sizeof(*r));
+    r->reason = get_reason_id(w, reason, len);
+    r->pid = pid;
+    r->tid = tid;
+    r->count = values[0];
+    r->total = values[1];
+    r->max = values[2];
+}
+
+/* Append the reasons new since the last update, and the records of all
+ * workers for this one. */
+static void write_log_sample(void) {
+    static const char padding[4];
+    struct latency_block block;
+    struct latency_entry *e;
+    size_t count = 0;
+    uint64_t now = realtime_ns();
+    int i;
+
+    memset(&block, 0, sizeof(block));
+    block.timestamp_ns = now;
+
+    /* New reasons are at the head of the list. */
+    block.type = LATENCY_BLOCK_REASON;
+    for (e = reasons.head; e && e->id >= reasons_written; e = e->next) {
+        block.value = e->id;
+        block.length = strlen(e->reason);
+        write_all(log_fd, &block, sizeof(block));
+        write_all(log_fd, e->reason, block.length);
+        write_all(log_fd, padding, (4 - block.length % 4) % 4);
+    }
+    reasons_written = reasons.count;
+
+    for (i = 0; i < worker_count; i++)
+        count += workers[i].record_count;
+    block.type = LATENCY_BLOCK_SAMPLE;
+    block.value = count;
+    block.length = 0;
+    write_all(log_fd, &block, sizeof(block));
+    for (i = 0; i < worker_count; i++) {
+        write_all(log_fd, workers[i].records, workers[i].record_count * sizeof(struct latency_record));
+        workers[i].record_count = 0;
+    }
+}
+
+/* Latencies of one replay window, by reason id. */
+struct replay_reason {
+    const char *name;
+    size_t len;
+    uint64_t count;
+    uint64_t total;
+    uint32_t max;
+};
+
+/* Fold the window's latencies, by id, into the table, by name. */
+static void fold_replay(struct latency_table *t, struct replay_reason *ids, uint32_t id_count) {
+    uint32_t i;
+
+    for (i = 0; i < id_count; i++) {
+        if (!ids[i].count)
+            continue;
+        add_latency_entry(t, ids[i].name, ids[i].len, ids[i].count, ids[i].total, ids[i].max);
+        ids[i].count = ids[i].total = ids[i].max = 0;
+    }
+}
+
+static void print_replay_window(struct latency_table *t, unsigned long from, unsigned long to) {
+    if (!t->count)
+        return;
+    printf("Latencies from +%lus to +%lus:\n", from, to);
+    print_latency_entries(t);
+    printf("\n");
+    clear_latency_table(t);
+}
+
+/*
+ * Add up the records of a log, for pid and tid if they are set, that are
+ * between begin and end seconds (0 for no end) from its first sample, and
+ * print them for each window seconds or, for window 0, all at once.
+ *
+ * The log is mapped and its records added up by reason id, so the reason
+ * names are only looked at when a window is printed.
+ */
+static void replay_log(const char *filename, int pid, int tid, unsigned long begin,
+                       unsigned long end, unsigned long window) {
+    const struct latency_block *block;
+    const struct latency_record *r, *last;
+    struct replay_reason *ids = NULL, *tmp;
+    struct latency_table t;
+    struct stat st;
+    const char *map, *p, *map_end;
+    uint32_t id_count = 0, id_size = 0;
+    uint64_t first_ns = 0;
+    unsigned long at = begin, window_start = begin, samples = 0;
+    time_t start_time;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!st.st_size) {
+        fprintf(stderr, "%s is empty.\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+    map_end = map + st.st_size;
+
+    init_latency_table(&t);
+
+    for (p = map; p + sizeof(*block) <= map_end; ) {
+        block = (const struct latency_block *)p;
+        p += sizeof(*block);
+
+        switch (block->type) {
+        case LATENCY_BLOCK_START:
+            if (block->value != LATENCY_LOG_MAGIC || block->length != LATENCY_LOG_VERSION) {
+                fprintf(stderr, "%s is not a latencytop log of version %d.\n", filename,
+                        LATENCY_LOG_VERSION);
+                exit(EXIT_FAILURE);
+            }
+            /* The ids of the previous run end here. */
+            fold_replay(&t, ids, id_count);
+            id_count = 0;
+            if (!first_ns) {
+                first_ns = block->timestamp_ns;
+                start_time = first_ns / 1000000000ULL;
+                printf("Log starts at %s\n", ctime(&start_time));
+            }
+            break;
+
+        case LATENCY_BLOCK_REASON:
+            if (p + block->length > map_end)
+                goto truncated;
+            if (block->value >= id_size) {
+                id_size = block->value * 2 + 64;
+                tmp = realloc(ids, id_size * sizeof(*ids));
+                if (!tmp) {
+                    fprintf(stderr, "Could not allocate reasons: %s\n", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                ids = tmp;
+            }
+            for (; id_count <= block->value; id_count++)
+                memset(&ids[id_count], 0, sizeof(*ids));
+            ids[block->value].name = p;
+            ids[block->value].len = block->length;
+            p += (block->length + 3) & ~3U;
+            break;
+
+        case LATENCY_BLOCK_SAMPLE:
+            if (p + (size_t)block->value * sizeof(*r) > map_end)
+                goto truncated;
+            r = (const struct latency_record *)p;
+            last = r + block->value;
+            p = (const char *)last;
+
+            at = (block->timestamp_ns - first_ns) / 1000000000ULL;
+            if (at < begin)
+                break;
+            if (end && at > end) {
+                at = end;
+                goto done;
+            }
+            if (window && at >= window_start + window) {
+                fold_replay(&t, ids, id_count);
+                print_replay_window(&t, window_start, window_start + window);
+                window_start += (at - window_start) / window * window;
+            }
+            samples++;
+
+            for (; r < last; r++) {
+                if ((pid && r->pid != pid) || (tid && r->tid != tid))
+                    continue;
+                if (r->reason >= id_count || !ids[r->reason].name)
+                    continue;
+                ids[r->reason].count += r->count;
+                ids[r->reason].total += r->total;
+                if (r->max > ids[r->reason].max)
+                    ids[r->reason].max = r->max;
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Unknown block type %u in %s.\n", block->type, filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    goto done;
+
+truncated:
+    fprintf(stderr, "%s is truncated, ignoring its last update.\n", filename);
+done:
+    fold_replay(&t, ids, id_count);
+    print_replay_window(&t, window_start, window ? window_start + window : at);
+    printf("%lu updates replayed.\n", samples);
+
+    free(ids);
+    munmap((void *)map, st.st_size);
+}
+
 static void set_latencytop(int on) {
     FILE *f;
 
@@ -322,63 +962,46 @@ static void erase_latency_file(FILE *f) {
     fprintf(f, "erase\n");
 }
 
-static struct latency_entry *read_latency_file(FILE *f, struct latency_entry *list) {
-    struct latency_entry *e, *head;
-    char line[MAX_LINE];
-    unsigned long count, max, total;
-    char reason[MAX_LINE];
-
-    head = list;
+static void read_latency_file(procfile_t *f, struct latency_table *t, struct worker *w, int pid, int tid) {
+    const char *line, *p, *reason;
+    size_t reason_len;
+    uint64_t values[3];
 
-    if (!fgets(line, MAX_LINE, f)) {
+    if (procfile_read(f) < 0) {
         fprintf(stderr, "Could not read latency file version: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    if (strcmp(line, EXPECTED_VERSION) != 0) {
+    line = f->buf;
+    if (strncmp(line, EXPECTED_VERSION, strlen(EXPECTED_VERSION)) != 0) {
+        p = strchr(line, '\n');
         fprintf(stderr, "Expected version: %s\n", EXPECTED_VERSION);
-        fprintf(stderr, "But got version: %s", line);
+        fprintf(stderr, "But got version: %.*s\n", p ? (int)(p - line) : (int)strlen(line), line);
         exit(EXIT_FAILURE);
     }
 
-    while (fgets(line, MAX_LINE, f)) {
-        sscanf(line, "%ld %ld %ld %s", &count, &total, &max, reason);
-        if (max > 0 || total > 0) {
-            e = find_latency_entry(head, reason);
-            if (e) {
-                e->count += count;
-                if (max > e->max)
-                    e->max = max;
-                e->total += total;
-            } else {
-                e = alloc_latency_entry();
-                e->count = count;
-                e->max = max;
-                e->total = total;
-                strcpy(e->reason, reason);
-                e->next = head;
-                head = e;
-            }
+    for (line = procfile_next_line(line); line; line = procfile_next_line(line)) {
+        /* <count> <total> <max> <reason>, only the first word of the reason
+         * is used. */
+        p = procfile_parse_u64s(line, values, 3);
+        if (!p || !procfile_next_token(p, &reason, &reason_len))
+            continue;
+        if (values[2] > 0 || values[1] > 0) {
+            add_latency_entry(t, reason, reason_len, values[0], values[1], values[2]);
+            if (log_fd >= 0)
+                record_latency(w, reason, reason_len, values, pid, tid);
         }
     }
-
-    return head;
 }
 
-static void print_latency_entries(struct latency_entry *head) {
+static void print_latency_entries(struct latency_table *t) {
     struct latency_entry *e, **array;
     unsigned long average;
     int i, count;
 
-    e = head;
-    count = 0;
-    while (e) {
-        count++;
-        e = e->next;
-    }
-
-    e = head;
-    array = calloc(count, sizeof(struct latency_entry *));
+    count = t->count;
+    e = t->head;
+    array = calloc(count ? count : 1, sizeof(struct latency_entry *));
     if (!array) {
         fprintf(stderr, "Error allocating array: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
@@ -417,13 +1040,24 @@ static void clear_screen(void) {
 }
 
 static void usage(const char *cmd) {
-    fprintf(stderr, "Usage: %s [ -d delay ] [ -n iterations ] [ -p pid [ -t tid ] ] [ -h ]\n"
+    fprintf(stderr, "Usage: %s [ -d delay ] [ -n iterations ] [ -p pid [ -t tid ] | -a ] [ -j jobs ]\n"
+                    "           [ -o file ] [ -h ]\n"
+                    "       %s -i file [ -p pid [ -t tid ] ] [ -b secs ] [ -e secs ] [ -w secs ]\n"
                     "    -d delay       Time to sleep between updates.\n"
                     "    -n iterations  Number of updates to show (0 = infinite).\n"
                     "    -p pid         Process to monitor (default is all).\n"
                     "    -t tid         Thread (within specified process) to monitor (default is all).\n"
+                    "    -a             Add up the latencies of every thread in the system.\n"
+                    "    -j jobs        Threads reading per-thread stats (default is one per cpu).\n"
+                    "    -o file        Also append every update to file, erasing the counters\n"
+                    "                   after each one so updates don't overlap.\n"
+                    "    -i file        Add up the updates logged in file with -o instead, for\n"
+                    "                   the process and thread of -p and -t if given.\n"
+                    "    -b secs        With -i, skip the first secs seconds of the log.\n"
+                    "    -e secs        With -i, stop secs seconds into the log.\n"
+                    "    -w secs        With -i, show a table for every secs seconds.\n"
                     "    -h             Display this help screen.\n",
-        cmd);
+        cmd, cmd);
 }
 
 static int numcmp(const long long a, const long long b) {
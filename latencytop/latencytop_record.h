@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LATENCYTOP_RECORD_H
+#define LATENCYTOP_RECORD_H
+
+#include <stdint.h>
+
+/*
+ * Log written by latencytop -o <file> and read back by latencytop -i <file>,
+ * in host byte order.
+ *
+ * The log is a sequence of blocks, each starting with a struct
+ * latency_block. Every run appends a LATENCY_BLOCK_START block, then for
+ * every update the reasons first seen in it, as LATENCY_BLOCK_REASON blocks,
+ * and a LATENCY_BLOCK_SAMPLE block holding that update's records.
+ *
+ * Reason ids are only valid until the next LATENCY_BLOCK_START, so runs can
+ * be appended to the same log.
+ *
+ * The counters are erased after every update while recording, so each
+ * record covers the interval ending at the time of its sample, and times
+ * are in microseconds.
+ */
+
+#define LATENCY_LOG_MAGIC 0x5943544c  /* "LTCY" */
+#define LATENCY_LOG_VERSION 1
+
+enum {
+    /* value: LATENCY_LOG_MAGIC, length: LATENCY_LOG_VERSION */
+    LATENCY_BLOCK_START = 1,
+    /* value: reason id, length: bytes of the reason that follow, padded
+     * with NULs to a multiple of 4 */
+    LATENCY_BLOCK_REASON,
+    /* value: number of struct latency_record that follow, length: 0 */
+    LATENCY_BLOCK_SAMPLE,
+};
+
+struct latency_block {
+    uint32_t type;
+    uint32_t value;
+    uint32_t length;
+    uint32_t reserved;
+    /* CLOCK_REALTIME, in ns. */
+    uint64_t timestamp_ns;
+};
+
+struct latency_record {
+    uint64_t total;
+    uint32_t reason;
+    /* 0 for the global stats. */
+    int32_t pid;
+    int32_t tid;
+    uint32_t count;
+    uint32_t max;
+    uint32_t reserved;
+};
+
+#endif
@@ -90,10 +90,22 @@ int pm_kernel_pids(pm_kernel_t *ker, pid_t **pids_out, size_t *len);
  * The count is returned through *count_out. */
 int pm_kernel_count(pm_kernel_t *ker, unsigned long pfn, uint64_t *count_out);
 
+/* Get the map counts of count consecutive physical frames starting at pfn,
+ * with a single read. The counts are returned through counts_out, which
+ * must hold count entries. */
+int pm_kernel_count_range(pm_kernel_t *ker, unsigned long pfn, size_t count,
+                          uint64_t *counts_out);
+
 /* Get the page flags (from /proc/kpageflags) of a physical frame.
  * The count is returned through *flags_out. */
 int pm_kernel_flags(pm_kernel_t *ker, unsigned long pfn, uint64_t *flags_out);
 
+/* Get the page flags of count consecutive physical frames starting at pfn,
+ * with a single read. The flags are returned through flags_out, which must
+ * hold count entries. */
+int pm_kernel_flags_range(pm_kernel_t *ker, unsigned long pfn, size_t count,
+                          uint64_t *flags_out);
+
 #define PM_PAGE_LOCKED     (1 <<  0)
 #define PM_PAGE_ERROR      (1 <<  1)
 #define PM_PAGE_REFERENCED (1 <<  2)
@@ -178,6 +190,7 @@ int pm_process_destroy(pm_process_t *proc);
 #define PM_MAP_WRITE 2
 #define PM_MAP_EXEC  4
 #define PM_MAP_PERMISSIONS (PM_MAP_READ | PM_MAP_WRITE | PM_MAP_EXEC)
+#define PM_MAP_PRIVATE 8
 #define pm_map_start(map)  ((map)->start)
 #define pm_map_end(map)    ((map)->end)
 #define pm_map_offset(map) ((map)->offset)
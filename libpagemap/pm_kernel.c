@@ -129,6 +129,23 @@ int pm_kernel_count(pm_kernel_t *ker, unsigned long pfn, uint64_t *count_out) {
     return 0;
 }
 
+int pm_kernel_count_range(pm_kernel_t *ker, unsigned long pfn, size_t count,
+                          uint64_t *counts_out) {
+    ssize_t len;
+
+    if (!ker || !counts_out)
+        return -1;
+
+    len = pread64(ker->kpagecount_fd, counts_out, count * sizeof(uint64_t),
+                (off64_t)pfn * sizeof(uint64_t));
+    if (len < 0)
+        return errno;
+    if (len < (ssize_t)(count * sizeof(uint64_t)))
+        return -1;
+
+    return 0;
+}
+
 int pm_kernel_flags(pm_kernel_t *ker, unsigned long pfn, uint64_t *flags_out) {
     off_t off;
 
@@ -145,6 +162,23 @@ int pm_kernel_flags(pm_kernel_t *ker, unsigned long pfn, uint64_t *flags_out) {
     return 0;
 }
 
+int pm_kernel_flags_range(pm_kernel_t *ker, unsigned long pfn, size_t count,
+                          uint64_t *flags_out) {
+    ssize_t len;
+
+    if (!ker || !flags_out)
+        return -1;
+
+    len = pread64(ker->kpageflags_fd, flags_out, count * sizeof(uint64_t),
+                (off64_t)pfn * sizeof(uint64_t));
+    if (len < 0)
+        return errno;
+    if (len < (ssize_t)(count * sizeof(uint64_t)))
+        return -1;
+
+    return 0;
+}
+
 int pm_kernel_destroy(pm_kernel_t *ker) {
     if (!ker)
         return -1;
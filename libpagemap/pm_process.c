@@ -102,9 +102,9 @@ int pm_process_usage(pm_process_t *proc, pm_memusage_t *usage_out) {
 int pm_process_pagemap_range(pm_process_t *proc,
                              unsigned long low, unsigned long high,
                              uint64_t **range_out, size_t *len) {
-    int firstpage, numpages;
+    unsigned long firstpage, numpages;
     uint64_t *range;
-    off_t off;
+    ssize_t bytes;
     int error;
 
     if (!proc || (low >= high) || !range_out || !len)
@@ -117,21 +117,17 @@ int pm_process_pagemap_range(pm_process_t *proc,
     if (!range)
         return errno;
 
-    off = lseek(proc->pagemap_fd, firstpage * sizeof(uint64_t), SEEK_SET);
-    if (off == (off_t)-1) {
-        error = errno;
-        free(range);
-        return error;
-    }
-    error = read(proc->pagemap_fd, (char*)range, numpages * sizeof(uint64_t));
-    if (error == 0) {
+    /* pread so that several threads can share the pagemap fd. */
+    bytes = pread64(proc->pagemap_fd, (char*)range, numpages * sizeof(uint64_t),
+                  (off64_t)firstpage * sizeof(uint64_t));
+    if (bytes == 0) {
         /* EOF, mapping is not in userspace mapping range (probably vectors) */
         *len = 0;
         free(range);
         *range_out = NULL;
         return 0;
-    } else if (error < 0 || (error > 0 && error < (int)(numpages * sizeof(uint64_t)))) {
-        error = (error < 0) ? errno : -1;
+    } else if (bytes < 0 || (size_t)bytes < numpages * sizeof(uint64_t)) {
+        error = (bytes < 0) ? errno : -1;
         free(range);
         return error;
     }
@@ -285,6 +281,7 @@ static int read_maps(pm_process_t *proc) {
         if (perms[0] == 'r') map->flags |= PM_MAP_READ;
         if (perms[1] == 'w') map->flags |= PM_MAP_WRITE;
         if (perms[2] == 'x') map->flags |= PM_MAP_EXEC;
+        if (perms[3] == 'p') map->flags |= PM_MAP_PRIVATE;
 
         maps_count++;
     }
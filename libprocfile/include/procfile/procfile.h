@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PROCFILE_PROCFILE_H
+#define _PROCFILE_PROCFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * procfile_t reads a /proc or /sys file over and over without reopening it
+ * or going through stdio. Each procfile_read() rereads the file from offset
+ * 0 into a buffer that is kept, and only grown, across reads, so sampling a
+ * file at a high rate costs a few pread() calls and no allocations.
+ *
+ * The buffer is always NUL terminated, so the parsing functions below can
+ * walk it without being given its length.
+ */
+typedef struct procfile procfile_t;
+
+struct procfile {
+    int fd;
+
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+/* Initialize an empty procfile. Must be called before anything else. */
+void procfile_init(procfile_t *pf);
+
+/* Open path, closing whatever file was open before but keeping the buffer.
+ * Returns 0 on success or -1 with errno set. */
+int procfile_open(procfile_t *pf, const char *path);
+
+/* Read the whole file again. Returns the number of bytes read, which are
+ * then in pf->buf, or -1 with errno set. */
+ssize_t procfile_read(procfile_t *pf);
+
+/* Close the file, keeping the buffer for a later procfile_open(). */
+void procfile_close(procfile_t *pf);
+
+/* Close the file and free the buffer. */
+void procfile_destroy(procfile_t *pf);
+
+/*
+ * Parsing helpers. They all take a pointer into a NUL terminated buffer and
+ * return a pointer to where parsing should continue, or NULL when what was
+ * asked for isn't there. Spaces and tabs before a token or number are
+ * skipped, newlines are not, so a parse never runs into the next line.
+ */
+
+/* Returns the start of the next line, or NULL if there is none. */
+const char *procfile_next_line(const char *p);
+
+/* Skips spaces and tabs. */
+const char *procfile_skip_spaces(const char *p);
+
+/* Finds the next token, a run of characters other than whitespace. Sets
+ * *start and *len to it and returns the pointer just past it. */
+const char *procfile_next_token(const char *p, const char **start, size_t *len);
+
+/* Matches the next token against word. */
+const char *procfile_match(const char *p, const char *word);
+
+/* Parses an unsigned decimal number. */
+const char *procfile_parse_u64(const char *p, uint64_t *value);
+
+/* Parses count unsigned decimal numbers into values. */
+const char *procfile_parse_u64s(const char *p, uint64_t *values, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <procfile/procfile.h>
+
+/* Most of the files read are well under a page. */
+#define PROCFILE_INITIAL_SIZE 4096
+
+void procfile_init(procfile_t *pf) {
+    pf->fd = -1;
+    pf->buf = NULL;
+    pf->size = 0;
+    pf->len = 0;
+}
+
+int procfile_open(procfile_t *pf, const char *path) {
+    procfile_close(pf);
+
+    pf->fd = open(path, O_RDONLY);
+    if (pf->fd < 0)
+        return -1;
+
+    return 0;
+}
+
+ssize_t procfile_read(procfile_t *pf) {
+    ssize_t bytes;
+    size_t new_size;
+    char *tmp;
+
+    if (pf->fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    pf->len = 0;
+    while (1) {
+        /* Always keep room for the terminating NUL. */
+        if (pf->size - pf->len <= 1) {
+            new_size = pf->size ? pf->size * 2 : PROCFILE_INITIAL_SIZE;
+            tmp = realloc(pf->buf, new_size);
+            if (!tmp) {
+                errno = ENOMEM;
+                return -1;
+            }
+            pf->buf = tmp;
+            pf->size = new_size;
+        }
+
+        bytes = pread(pf->fd, pf->buf + pf->len, pf->size - pf->len - 1, pf->len);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes == 0)
+            break;
+        pf->len += bytes;
+    }
+    pf->buf[pf->len] = '\0';
+
+    return pf->len;
+}
+
+void procfile_close(procfile_t *pf) {
+    if (pf->fd >= 0) {
+        close(pf->fd);
+        pf->fd = -1;
+    }
+}
+
+void procfile_destroy(procfile_t *pf) {
+    procfile_close(pf);
+    free(pf->buf);
+    pf->buf = NULL;
+    pf->size = 0;
+    pf->len = 0;
+}
+
+const char *procfile_next_line(const char *p) {
+    p = strchr(p, '\n');
+    if (!p || !p[1])
+        return NULL;
+
+    return p + 1;
+}
+
+const char *procfile_skip_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    return p;
+}
+
+static inline int is_token_char(char c) {
+    return c != '\0' && c != ' ' && c != '\t' && c != '\n';
+}
+
+const char *procfile_next_token(const char *p, const char **start, size_t *len) {
+    const char *begin;
+
+    p = procfile_skip_spaces(p);
+    if (!is_token_char(*p))
+        return NULL;
+
+    begin = p;
+    while (is_token_char(*p))
+        p++;
+
+    *start = begin;
+    *len = p - begin;
+    return p;
+}
+
+const char *procfile_match(const char *p, const char *word) {
+    const char *token;
+    size_t len;
+
+    p = procfile_next_token(p, &token, &len);
+    if (!p || strncmp(token, word, len) || word[len] != '\0')
+        return NULL;
+
+    return p;
+}
+
+const char *procfile_parse_u64(const char *p, uint64_t *value) {
+    uint64_t v = 0;
+    unsigned int digit;
+
+    p = procfile_skip_spaces(p);
+    digit = (unsigned char)*p - '0';
+    if (digit > 9)
+        return NULL;
+
+    do {
+        v = v * 10 + digit;
+        digit = (unsigned char)*++p - '0';
+    } while (digit <= 9);
+
+    *value = v;
+    return p;
+}
+
+const char *procfile_parse_u64s(const char *p, uint64_t *values, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count && p; i++)
+        p = procfile_parse_u64(p, &values[i]);
+
+    return p;
+}
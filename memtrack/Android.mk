@@ -20,6 +20,7 @@ src_files := \
 includes := \
     bionic \
     external/stlport/stlport \
+    $(LOCAL_PATH)/../libprocfile/include \
 
 include $(CLEAR_VARS)
 
@@ -35,6 +36,9 @@ LOCAL_SHARED_LIBRARIES := \
 	libstlport \
 	liblog \
 
+LOCAL_STATIC_LIBRARIES := \
+	libprocfile \
+
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
@@ -47,6 +51,7 @@ LOCAL_MODULE := memtrack
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_C_INCLUDES += $(includes)
 LOCAL_STATIC_LIBRARIES := \
+	libprocfile \
 	libc \
 	libstdc++ \
 	libstlport_static \
@@ -15,13 +15,18 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 
@@ -31,6 +36,7 @@
 #include <vector>
 
 #include "memtrack.h"
+#include "memtrack_export.h"
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -39,7 +45,7 @@
 
 FileData::FileData(char *filename, char *buffer, size_t buffer_len)
     : data_(buffer), max_(buffer_len), cur_idx_(0), len_(0),
-      read_complete_(false) {
+      read_complete_(false), skip_line_(false) {
   fd_ = open(filename, O_RDONLY);
   if (fd_ < 0) {
     read_complete_ = true;
@@ -52,114 +58,546 @@ FileData::~FileData() {
   }
 }
 
-bool FileData::isAvail(size_t bytes_needed) {
-  if (cur_idx_ + bytes_needed < len_) {
-    return true;
-  }
-
+bool FileData::fill() {
   if (read_complete_) {
     return false;
   }
 
-  if (cur_idx_ != len_) {
-    // Copy the leftover to the front of the buffer.
-    len_ = len_ - cur_idx_;
-    memcpy(data_, data_ + cur_idx_, len_);
+  if (cur_idx_ != 0) {
+    // Move the partial line left over to the front of the buffer.
+    len_ -= cur_idx_;
+    memmove(data_, data_ + cur_idx_, len_);
+    cur_idx_ = 0;
   }
 
-  ssize_t bytes;
-  cur_idx_ = 0;
-  while (cur_idx_ + bytes_needed >= len_) {
-    bytes = read(fd_, data_ + len_, max_ - len_);
-    if (bytes == 0 || bytes == -1) {
-      read_complete_;
-      break;
+  while (true) {
+    // Keep room to NUL terminate the data for procfile_parse_u64().
+    ssize_t bytes = read(fd_, data_ + len_, max_ - 1 - len_);
+    if (bytes > 0) {
+      len_ += bytes;
+      data_[len_] = '\0';
+      return true;
+    }
+    if (bytes == -1 && errno == EINTR) {
+      continue;
     }
-    len_ += bytes;
+    read_complete_ = true;
+    return false;
   }
+}
 
-  return cur_idx_ + bytes_needed < len_;
+// Load four bytes from a possibly unaligned address.
+static inline uint32_t load32(const char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
 }
 
 bool FileData::getPss(size_t *pss) {
-  size_t value;
   while (true) {
-    if (!isAvail(4)) {
-      return false;
+    char *line = data_ + cur_idx_;
+    char *end = data_ + len_;
+    char *eol = (char *)memchr(line, '\n', end - line);
+    if (eol == NULL) {
+      if (cur_idx_ == 0 && len_ == max_ - 1) {
+        // The line doesn't fit in the buffer. A Pss line is always short,
+        // so drop what we have and ignore the rest of the line.
+        skip_line_ = true;
+        cur_idx_ = len_;
+      }
+      if (fill()) {
+        continue;
+      }
+      if (cur_idx_ == len_) {
+        return false;
+      }
+      // The last line has no newline.
+      eol = end;
+      cur_idx_ = len_;
+    } else {
+      cur_idx_ = eol + 1 - data_;
     }
 
-    if (data_[cur_idx_] != 'P' || data_[cur_idx_+1] != 's' ||
-        data_[cur_idx_+2] != 's' || data_[cur_idx_+3] != ':') {
-      // Consume the rest of the line.
-      while (isAvail(1) && data_[cur_idx_++] != '\n');
-    } else {
-      cur_idx_ += 4;
-      while (isAvail(1) && isspace(data_[cur_idx_])) {
-        cur_idx_++;
-      }
+    if (skip_line_) {
+      skip_line_ = false;
+      continue;
+    }
+
+    // Anything else starting with Pss (Pss_Anon:, ...) fails the compare on
+    // the fourth byte.
+    if (eol - line < 4 || load32(line) != load32("Pss:")) {
+      continue;
+    }
 
+    uint64_t value;
+    if (procfile_parse_u64(line + 4, &value) == NULL) {
       value = 0;
-      while (isAvail(1) && isdigit(data_[cur_idx_])) {
-        value = value * 10 + data_[cur_idx_] - '0';
-        cur_idx_++;
+    }
+    *pss = value;
+    return true;
+  }
+}
+
+void P2Quantile::init(double p) {
+  p_ = p;
+  count_ = 0;
+  increments_[0] = 0;
+  increments_[1] = p / 2;
+  increments_[2] = p;
+  increments_[3] = (1 + p) / 2;
+  increments_[4] = 1;
+}
+
+void P2Quantile::add(double value) {
+  if (count_ < 5) {
+    heights_[count_++] = value;
+    if (count_ == 5) {
+      std::sort(heights_, heights_ + 5);
+      for (int i = 0; i < 5; i++) {
+        positions_[i] = i + 1;
       }
-      *pss = value;
+      desired_[0] = 1;
+      desired_[1] = 1 + 2 * p_;
+      desired_[2] = 1 + 4 * p_;
+      desired_[3] = 3 + 2 * p_;
+      desired_[4] = 5;
+    }
+    return;
+  }
+  count_++;
 
-      // Consume the rest of the line.
-      while (isAvail(1) && data_[cur_idx_++] != '\n');
+  // Find the cell the value falls in, extending the extremes if needed.
+  int k;
+  if (value < heights_[0]) {
+    heights_[0] = value;
+    k = 0;
+  } else if (value >= heights_[4]) {
+    heights_[4] = value;
+    k = 3;
+  } else {
+    for (k = 0; k < 3 && value >= heights_[k + 1]; k++);
+  }
 
-      return true;
+  for (int i = k + 1; i < 5; i++) {
+    positions_[i]++;
+  }
+  for (int i = 0; i < 5; i++) {
+    desired_[i] += increments_[i];
+  }
+
+  // Move the middle markers towards their desired positions.
+  for (int i = 1; i < 4; i++) {
+    double d = desired_[i] - positions_[i];
+    if ((d >= 1 && positions_[i + 1] - positions_[i] > 1) ||
+        (d <= -1 && positions_[i - 1] - positions_[i] < -1)) {
+      int sign = (d > 0) ? 1 : -1;
+      double height = parabolic(i, sign);
+      if (heights_[i - 1] < height && height < heights_[i + 1]) {
+        heights_[i] = height;
+      } else {
+        heights_[i] = linear(i, sign);
+      }
+      positions_[i] += sign;
     }
   }
 }
 
-const char *ProcessInfo::kProc = "/proc/";
-const char *ProcessInfo::kCmdline = "/cmdline";
-const char *ProcessInfo::kSmaps = "/smaps";
+double P2Quantile::parabolic(int i, double d) const {
+  return heights_[i] + d / (positions_[i + 1] - positions_[i - 1]) *
+      ((positions_[i] - positions_[i - 1] + d) *
+       (heights_[i + 1] - heights_[i]) / (positions_[i + 1] - positions_[i]) +
+       (positions_[i + 1] - positions_[i] - d) *
+       (heights_[i] - heights_[i - 1]) / (positions_[i] - positions_[i - 1]));
+}
+
+double P2Quantile::linear(int i, int d) const {
+  return heights_[i] + d * (heights_[i + d] - heights_[i]) /
+      (positions_[i + d] - positions_[i]);
+}
+
+double P2Quantile::value() const {
+  if (count_ == 0) {
+    return 0;
+  }
+  if (count_ >= 5) {
+    return heights_[2];
+  }
+
+  // Not enough values for the markers yet, use the exact answer.
+  double sorted[5];
+  memcpy(sorted, heights_, count_ * sizeof(double));
+  std::sort(sorted, sorted + count_);
+  size_t i = (size_t)(p_ * (count_ - 1) + 0.5);
+  return sorted[i];
+}
+
+Arena::Arena() : cur_chunk_(0), cur_idx_(0) {
+}
+
+Arena::~Arena() {
+  reset();
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    free(chunks_[i]);
+  }
+}
+
+void *Arena::alloc(size_t bytes) {
+  bytes = (bytes + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (bytes > kChunkSize) {
+    // Too big for a chunk, these are rare enough to simply be freed on reset.
+    char *data = (char *)malloc(bytes);
+    if (data == NULL) {
+      perror("Cannot allocate memory.\n");
+      exit(1);
+    }
+    big_chunks_.push_back(data);
+    return data;
+  }
+
+  while (cur_chunk_ < chunks_.size() && cur_idx_ + bytes > kChunkSize) {
+    cur_chunk_++;
+    cur_idx_ = 0;
+  }
+  if (cur_chunk_ == chunks_.size()) {
+    char *data = (char *)malloc(kChunkSize);
+    if (data == NULL) {
+      perror("Cannot allocate memory.\n");
+      exit(1);
+    }
+    chunks_.push_back(data);
+    cur_idx_ = 0;
+  }
+
+  void *ptr = chunks_[cur_chunk_] + cur_idx_;
+  cur_idx_ += bytes;
+  return ptr;
+}
 
-ProcessInfo::ProcessInfo() {
+const char *Arena::copyString(const char *str, size_t len) {
+  char *copy = (char *)alloc(len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+void Arena::reset() {
+  for (size_t i = 0; i < big_chunks_.size(); i++) {
+    free(big_chunks_[i]);
+  }
+  big_chunks_.clear();
+  cur_chunk_ = 0;
+  cur_idx_ = 0;
+}
+
+NameTable::NameTable() : capacity_(kInitialCapacity), size_(0) {
+  entries_ = (entry_t *)calloc(capacity_, sizeof(entry_t));
+  if (entries_ == NULL) {
+    perror("Cannot allocate memory.\n");
+    exit(1);
+  }
+}
+
+NameTable::~NameTable() {
+  free(entries_);
+}
+
+uint32_t NameTable::hash(const char *name, size_t len) {
+  // FNV-1a
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+size_t NameTable::find(const char *name, size_t len, uint32_t hash) const {
+  size_t mask = capacity_ - 1;
+  for (size_t i = hash & mask; entries_[i].name != NULL; i = (i + 1) & mask) {
+    if (entries_[i].hash == hash && entries_[i].len == len &&
+        memcmp(entries_[i].name, name, len) == 0) {
+      return entries_[i].index;
+    }
+  }
+  return kNotFound;
+}
+
+void NameTable::insert(const char *name, size_t len, uint32_t hash,
+                       size_t index) {
+  // Keep the load factor under 1/2 so probe sequences stay short.
+  if ((size_ + 1) * 2 > capacity_) {
+    grow();
+  }
+
+  size_t mask = capacity_ - 1;
+  size_t i;
+  for (i = hash & mask; entries_[i].name != NULL; i = (i + 1) & mask);
+  entries_[i].name = name;
+  entries_[i].len = len;
+  entries_[i].hash = hash;
+  entries_[i].index = index;
+  size_++;
+}
+
+void NameTable::clear() {
+  if (size_ != 0) {
+    memset(entries_, 0, capacity_ * sizeof(entry_t));
+    size_ = 0;
+  }
+}
+
+void NameTable::grow() {
+  entry_t *old_entries = entries_;
+  size_t old_capacity = capacity_;
+
+  capacity_ *= 2;
+  entries_ = (entry_t *)calloc(capacity_, sizeof(entry_t));
+  if (entries_ == NULL) {
+    perror("Cannot allocate memory.\n");
+    exit(1);
+  }
+
+  size_t mask = capacity_ - 1;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_entries[i].name == NULL) {
+      continue;
+    }
+    size_t j;
+    for (j = old_entries[i].hash & mask; entries_[j].name != NULL;
+         j = (j + 1) & mask);
+    entries_[j] = old_entries[i];
+  }
+  free(old_entries);
+}
+
+const char *ScanWorker::kProc = "/proc/";
+const char *ScanWorker::kCmdline = "/cmdline";
+const char *ScanWorker::kSmaps = "/smaps";
+
+ScanWorker::ScanWorker() : num_cur_(0) {
   memcpy(proc_file_, kProc, kProcLen);
+  procfile_init(&cmdline_);
 }
 
-ProcessInfo::~ProcessInfo() {
+ScanWorker::~ScanWorker() {
+  procfile_destroy(&cmdline_);
+}
+
+void ScanWorker::reset() {
+  num_cur_ = 0;
+  names_.clear();
+  arena_.reset();
 }
 
-bool ProcessInfo::getInformation(int pid, char *pid_str, size_t pid_str_len) {
+bool ScanWorker::getInformation(int pid, const char *pid_str,
+                                size_t pid_str_len) {
   memcpy(proc_file_ + kProcLen, pid_str, pid_str_len);
   memcpy(proc_file_ + kProcLen + pid_str_len, kCmdline, kCmdlineLen);
 
   // Read the cmdline for the process.
-  int fd = open(proc_file_, O_RDONLY);
-  if (fd < 0) {
+  if (procfile_open(&cmdline_, proc_file_) != 0) {
     return false;
   }
-
-  ssize_t bytes = read(fd, cmd_name_, sizeof(cmd_name_));
-  close(fd);
-  if (bytes == -1 || bytes == 0) {
+  ssize_t bytes = procfile_read(&cmdline_);
+  procfile_close(&cmdline_);
+  if (bytes <= 0) {
     return false;
   }
+  // Only the first argument is used as the name.
+  const char *cmd_name = cmdline_.buf;
+  size_t name_len = strlen(cmd_name);
 
   memcpy(proc_file_ + kProcLen + pid_str_len, kSmaps, kSmapsLen);
   FileData smaps(proc_file_, buffer_, sizeof(buffer_));
 
-  cur_process_info_t process_info;
+  size_t total_pss_kb = 0;
   size_t pss_kb;
-  process_info.pss_kb = 0;
   while (smaps.getPss(&pss_kb)) {
-    process_info.pss_kb += pss_kb;
+    total_pss_kb += pss_kb;
   }
 
-  if (cur_.count(cmd_name_) == 0) {
-    cur_[cmd_name_] = process_info;
-  } else {
-    cur_[cmd_name_].pss_kb += process_info.pss_kb;
+  uint32_t hash = NameTable::hash(cmd_name, name_len);
+  size_t index = names_.find(cmd_name, name_len, hash);
+  if (index == NameTable::kNotFound) {
+    index = num_cur_++;
+    if (index == cur_.size()) {
+      cur_.resize(index + 1);
+    }
+    cur_process_info_t *info = &cur_[index];
+    info->name = arena_.copyString(cmd_name, name_len);
+    info->name_len = name_len;
+    info->hash = hash;
+    info->pss_kb = 0;
+    info->pids.clear();
+    names_.insert(info->name, name_len, hash, index);
   }
-  cur_[cmd_name_].pids.push_back(pid);
+  cur_[index].pss_kb += total_pss_kb;
+  cur_[index].pids.push_back(pid);
 
   return true;
 }
 
+const char *ProcessInfo::kProc = "/proc/";
+
+static unsigned long long nowNs() {
+  struct timespec t;
+  memset(&t, 0, sizeof(t));
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (unsigned long long)t.tv_sec*NS_PER_SEC + t.tv_nsec;
+}
+
+ProcessInfo::ProcessInfo(size_t num_threads, size_t history_len,
+                         size_t max_names, double growth_threshold_kb_per_min)
+    : next_pid_(0), scan_id_(0), workers_done_(0), exiting_(false),
+      history_len_(history_len), max_names_(max_names), untracked_pids_(0),
+      growth_threshold_(growth_threshold_kb_per_min), last_scan_ns_(0),
+      num_scans_(0), export_map_(NULL), export_len_(0) {
+  start_ns_ = nowNs();
+
+  if (num_threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = (cpus > 0) ? cpus : 1;
+  }
+  if (num_threads > MAX_SCAN_THREADS) {
+    num_threads = MAX_SCAN_THREADS;
+  }
+
+  pids_.reserve(kInitialEntries);
+  all_.reserve(kInitialEntries);
+
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&start_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.push_back(new ScanWorker());
+  }
+
+  // The args must not move once the threads have been started.
+  thread_args_.resize(num_threads);
+  for (size_t i = 1; i < num_threads; i++) {
+    thread_args_[i].info = this;
+    thread_args_[i].worker = workers_[i];
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerThread, &thread_args_[i]) != 0) {
+      // Run with however many threads we managed to start.
+      for (size_t j = i; j < num_threads; j++) {
+        delete workers_[j];
+      }
+      workers_.resize(i);
+      break;
+    }
+    threads_.push_back(thread);
+  }
+}
+
+ProcessInfo::~ProcessInfo() {
+  pthread_mutex_lock(&lock_);
+  exiting_ = true;
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&lock_);
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+
+  for (size_t i = 0; i < workers_.size(); i++) {
+    delete workers_[i];
+  }
+
+  if (export_map_ != NULL) {
+    munmap(export_map_, export_len_);
+  }
+
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&start_cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+void *ProcessInfo::workerThread(void *data) {
+  thread_arg_t *arg = (thread_arg_t *)data;
+  ProcessInfo *info = arg->info;
+
+  unsigned int last_scan_id = 0;
+  pthread_mutex_lock(&info->lock_);
+  while (true) {
+    while (!info->exiting_ && info->scan_id_ == last_scan_id) {
+      pthread_cond_wait(&info->start_cond_, &info->lock_);
+    }
+    if (info->exiting_) {
+      break;
+    }
+    last_scan_id = info->scan_id_;
+    pthread_mutex_unlock(&info->lock_);
+
+    info->runWorker(arg->worker);
+
+    pthread_mutex_lock(&info->lock_);
+    info->workers_done_++;
+    pthread_cond_signal(&info->done_cond_);
+  }
+  pthread_mutex_unlock(&info->lock_);
+
+  return NULL;
+}
+
+void ProcessInfo::runWorker(ScanWorker *worker) {
+  worker->reset();
+
+  size_t num_pids = pids_.size();
+  while (true) {
+    size_t i = __sync_fetch_and_add(&next_pid_, 1);
+    if (i >= num_pids) {
+      break;
+    }
+    worker->getInformation(pids_[i].pid, pids_[i].str, pids_[i].len);
+  }
+}
+
+void ProcessInfo::mergeWorker(const ScanWorker &worker) {
+  for (size_t i = 0; i < worker.numProcesses(); i++) {
+    const cur_process_info_t &cur = worker.process(i);
+
+    size_t index = all_names_.find(cur.name, cur.name_len, cur.hash);
+    if (index == NameTable::kNotFound) {
+      if (all_.size() == max_names_) {
+        untracked_pids_ += cur.pids.size();
+        continue;
+      }
+      index = all_.size();
+      all_.resize(index + 1);
+
+      // Initialize all of the variables.
+      process_info_t *info = &all_[index];
+      info->name = names_arena_.copyString(cur.name, cur.name_len);
+      info->max_num_pids = 0;
+      info->num_samples = 0;
+      info->avg_pss_kb = 0;
+      info->min_pss_kb = 0;
+      info->max_pss_kb = 0;
+      info->last_pss_kb = 0;
+      info->sample_pss_kb = 0;
+      info->sample_id = 0;
+      info->history = (pss_sample_t *)names_arena_.alloc(
+          history_len_ * sizeof(pss_sample_t));
+      info->history_next = 0;
+      info->history_count = 0;
+      info->p50_pss_kb.init(0.50);
+      info->p95_pss_kb.init(0.95);
+      info->p99_pss_kb.init(0.99);
+      all_names_.insert(info->name, cur.name_len, cur.hash, index);
+    }
+
+    process_info_t *info = &all_[index];
+    if (info->sample_id != scan_id_) {
+      info->sample_id = scan_id_;
+      info->sample_pss_kb = 0;
+      touched_.push_back(index);
+    }
+    info->sample_pss_kb += cur.pss_kb;
+    info->pids.insert(info->pids.end(), cur.pids.begin(), cur.pids.end());
+  }
+}
+
 void ProcessInfo::scan() {
   DIR *proc_dir = opendir(kProc);
   if (proc_dir == NULL) {
@@ -168,21 +606,24 @@ void ProcessInfo::scan() {
   }
 
   // Clear any current pids.
-  for (processes_t::iterator it = all_.begin(); it != all_.end(); ++it) {
-    it->second.pids.clear();
+  for (size_t i = 0; i < all_.size(); i++) {
+    all_[i].pids.clear();
   }
 
   struct dirent *dir_data;
-  int len;
+  size_t len;
   bool is_pid;
-  size_t pid;
-  cur_.clear();
+  int pid;
+  pids_.clear();
   while ((dir_data = readdir(proc_dir))) {
     // Check if the directory entry represents a pid.
     len = strlen(dir_data->d_name);
+    if (len >= sizeof(((pid_entry_t *)0)->str)) {
+      continue;
+    }
     is_pid = true;
     pid = 0;
-    for (int i = 0; i < len; i++) {
+    for (size_t i = 0; i < len; i++) {
       if (!isdigit(dir_data->d_name[i])) {
         is_pid = false;
         break;
@@ -190,45 +631,213 @@ void ProcessInfo::scan() {
       pid = pid * 10 + dir_data->d_name[i] - '0';
     }
     if (is_pid) {
-      getInformation(pid, dir_data->d_name, len);
+      pid_entry_t entry;
+      entry.pid = pid;
+      entry.len = len;
+      memcpy(entry.str, dir_data->d_name, len + 1);
+      pids_.push_back(entry);
     }
   }
   closedir(proc_dir);
 
+  // Hand the pids to the workers, and do our share of the work on this
+  // thread.
+  pthread_mutex_lock(&lock_);
+  next_pid_ = 0;
+  workers_done_ = 0;
+  scan_id_++;
+  if (scan_id_ == 0) {
+    // Zero marks an entry that has never been part of a sample.
+    scan_id_ = 1;
+  }
+  pthread_cond_broadcast(&start_cond_);
+  pthread_mutex_unlock(&lock_);
+
+  runWorker(workers_[0]);
+
+  pthread_mutex_lock(&lock_);
+  while (workers_done_ != threads_.size()) {
+    pthread_cond_wait(&done_cond_, &lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+
+  last_scan_ns_ = nowNs();
+  uint32_t time_sec = (last_scan_ns_ - start_ns_) / NS_PER_SEC;
+  num_scans_++;
+
+  // Merge the per-thread results, summing up processes that share a name.
+  touched_.clear();
+  untracked_pids_ = 0;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    mergeWorker(*workers_[i]);
+  }
+
   // Loop through the current processes and add them into our real list.
-  for (cur_processes_t::const_iterator it = cur_.begin();
-       it != cur_.end(); ++it) {
+  for (size_t i = 0; i < touched_.size(); i++) {
+    process_info_t *info = &all_[touched_[i]];
 
-    if (all_.count(it->first) == 0) {
-      // Initialize all of the variables.
-      all_[it->first].num_samples = 0;
-      all_[it->first].name = it->first;
-      all_[it->first].avg_pss_kb = 0;
-      all_[it->first].min_pss_kb = 0;
-      all_[it->first].max_pss_kb = 0;
-    }
+    // Keep the pids in a stable order no matter which thread found them.
+    std::sort(info->pids.begin(), info->pids.end());
 
-    if (it->second.pids.size() > all_[it->first].max_num_pids) {
-      all_[it->first].max_num_pids = it->second.pids.size();
+    if (info->pids.size() > info->max_num_pids) {
+      info->max_num_pids = info->pids.size();
     }
 
-    all_[it->first].pids = it->second.pids;
-
-    if (it->second.pss_kb > all_[it->first].max_pss_kb) {
-      all_[it->first].max_pss_kb = it->second.pss_kb;
+    if (info->sample_pss_kb > info->max_pss_kb) {
+      info->max_pss_kb = info->sample_pss_kb;
     }
 
-    if (all_[it->first].min_pss_kb == 0 ||
-        it->second.pss_kb < all_[it->first].min_pss_kb) {
-      all_[it->first].min_pss_kb = it->second.pss_kb;
+    if (info->min_pss_kb == 0 || info->sample_pss_kb < info->min_pss_kb) {
+      info->min_pss_kb = info->sample_pss_kb;
     }
 
-    all_[it->first].last_pss_kb = it->second.pss_kb;
+    info->last_pss_kb = info->sample_pss_kb;
+
+    computeAvg(&info->avg_pss_kb, info->sample_pss_kb, info->num_samples);
+    info->num_samples++;
+
+    addSample(info, time_sec);
+  }
+
+  if (export_map_ != NULL) {
+    exportToFile();
+  }
+}
+
+void ProcessInfo::addSample(process_info_t *info, uint32_t time_sec) {
+  pss_sample_t *sample = &info->history[info->history_next];
+  sample->time_sec = time_sec;
+  sample->pss_kb = info->sample_pss_kb;
+  info->history_next = (info->history_next + 1) % history_len_;
+  if (info->history_count < history_len_) {
+    info->history_count++;
+  }
+
+  info->p50_pss_kb.add(info->sample_pss_kb);
+  info->p95_pss_kb.add(info->sample_pss_kb);
+  info->p99_pss_kb.add(info->sample_pss_kb);
+}
+
+double ProcessInfo::growthRate(const process_info_t *info) const {
+  size_t n = info->history_count;
+  if (n < 2) {
+    return 0;
+  }
+
+  // Times are relative to the oldest sample to keep the sums small.
+  size_t oldest = (info->history_next + history_len_ - n) % history_len_;
+  uint32_t base_sec = info->history[oldest].time_sec;
+  double sum_t = 0, sum_p = 0, sum_tt = 0, sum_tp = 0;
+  for (size_t i = 0; i < n; i++) {
+    const pss_sample_t *sample = &info->history[(oldest + i) % history_len_];
+    double t = sample->time_sec - base_sec;
+    double p = sample->pss_kb;
+    sum_t += t;
+    sum_p += p;
+    sum_tt += t * t;
+    sum_tp += t * p;
+  }
+
+  double denom = n * sum_tt - sum_t * sum_t;
+  if (denom == 0) {
+    return 0;
+  }
+  return (n * sum_tp - sum_t * sum_p) / denom * 60;
+}
+
+bool ProcessInfo::isGrowing(const process_info_t *info, double growth) const {
+  // Don't trust the slope until at least half of the window is filled.
+  return growth > growth_threshold_ && info->history_count * 2 >= history_len_;
+}
+
+bool ProcessInfo::openExport(const char *filename) {
+  export_len_ = sizeof(memtrack_export_header_t) +
+                max_names_ * sizeof(memtrack_export_record_t);
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  if (ftruncate(fd, export_len_) != 0) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, export_len_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  export_map_ = map;
+
+  memtrack_export_header_t *header = (memtrack_export_header_t *)export_map_;
+  header->magic = MEMTRACK_EXPORT_MAGIC;
+  header->version = MEMTRACK_EXPORT_VERSION;
+  header->header_size = sizeof(memtrack_export_header_t);
+  header->record_size = sizeof(memtrack_export_record_t);
+  header->max_records = max_names_;
+  header->num_records = 0;
+  header->sequence = 0;
+
+  return true;
+}
+
+static inline uint32_t clampU32(double value) {
+  if (value <= 0) {
+    return 0;
+  }
+  if (value >= UINT32_MAX) {
+    return UINT32_MAX;
+  }
+  return (uint32_t)(value + 0.5);
+}
+
+void ProcessInfo::exportToFile() {
+  memtrack_export_header_t *header = (memtrack_export_header_t *)export_map_;
+  memtrack_export_record_t *records =
+      (memtrack_export_record_t *)(header + 1);
+
+  // An odd sequence number tells readers an update is in progress.
+  header->sequence++;
+  __sync_synchronize();
 
-    computeAvg(&all_[it->first].avg_pss_kb, it->second.pss_kb,
-               all_[it->first].num_samples);
-    all_[it->first].num_samples++;
+  // Records are kept in the order the names were first seen, so a name
+  // always stays in the same record.
+  for (size_t i = 0; i < all_.size(); i++) {
+    const process_info_t *info = &all_[i];
+    memtrack_export_record_t *record = &records[i];
+
+    if (i >= header->num_records) {
+      strncpy(record->name, info->name, MEMTRACK_EXPORT_NAME_LEN - 1);
+      record->name[MEMTRACK_EXPORT_NAME_LEN - 1] = '\0';
+    }
+
+    double growth = growthRate(info);
+    record->flags = 0;
+    if (isGrowing(info, growth)) {
+      record->flags |= MEMTRACK_EXPORT_FLAG_GROWING;
+    }
+    if (info->sample_id == scan_id_) {
+      record->flags |= MEMTRACK_EXPORT_FLAG_RUNNING;
+    }
+    record->num_pids = info->pids.size();
+    record->max_num_pids = info->max_num_pids;
+    record->num_samples = info->num_samples;
+    record->last_pss_kb = info->last_pss_kb;
+    record->min_pss_kb = info->min_pss_kb;
+    record->max_pss_kb = info->max_pss_kb;
+    record->avg_pss_kb = clampU32(info->avg_pss_kb);
+    record->p50_pss_kb = clampU32(info->p50_pss_kb.value());
+    record->p95_pss_kb = clampU32(info->p95_pss_kb.value());
+    record->p99_pss_kb = clampU32(info->p99_pss_kb.value());
+    record->growth_kb_per_min = (int32_t)growth;
   }
+  header->num_records = all_.size();
+  header->num_scans = num_scans_;
+  header->timestamp_ns = last_scan_ns_;
+
+  __sync_synchronize();
+  header->sequence++;
 }
 
 bool comparePss(const process_info_t *first, const process_info_t *second) {
@@ -237,8 +846,8 @@ bool comparePss(const process_info_t *first, const process_info_t *second) {
 
 void ProcessInfo::dumpToLog() {
   list_.clear();
-  for (processes_t::const_iterator it = all_.begin(); it != all_.end(); ++it) {
-    list_.push_back(&it->second);
+  for (size_t i = 0; i < all_.size(); i++) {
+    list_.push_back(&all_[i]);
   }
 
   // Now sort the list.
@@ -247,8 +856,8 @@ void ProcessInfo::dumpToLog() {
   ALOGI("Dumping process list");
   for (std::vector<const process_info_t *>::const_iterator it = list_.begin();
        it != list_.end(); ++it) {
-    ALOGI("  Name: %s", (*it)->name.c_str());
-    ALOGI("    Max running processes: %d", (*it)->max_num_pids);
+    ALOGI("  Name: %s", (*it)->name);
+    ALOGI("    Max running processes: %zu", (*it)->max_num_pids);
     if ((*it)->pids.size() > 0) {
       ALOGI("    Currently running pids:");
       for (std::vector<int>::const_iterator pid_it = (*it)->pids.begin();
@@ -261,13 +870,47 @@ void ProcessInfo::dumpToLog() {
     ALOGI("    Avg  PSS %0.4fM", (*it)->avg_pss_kb/1024.0);
     ALOGI("    Max  PSS %0.4fM", (*it)->max_pss_kb/1024.0);
     ALOGI("    Last PSS %0.4fM", (*it)->last_pss_kb/1024.0);
+    ALOGI("    P50  PSS %0.4fM", (*it)->p50_pss_kb.value()/1024.0);
+    ALOGI("    P95  PSS %0.4fM", (*it)->p95_pss_kb.value()/1024.0);
+    ALOGI("    P99  PSS %0.4fM", (*it)->p99_pss_kb.value()/1024.0);
+
+    double growth = growthRate(*it);
+    ALOGI("    Growth over last %zu samples %0.2fK/min%s",
+          (*it)->history_count, growth,
+          isGrowing(*it, growth) ? " (growing)" : "");
+  }
+
+  if (untracked_pids_ != 0) {
+    ALOGI("%zu processes in the last scan were not tracked, more than %zu "
+          "names seen", untracked_pids_, max_names_);
   }
 }
 
 void usage() {
   printf("Usage: memtrack [--verbose | --quiet] [--scan_delay TIME_SECS]\n");
+  printf("                [--threads NUM_THREADS] [--benchmark NUM_SCANS]\n");
+  printf("                [--history NUM_SAMPLES] [--max_names NUM_NAMES]\n");
+  printf("                [--growth_threshold KB_PER_MIN] [--export FILE]\n");
   printf("  --scan_delay TIME_SECS\n");
   printf("    The amount of delay in seconds between scans.\n");
+  printf("  --threads NUM_THREADS\n");
+  printf("    The number of threads used to scan. Defaults to the number of\n");
+  printf("    cpus online, up to %d.\n", MAX_SCAN_THREADS);
+  printf("  --benchmark NUM_SCANS\n");
+  printf("    Run NUM_SCANS scans back to back, print the time taken by each\n");
+  printf("    scan and a summary to stdout, then exit.\n");
+  printf("  --history NUM_SAMPLES\n");
+  printf("    The number of samples kept for each process name, used to find\n");
+  printf("    the growth rate. Defaults to %d.\n", DEFAULT_HISTORY_SAMPLES);
+  printf("  --max_names NUM_NAMES\n");
+  printf("    The maximum number of different process names tracked.\n");
+  printf("    Defaults to %d.\n", DEFAULT_MAX_NAMES);
+  printf("  --growth_threshold KB_PER_MIN\n");
+  printf("    Processes growing faster than this are reported as growing.\n");
+  printf("    Defaults to %d.\n", DEFAULT_GROWTH_THRESHOLD_KB_PER_MIN);
+  printf("  --export FILE\n");
+  printf("    After every scan, write the results to FILE in the binary\n");
+  printf("    format described in memtrack_export.h.\n");
   printf("  --verbose\n");
   printf("    Print information about the scans to stdout only.\n");
   printf("  --quiet\n");
@@ -276,6 +919,33 @@ void usage() {
          LOG_TAG);
 }
 
+void runBenchmark(ProcessInfo *proc_info, size_t num_scans) {
+  printf("Benchmarking %zu scans using %zu threads\n", num_scans,
+         proc_info->numThreads());
+
+  unsigned long long min_nsecs = 0;
+  unsigned long long max_nsecs = 0;
+  unsigned long long total_nsecs = 0;
+  for (size_t i = 0; i < num_scans; i++) {
+    unsigned long long nsecs = nowNs();
+    proc_info->scan();
+    nsecs = nowNs() - nsecs;
+    printf("Scan %zu Time %0.4f\n", i, ((double)nsecs)/NS_PER_SEC);
+
+    if (i == 0 || nsecs < min_nsecs) {
+      min_nsecs = nsecs;
+    }
+    if (nsecs > max_nsecs) {
+      max_nsecs = nsecs;
+    }
+    total_nsecs += nsecs;
+  }
+  printf("Scan Time min %0.4f avg %0.4f max %0.4f\n",
+         ((double)min_nsecs)/NS_PER_SEC,
+         ((double)total_nsecs)/num_scans/NS_PER_SEC,
+         ((double)max_nsecs)/NS_PER_SEC);
+}
+
 int SignalReceived = 0;
 
 int SignalsToHandle[] = {
@@ -301,6 +971,12 @@ int main(int argc, char **argv) {
   bool verbose = false;
   bool quiet = false;
   unsigned int scan_delay_sec = DEFAULT_SLEEP_DELAY_SECONDS;
+  size_t num_threads = 0;
+  size_t benchmark_scans = 0;
+  size_t history_len = DEFAULT_HISTORY_SAMPLES;
+  size_t max_names = DEFAULT_MAX_NAMES;
+  double growth_threshold = DEFAULT_GROWTH_THRESHOLD_KB_PER_MIN;
+  const char *export_file = NULL;
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--verbose") == 0) {
       verbose = true;
@@ -313,6 +989,37 @@ int main(int argc, char **argv) {
         exit(1);
       }
       scan_delay_sec = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 ||
+               strcmp(argv[i], "--benchmark") == 0 ||
+               strcmp(argv[i], "--history") == 0 ||
+               strcmp(argv[i], "--max_names") == 0) {
+      if (i+1 == argc || atoi(argv[i+1]) <= 0) {
+        printf("The %s options requires a single positive argument.\n",
+               argv[i]);
+        usage();
+        exit(1);
+      }
+      if (strcmp(argv[i], "--threads") == 0) {
+        num_threads = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--benchmark") == 0) {
+        benchmark_scans = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--history") == 0) {
+        history_len = atoi(argv[++i]);
+      } else {
+        max_names = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "--growth_threshold") == 0 ||
+               strcmp(argv[i], "--export") == 0) {
+      if (i+1 == argc) {
+        printf("The %s options requires a single argument.\n", argv[i]);
+        usage();
+        exit(1);
+      }
+      if (strcmp(argv[i], "--growth_threshold") == 0) {
+        growth_threshold = atof(argv[++i]);
+      } else {
+        export_file = argv[++i];
+      }
     } else {
       printf("Unknown option %s\n", argv[i]);
       usage();
@@ -333,7 +1040,17 @@ int main(int argc, char **argv) {
     }
   }
 
-  ProcessInfo proc_info;
+  ProcessInfo proc_info(num_threads, history_len, max_names, growth_threshold);
+  if (export_file != NULL && !proc_info.openExport(export_file)) {
+    printf("Unable to create export file %s: %s\n", export_file,
+           strerror(errno));
+    exit(1);
+  }
+
+  if (benchmark_scans > 0) {
+    runBenchmark(&proc_info, benchmark_scans);
+    return 0;
+  }
 
   if (!quiet) {
     printf("Hit Ctrl-Z or send SIGUSR1 to pid %d to print the current list of\n",
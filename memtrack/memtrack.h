@@ -17,15 +17,26 @@
 #ifndef __MEMTRACK_H__
 #define __MEMTRACK_H__
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/types.h>
 
-#include <map>
-#include <string>
 #include <vector>
 
+#include <procfile/procfile.h>
+
 #define DEFAULT_SLEEP_DELAY_SECONDS 5
 #define NS_PER_SEC 1000000000LL
 
+// Upper bound on the number of scan threads, regardless of the number of
+// cpus in the system.
+#define MAX_SCAN_THREADS 16
+
+#define DEFAULT_HISTORY_SAMPLES 600
+#define DEFAULT_MAX_NAMES 2048
+#define DEFAULT_GROWTH_THRESHOLD_KB_PER_MIN 64
+
 class FileData {
 public:
   FileData(char *filename, char *buffer, size_t buffer_len);
@@ -35,20 +46,118 @@ public:
   // PSS values to be found, return false.
   bool getPss(size_t *pss);
 
-  // Check if there is at least bytes available in the file data.
-  bool isAvail(size_t bytes);
-
 private:
+  // Read more of the file into the buffer, after moving any partial line
+  // left at the end to the front. Returns false once nothing more can be
+  // read.
+  bool fill();
+
   int fd_;
   char *data_;
   size_t max_;
   size_t cur_idx_;
   size_t len_;
   bool read_complete_;
+  // Set while discarding the rest of a line longer than the buffer.
+  bool skip_line_;
+};
+
+// Simple bump allocator. Nothing is freed individually, instead reset()
+// releases everything at once while keeping the chunks for reuse, so that
+// a steady state scan does not need to call malloc at all.
+class Arena {
+public:
+  Arena();
+  ~Arena();
+
+  // Allocate bytes of memory, aligned for any pointer sized type.
+  void *alloc(size_t bytes);
+
+  // Copy len bytes of str into the arena and nul terminate the copy.
+  const char *copyString(const char *str, size_t len);
+
+  // Make all of the memory in the arena available again.
+  void reset();
+
+private:
+  static const size_t kChunkSize = 16384;
+
+  std::vector<char *> chunks_;
+  std::vector<char *> big_chunks_;
+  size_t cur_chunk_;
+  size_t cur_idx_;
 };
 
+// Open addressing hash table, using linear probing, that maps a string
+// to an index. The table does not own the strings, they are expected to
+// live in an Arena for at least as long as the table refers to them.
+class NameTable {
+public:
+  NameTable();
+  ~NameTable();
+
+  static const size_t kNotFound = (size_t)-1;
+
+  // Hash function to use for all of the names passed to this table.
+  static uint32_t hash(const char *name, size_t len);
+
+  // Return the index associated with name, or kNotFound.
+  size_t find(const char *name, size_t len, uint32_t hash) const;
+
+  // Add name to the table. The name must not already be present.
+  void insert(const char *name, size_t len, uint32_t hash, size_t index);
+
+  // Remove all entries, but keep the allocated table.
+  void clear();
+
+private:
+  static const size_t kInitialCapacity = 256;
+
+  typedef struct {
+    const char *name;
+    size_t len;
+    uint32_t hash;
+    size_t index;
+  } entry_t;
+
+  void grow();
+
+  entry_t *entries_;
+  size_t capacity_;  // Always a power of two.
+  size_t size_;
+};
+
+// Streaming estimate of a single quantile using the P-square algorithm
+// (Jain and Chlamtac, 1985). Uses constant memory no matter how many
+// values are added.
+class P2Quantile {
+public:
+  // p is the quantile to estimate, between 0 and 1.
+  void init(double p);
+
+  void add(double value);
+
+  double value() const;
+
+private:
+  double parabolic(int i, double d) const;
+  double linear(int i, int d) const;
+
+  double p_;
+  size_t count_;
+  double heights_[5];
+  double positions_[5];
+  double desired_[5];
+  double increments_[5];
+};
+
+typedef struct {
+  uint32_t time_sec;  // Seconds since memtrack started.
+  uint32_t pss_kb;
+} pss_sample_t;
+
 typedef struct {
-  std::string name;
+  const char *name;
 
   size_t max_num_pids;
 
@@ -59,33 +168,59 @@ typedef struct {
   size_t last_pss_kb;
 
   std::vector<int> pids;
+
+  // Fixed size ring buffer holding the last history_len samples, allocated
+  // when the entry is created.
+  pss_sample_t *history;
+  size_t history_next;
+  size_t history_count;
+
+  P2Quantile p50_pss_kb;
+  P2Quantile p95_pss_kb;
+  P2Quantile p99_pss_kb;
+
+  // Accumulated pss for the sample currently being merged, only valid when
+  // sample_id matches the id of the current scan.
+  size_t sample_pss_kb;
+  unsigned int sample_id;
 } process_info_t;
-typedef std::map<std::string, process_info_t> processes_t;
 
 typedef struct {
+  const char *name;
+  size_t name_len;
+  uint32_t hash;
+
   size_t pss_kb;
 
   std::vector<int> pids;
 } cur_process_info_t;
-typedef std::map<std::string, cur_process_info_t> cur_processes_t;
 
-class ProcessInfo {
+typedef struct {
+  int pid;
+  size_t len;
+  char str[16];
+} pid_entry_t;
+
+// All of the state needed to gather information about a subset of the
+// processes for one scan. Each scan thread owns one of these, so the
+// threads never need to share anything but the index of the next pid.
+class ScanWorker {
 public:
-  ProcessInfo();
-  ~ProcessInfo();
+  ScanWorker();
+  ~ScanWorker();
 
-  // Get the information about a single process.
-  bool getInformation(int pid, char *pid_str, size_t pid_str_len);
+  // Forget everything found during the previous scan.
+  void reset();
 
-  // Scan all of the running processes.
-  void scan();
+  // Get the information about a single process.
+  bool getInformation(int pid, const char *pid_str, size_t pid_str_len);
 
-  // Dump the information about all of the processes in the system to the log.
-  void dumpToLog();
+  size_t numProcesses() const { return num_cur_; }
+  const cur_process_info_t &process(size_t i) const { return cur_[i]; }
 
 private:
-  static const size_t kBufferLen = 4096;
-  static const size_t kCmdNameLen = 1024;
+  // Large enough that most smaps files are read with a few reads.
+  static const size_t kBufferLen = 32768;
 
   static const char *kProc;
   static const size_t kProcLen = 6;
@@ -96,22 +231,110 @@ private:
   static const char *kSmaps;
   static const size_t kSmapsLen = 7;  // Includes \0 at end of string.
 
-  static const char *kStatus;
-  static const size_t kStatusLen = 8;  // Includes \0 at end of string.
+  char proc_file_[PATH_MAX];
+  char buffer_[kBufferLen];
+
+  // Reused for every cmdline read, only the buffer is kept across pids.
+  procfile_t cmdline_;
+
+  // The names are interned in the arena, which is reset every scan. The
+  // entries of cur_ are reused across scans so the pid vectors keep their
+  // storage.
+  Arena arena_;
+  NameTable names_;
+  std::vector<cur_process_info_t> cur_;
+  size_t num_cur_;
+};
+
+class ProcessInfo {
+public:
+  // Use num_threads threads to scan, zero means pick based on the number
+  // of cpus online. history_len samples are kept for each of up to
+  // max_names different command names; names seen after that are counted
+  // but not tracked, which keeps memory use constant however long we run.
+  ProcessInfo(size_t num_threads, size_t history_len, size_t max_names,
+              double growth_threshold_kb_per_min);
+  ~ProcessInfo();
+
+  // Create the file the results are exported to after every scan.
+  bool openExport(const char *filename);
+
+  // Scan all of the running processes.
+  void scan();
+
+  // Dump the information about all of the processes in the system to the log.
+  void dumpToLog();
+
+  size_t numThreads() const { return workers_.size(); }
+
+private:
+  static const char *kProc;
 
   static const size_t kInitialEntries = 1000;
 
-  char proc_file_[PATH_MAX];
-  char buffer_[kBufferLen];
+  typedef struct {
+    ProcessInfo *info;
+    ScanWorker *worker;
+  } thread_arg_t;
+
+  static void *workerThread(void *data);
 
-  char cmd_name_[kCmdNameLen];
+  // Process pids until there are none left for this scan.
+  void runWorker(ScanWorker *worker);
 
-  // Minimize a need for a lot of allocations by keeping our maps and
-  // lists in this object.
-  processes_t all_;
-  cur_processes_t cur_;
+  // Fold the results of one worker into the current sample.
+  void mergeWorker(const ScanWorker &worker);
+
+  // Record the sample just merged into info.
+  void addSample(process_info_t *info, uint32_t time_sec);
+
+  // Least squares slope of the pss in the history of info, in KB/min.
+  double growthRate(const process_info_t *info) const;
+
+  // Whether growth, the growth rate of info, marks it as growing.
+  bool isGrowing(const process_info_t *info, double growth) const;
+
+  // Write the current state to the export file.
+  void exportToFile();
+
+  // workers_[0] is run on the calling thread, the rest each get a thread.
+  std::vector<ScanWorker *> workers_;
+  std::vector<pthread_t> threads_;
+  std::vector<thread_arg_t> thread_args_;
+
+  // The pids found in /proc for the current scan, handed out to the workers
+  // by atomically incrementing next_pid_.
+  std::vector<pid_entry_t> pids_;
+  volatile size_t next_pid_;
+
+  pthread_mutex_t lock_;
+  pthread_cond_t start_cond_;
+  pthread_cond_t done_cond_;
+  unsigned int scan_id_;
+  size_t workers_done_;
+  bool exiting_;
+
+  // Minimize a need for a lot of allocations by keeping our tables and
+  // lists in this object. Names in all_ are interned in names_arena_ and
+  // live for the lifetime of this object.
+  Arena names_arena_;
+  NameTable all_names_;
+  std::vector<process_info_t> all_;
+  std::vector<size_t> touched_;
   std::vector<const process_info_t *> list_;
 
+  size_t history_len_;
+  size_t max_names_;
+  size_t untracked_pids_;  // Pids skipped in the last scan, see max_names.
+  double growth_threshold_;
+  unsigned long long start_ns_;
+  unsigned long long last_scan_ns_;
+  unsigned long long num_scans_;
+
+  // Shared mapping of the export file, NULL if not exporting.
+  void *export_map_;
+  size_t export_len_;
+
   // Compute a running average.
   static inline void computeAvg(double *running_avg, size_t cur_avg,
                                 size_t num_samples) {
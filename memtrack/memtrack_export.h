@@ -0,0 +1,82 @@
+/*
+ * Copyright 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __MEMTRACK_EXPORT_H__
+#define __MEMTRACK_EXPORT_H__
+
+#include <stdint.h>
+
+/*
+ * Layout of the file written by memtrack --export. The file has a fixed
+ * size: one header followed by max_records records, and is updated in
+ * place after every scan through a shared mapping, so a collector can
+ * simply mmap it and read it at any time.
+ *
+ * To get a consistent snapshot, a reader copies what it needs between two
+ * reads of sequence, and retries if the value was odd or has changed:
+ *
+ *   do {
+ *     seq = header->sequence;
+ *     <memory barrier>
+ *     <copy records>
+ *     <memory barrier>
+ *   } while ((seq & 1) || seq != header->sequence);
+ *
+ * All fields are in host byte order.
+ */
+
+#define MEMTRACK_EXPORT_MAGIC 0x4b52544d  /* "MTRK" */
+#define MEMTRACK_EXPORT_VERSION 1
+
+#define MEMTRACK_EXPORT_NAME_LEN 64
+
+/* The process is growing faster than the growth threshold. */
+#define MEMTRACK_EXPORT_FLAG_GROWING 0x1
+/* The process was present in the last scan. */
+#define MEMTRACK_EXPORT_FLAG_RUNNING 0x2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t max_records;
+    uint32_t num_records;
+    volatile uint32_t sequence;
+    uint32_t reserved;
+    uint64_t num_scans;
+    uint64_t timestamp_ns;  /* CLOCK_MONOTONIC time of the last scan. */
+} memtrack_export_header_t;
+
+typedef struct {
+    /* Truncated, always nul terminated. */
+    char name[MEMTRACK_EXPORT_NAME_LEN];
+    uint32_t flags;
+    uint32_t num_pids;
+    uint32_t max_num_pids;
+    uint32_t num_samples;
+    uint32_t last_pss_kb;
+    uint32_t min_pss_kb;
+    uint32_t max_pss_kb;
+    uint32_t avg_pss_kb;
+    uint32_t p50_pss_kb;
+    uint32_t p95_pss_kb;
+    uint32_t p99_pss_kb;
+    /* Least squares slope of the pss over the history window. */
+    int32_t growth_kb_per_min;
+} memtrack_export_record_t;
+
+#endif  /* __MEMTRACK_EXPORT_H__ */
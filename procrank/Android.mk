@@ -17,12 +17,15 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := procrank.c
 
-LOCAL_C_INCLUDES := $(call include-path-for, libpagemap)
+LOCAL_C_INCLUDES := $(call include-path-for, libpagemap) \
+                    $(LOCAL_PATH)/../libprocfile/include
 
 LOCAL_CFLAGS := -Wall -Wextra -Wformat=2 -Werror
 
 LOCAL_SHARED_LIBRARIES := libpagemap
 
+LOCAL_STATIC_LIBRARIES := libprocfile
+
 LOCAL_MODULE := procrank
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 
 #include <pagemap/pagemap.h>
+#include <procfile/procfile.h>
 
 struct proc_info {
     pid_t pid;
@@ -48,24 +49,20 @@ int (*compfn)(const void *a, const void *b);
 static int order;
 
 void print_mem_info() {
-    char buffer[1024];
+    procfile_t meminfo;
     int numFound = 0;
 
-    int fd = open("/proc/meminfo", O_RDONLY);
-
-    if (fd < 0) {
+    procfile_init(&meminfo);
+    if (procfile_open(&meminfo, "/proc/meminfo")) {
         printf("Unable to open /proc/meminfo: %s\n", strerror(errno));
         return;
     }
 
-    const int len = read(fd, buffer, sizeof(buffer)-1);
-    close(fd);
-
-    if (len < 0) {
+    if (procfile_read(&meminfo) <= 0) {
         printf("Empty /proc/meminfo");
+        procfile_destroy(&meminfo);
         return;
     }
-    buffer[len] = 0;
 
     static const char* const tags[] = {
             "MemTotal:",
@@ -76,44 +73,30 @@ void print_mem_info() {
             "Slab:",
             NULL
     };
-    static const int tagsLen[] = {
-            9,
-            8,
-            8,
-            7,
-            6,
-            5,
-            0
-    };
-    long mem[] = { 0, 0, 0, 0, 0, 0 };
+    uint64_t mem[] = { 0, 0, 0, 0, 0, 0 };
 
-    char* p = buffer;
-    while (*p && numFound < 6) {
+    const char* p = meminfo.buf;
+    while (p && numFound < 6) {
+        const char* tag;
+        size_t tagLen;
+        const char* num = procfile_next_token(p, &tag, &tagLen);
         int i = 0;
-        while (tags[i]) {
-            if (strncmp(p, tags[i], tagsLen[i]) == 0) {
-                p += tagsLen[i];
-                while (*p == ' ') p++;
-                char* num = p;
-                while (*p >= '0' && *p <= '9') p++;
-                if (*p != 0) {
-                    *p = 0;
-                    p++;
+        while (num && tags[i]) {
+            if (strncmp(tag, tags[i], tagLen) == 0 && tags[i][tagLen] == 0) {
+                if (procfile_parse_u64(num, &mem[i])) {
+                    numFound++;
                 }
-                mem[i] = atoll(num);
-                numFound++;
                 break;
             }
             i++;
         }
-        while (*p && *p != '\n') {
-            p++;
-        }
-        if (*p) p++;
+        p = procfile_next_line(p);
     }
+    procfile_destroy(&meminfo);
 
-    printf("RAM: %ldK total, %ldK free, %ldK buffers, %ldK cached, %ldK shmem, %ldK slab\n",
-            mem[0], mem[1], mem[2], mem[3], mem[4], mem[5]);
+    printf("RAM: %lluK total, %lluK free, %lluK buffers, %lluK cached, %lluK shmem, %lluK slab\n",
+            (unsigned long long)mem[0], (unsigned long long)mem[1], (unsigned long long)mem[2],
+            (unsigned long long)mem[3], (unsigned long long)mem[4], (unsigned long long)mem[5]);
 }
 
 int main(int argc, char *argv[]) {
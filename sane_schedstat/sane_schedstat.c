@@ -15,20 +15,25 @@
 */
 
 
-/* Opens /proc/sched_stat and diff's the counters.
-   Currently support version 15, modify parse() to support other
-   versions
+/* Opens /proc/schedstat and diff's the counters every interval.
+   Supports version 15 and later, whose cpu lines all start with the same
+   nine fields; modify parse() to support other versions.
 */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <string.h>
 
-#define MAX_CPU 2
+#include <procfile/procfile.h>
+
+/* Buckets of the run queue latency histogram, powers of two in us. */
+#define HIST_BUCKETS 24
 
 struct cpu_stat {
     /* sched_yield() stats */
@@ -46,52 +51,160 @@ struct cpu_stat {
     unsigned int ttwu_local;
 
     /* latency stats */
-    unsigned long long cpu_time;  /* time spent running by tasks (ms) */
-    unsigned long long run_delay; /* time spent waiting to run by tasks (ms) */
+    unsigned long long cpu_time;  /* time spent running by tasks (ns) */
+    unsigned long long run_delay; /* time spent waiting to run by tasks (ns) */
     unsigned long pcount;  /* number of tasks (not necessarily unique) given */
 };
 
-struct cpu_stat cpu_prev[MAX_CPU];
-struct cpu_stat cpu_delta[MAX_CPU];
-struct cpu_stat tmp;
+/* Indexed by cpu number, grown as cpus show up. A cpu that isn't in the
+   current sample, because it's offline, isn't printed. */
+static struct cpu_stat *cpu_prev;
+static struct cpu_stat *cpu_delta;
+static unsigned int *cpu_seen;  /* last sample the cpu was in */
+static int cpu_slots;
+static unsigned int samples;
 
-static const char *next_line(const char *b) {
-    while (1) {
-        switch (*b) {
-        case '\n':
-            return b + 1;
-        case '\0':
-            return NULL;
-        }
-        b++;
+/* How many cpu intervals had an average wait per timeslice in each bucket. */
+static unsigned long histogram[HIST_BUCKETS];
+
+static volatile sig_atomic_t done;
+
+static int grow_cpus(int cpu) {
+    int slots = cpu_slots ? cpu_slots : 8;
+
+    while (slots <= cpu)
+        slots *= 2;
+
+    cpu_prev = realloc(cpu_prev, slots * sizeof(*cpu_prev));
+    cpu_delta = realloc(cpu_delta, slots * sizeof(*cpu_delta));
+    cpu_seen = realloc(cpu_seen, slots * sizeof(*cpu_seen));
+    if (!cpu_prev || !cpu_delta || !cpu_seen) {
+        printf("Could not allocate stats for cpu %d\n", cpu);
+        return -1;
+    }
+    memset(cpu_prev + cpu_slots, 0, (slots - cpu_slots) * sizeof(*cpu_prev));
+    memset(cpu_delta + cpu_slots, 0, (slots - cpu_slots) * sizeof(*cpu_delta));
+    memset(cpu_seen + cpu_slots, 0, (slots - cpu_slots) * sizeof(*cpu_seen));
+    cpu_slots = slots;
+
+    return 0;
+}
+
+/* Average wait to run per timeslice of the interval, in us. */
+static unsigned long long avg_wait_us(const struct cpu_stat *d) {
+    return d->pcount ? d->run_delay / d->pcount / 1000 : 0;
+}
+
+static void add_to_histogram(const struct cpu_stat *d) {
+    unsigned long long us = avg_wait_us(d);
+    int bucket = 0;
+
+    if (!d->pcount)
+        return;
+    while (us > 1 && bucket < HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
     }
+    histogram[bucket]++;
 }
+
 static int print() {
+    struct cpu_stat total;
     int i;
 
-    printf("CPU  yield() schedule() switch idle   ttwu() local  cpu_time wait_time timeslices\n");
-    for (i=0; i<MAX_CPU; i++) {
-        printf(" %2d  %7u %10u %6u %4u %8u %5u %9llu %9llu %10lu\n",
+    memset(&total, 0, sizeof(total));
+    printf("CPU  yield() schedule() switch idle   ttwu() local  cpu_time wait_time timeslices avg_wait(us)\n");
+    for (i=0; i<cpu_slots; i++) {
+        if (cpu_seen[i] != samples)
+            continue;
+        printf(" %2d  %7u %10u %6u %4u %8u %5u %9llu %9llu %10lu %12llu\n",
             i,
             cpu_delta[i].yld_count,
             cpu_delta[i].sched_count, cpu_delta[i].sched_switch, cpu_delta[i].sched_goidle,
             cpu_delta[i].ttwu_count, cpu_delta[i].ttwu_local,
-            cpu_delta[i].cpu_time / 1000000, cpu_delta[i].run_delay / 1000000, cpu_delta[i].pcount);
+            cpu_delta[i].cpu_time / 1000000, cpu_delta[i].run_delay / 1000000, cpu_delta[i].pcount,
+            avg_wait_us(&cpu_delta[i]));
+        add_to_histogram(&cpu_delta[i]);
+
+        total.yld_count += cpu_delta[i].yld_count;
+        total.sched_count += cpu_delta[i].sched_count;
+        total.sched_switch += cpu_delta[i].sched_switch;
+        total.sched_goidle += cpu_delta[i].sched_goidle;
+        total.ttwu_count += cpu_delta[i].ttwu_count;
+        total.ttwu_local += cpu_delta[i].ttwu_local;
+        total.cpu_time += cpu_delta[i].cpu_time;
+        total.run_delay += cpu_delta[i].run_delay;
+        total.pcount += cpu_delta[i].pcount;
     }
+    printf("all  %7u %10u %6u %4u %8u %5u %9llu %9llu %10lu %12llu\n\n",
+        total.yld_count,
+        total.sched_count, total.sched_switch, total.sched_goidle,
+        total.ttwu_count, total.ttwu_local,
+        total.cpu_time / 1000000, total.run_delay / 1000000, total.pcount,
+        avg_wait_us(&total));
+    fflush(stdout);
     return 0;
 }
 
+static void print_histogram() {
+    unsigned long total = 0, max = 0;
+    int i, first = -1, last = -1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += histogram[i];
+        if (histogram[i] > max)
+            max = histogram[i];
+        if (histogram[i]) {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+    }
+    if (!total)
+        return;
+
+    printf("Average wait per timeslice, per cpu and interval:\n");
+    printf("%16s %8s\n", "avg_wait(us)", "count");
+    for (i = first; i <= last; i++) {
+        int bar = (int)(40 * histogram[i] / max);
+        if (i == HIST_BUCKETS - 1)
+            printf("%7u -        %8lu ", 1u << i, histogram[i]);
+        else
+            printf("%7u - %6u %8lu ", i ? 1u << i : 0, (2u << i) - 1, histogram[i]);
+        while (bar--)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
 static int parse_cpu_v15(const char *b) {
-    int cpu;
-
-    if (sscanf(b, "cpu%d %u %u %u %u %u %u %llu %llu %lu\n",
-            &cpu, &tmp.yld_count,
-            &tmp.sched_switch, &tmp.sched_count, &tmp.sched_goidle,
-            &tmp.ttwu_count, &tmp.ttwu_local,
-            &tmp.cpu_time, &tmp.run_delay, &tmp.pcount) != 10) {
-        printf("Could not parse %s\n", b);
+    uint64_t cpu, v[9];
+    const char *p;
+    struct cpu_stat tmp;
+
+    p = (strncmp(b, "cpu", 3) == 0) ? procfile_parse_u64(b + 3, &cpu) : NULL;
+    if (!p || !procfile_parse_u64s(p, v, 9)) {
+        p = strchr(b, '\n');
+        printf("Could not parse %.*s\n", p ? (int)(p - b) : (int)strlen(b), b);
         return -1;
     }
+    if (cpu >= (uint64_t)cpu_slots && grow_cpus(cpu))
+        return -1;
+
+    tmp.yld_count = v[0];
+    tmp.sched_switch = v[1];
+    tmp.sched_count = v[2];
+    tmp.sched_goidle = v[3];
+    tmp.ttwu_count = v[4];
+    tmp.ttwu_local = v[5];
+    tmp.cpu_time = v[6];
+    tmp.run_delay = v[7];
+    tmp.pcount = v[8];
+
+    /* A cpu missing from the last sample starts over from this one. */
+    if (cpu_seen[cpu] != samples - 1)
+        cpu_prev[cpu] = tmp;
+    cpu_seen[cpu] = samples;
 
     cpu_delta[cpu].yld_count = tmp.yld_count - cpu_prev[cpu].yld_count;
     cpu_delta[cpu].sched_switch = tmp.sched_switch - cpu_prev[cpu].sched_switch;
@@ -109,49 +222,96 @@ static int parse_cpu_v15(const char *b) {
 
 
 static int parse(const char *b) {
-    unsigned int version;
-    unsigned long long ts;
+    uint64_t version;
+    uint64_t ts;
+    const char *p;
 
-    if (sscanf(b, "version %u\n", &version) != 1) {
+    p = procfile_match(b, "version");
+    if (!p || !procfile_parse_u64(p, &version)) {
         printf("Could not parse version\n");
         return -1;
     }
-    switch (version) {
-    case 15:
-        b = next_line(b);
-        if (!b || sscanf(b, "timestamp %llu\n", &ts) != 1) {
-            printf("Could not parse timestamp\n");
-            return -1;
-        }
-        while (1) {
-            b = next_line(b);
-            if (!b) break;
-            if (b[0] == 'c') {
-                if (parse_cpu_v15(b)) return -1;
-            }
-        }
-        break;
-    default:
-        printf("Can not handle version %u\n", version);
+    if (version < 15) {
+        printf("Can not handle version %u\n", (unsigned int)version);
         return -1;
     }
+
+    /* Versions 16 and 17 only changed the domain lines, which are
+       skipped. */
+    b = procfile_next_line(b);
+    p = b ? procfile_match(b, "timestamp") : NULL;
+    if (!p || !procfile_parse_u64(p, &ts)) {
+        printf("Could not parse timestamp\n");
+        return -1;
+    }
+    samples++;
+    while (1) {
+        b = procfile_next_line(b);
+        if (!b) break;
+        if (b[0] == 'c') {
+            if (parse_cpu_v15(b)) return -1;
+        }
+    }
     return 0;
 }
 
+static void signal_handler(int sig) {
+    done = 1;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr, "Usage: %s [ -d delay ] [ -n iterations ] [ -h ]\n"
+                    "    -d delay       Seconds between updates (default 1).\n"
+                    "    -n iterations  Number of updates to show (default 0 = infinite).\n"
+                    "    -h             Display this help screen.\n"
+                    "Shows a histogram of the average wait per timeslice when done.\n",
+        cmd);
+}
+
 int main(int argc, char **argv) {
-    int i;
-    int fd;
-    char buf[4096];
+    procfile_t schedstat;
+    int delay = 1, iterations = 0, count = 0;
+    int i, ret = 0;
 
-    while (1) {
-        fd = open("/proc/schedstat", O_RDONLY);
-        if (fd < 0) return -1;
-        i = read(fd, buf, sizeof(buf) - 1);
-        close(fd);
-        buf[i] = '\0';
-        if (parse(buf)) return -1;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            delay = atoi(argv[++i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+            continue;
+        }
+        usage(argv[0]);
+        exit(strcmp(argv[i], "-h") ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (delay <= 0)
+        delay = 1;
+
+    procfile_init(&schedstat);
+    if (procfile_open(&schedstat, "/proc/schedstat")) {
+        printf("Could not open /proc/schedstat: %s\n", strerror(errno));
+        return -1;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    /* The first sample is only the starting point of the deltas. */
+    if (procfile_read(&schedstat) < 0 || parse(schedstat.buf)) return -1;
+
+    while (!done && (iterations == 0 || count++ < iterations)) {
+        sleep(delay);
+        if (done)
+            break;
+        if (procfile_read(&schedstat) < 0 || parse(schedstat.buf)) {
+            ret = -1;
+            break;
+        }
         print();
-        sleep(1);
     }
-    return 0;
+
+    print_histogram();
+    procfile_destroy(&schedstat);
+    return ret;
 }
@@ -4,7 +4,9 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= showslab.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libprocfile/include
 LOCAL_SHARED_LIBRARIES :=
+LOCAL_STATIC_LIBRARIES := libprocfile
 LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
 
 LOCAL_MODULE_TAGS := debug
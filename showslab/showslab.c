@@ -5,15 +5,19 @@
 #include <errno.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
+
+#include <procfile/procfile.h>
 
 #define STRINGIFY_ARG(a)        #a
 #define STRINGIFY(a)            STRINGIFY_ARG(a)
 
 #define DEF_SORT_FUNC		sort_nr_objs
-#define SLABINFO_LINE_LEN	512	/* size of longest line */
 #define SLABINFO_NAME_LEN	32	/* cache name size (will truncate) */
 #define SLABINFO_FILE		"/proc/slabinfo"
 #define DEF_NR_ROWS		15	/* default nr of caches to show */
+#define DEF_WINDOW		10	/* default nr of samples to rank over */
+#define MIN_LEAK_SAMPLES	3	/* samples needed to suspect a leak */
 
 /* object representing a slab cache (each line of slabinfo) */
 struct slab_info {
@@ -46,6 +50,80 @@ struct slab_stat {
 typedef int (*sort_t)(const struct slab_info *, const struct slab_info *);
 static sort_t sort_func;
 
+/*
+ * check_slabinfo_version - check the first line of a slabinfo file, which
+ * must be "slabinfo - version: 2.0" or "2.1".  Returns 0 if so, -1 if not.
+ */
+static int check_slabinfo_version(const char *line)
+{
+	const char *cur;
+	uint64_t major, minor;
+
+	cur = procfile_match(line, "slabinfo");
+	cur = cur ? procfile_match(cur, "-") : NULL;
+	cur = cur ? procfile_match(cur, "version:") : NULL;
+	cur = cur ? procfile_parse_u64(cur, &major) : NULL;
+	cur = (cur && *cur == '.') ? procfile_parse_u64(cur + 1, &minor) : NULL;
+	if (!cur) {
+		fprintf(stderr, "unable to parse slabinfo version!\n");
+		return -1;
+	}
+
+	if (major != 2 || minor > 1) {
+		fprintf(stderr, "we only support slabinfo 2.0 and 2.1!\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * parse_slab_line - parse one cache line of slabinfo 2.x into p, all but
+ * the next pointer.  Sets *active_slabs for the totals.  Returns 0 on
+ * success, -1 on unrecognizable data.
+ */
+static int parse_slab_line(const char *line, struct slab_info *p,
+			   unsigned long *active_slabs)
+{
+	const char *cur, *name;
+	size_t name_len;
+	uint64_t values[5], tunables[3], slabdata[3];
+
+	/*
+	 * <name> <active_objs> <num_objs> <objsize> <objperslab>
+	 * <pagesperslab> : tunables <limit> <batchcount> <sharedfactor>
+	 * : slabdata <active_slabs> <num_slabs> <sharedavail>
+	 */
+	cur = procfile_next_token(line, &name, &name_len);
+	cur = cur ? procfile_parse_u64s(cur, values, 5) : NULL;
+	cur = cur ? procfile_match(cur, ":") : NULL;
+	cur = cur ? procfile_match(cur, "tunables") : NULL;
+	cur = cur ? procfile_parse_u64s(cur, tunables, 3) : NULL;
+	cur = cur ? procfile_match(cur, ":") : NULL;
+	cur = cur ? procfile_match(cur, "slabdata") : NULL;
+	cur = cur ? procfile_parse_u64s(cur, slabdata, 3) : NULL;
+
+	if (!cur) {
+		fprintf(stderr, "unrecognizable data in slabinfo!\n");
+		return -1;
+	}
+
+	if (name_len >= SLABINFO_NAME_LEN)
+		name_len = SLABINFO_NAME_LEN - 1;
+	memcpy(p->name, name, name_len);
+	p->name[name_len] = '\0';
+	p->nr_active_objs = values[0];
+	p->nr_objs = values[1];
+	p->obj_size = values[2];
+	p->objs_per_slab = values[3];
+	p->nr_slabs = slabdata[1];
+	p->nr_pages = p->nr_slabs * values[4];
+	p->use = p->nr_objs ? 100 * p->nr_active_objs / p->nr_objs : 0;
+	*active_slabs = slabdata[0];
+
+	return 0;
+}
+
 /*
  * get_slabinfo - open, read, and parse a slabinfo 2.x file, which has the
  * following format:
@@ -60,37 +138,31 @@ static sort_t sort_func;
 static struct slab_info * get_slabinfo(struct slab_stat *stats)
 {
 	struct slab_info *head = NULL, *p = NULL, *prev = NULL;
-	FILE *slabfile;
-	char line[SLABINFO_LINE_LEN];
-	unsigned int major, minor;
+	procfile_t slabfile;
+	const char *line;
+	unsigned long active_slabs;
 
-	slabfile = fopen(SLABINFO_FILE, "r");
-	if (!slabfile) {
-		perror("fopen");
+	procfile_init(&slabfile);
+	if (procfile_open(&slabfile, SLABINFO_FILE)) {
+		perror("open");
 		return NULL;
 	}
 
-	if (!fgets(line, SLABINFO_LINE_LEN, slabfile)) {
+	if (procfile_read(&slabfile) <= 0) {
 		fprintf(stderr, "cannot read from " SLABINFO_FILE "\n");
+		procfile_destroy(&slabfile);
 		return NULL;
 	}
 
-	if (sscanf(line, "slabinfo - version: %u.%u", &major, &minor) != 2) {
-		fprintf(stderr, "unable to parse slabinfo version!\n");
-		return NULL;
-	}
-
-	if (major != 2 || minor > 1) {
-		fprintf(stderr, "we only support slabinfo 2.0 and 2.1!\n");
+	line = slabfile.buf;
+	if (check_slabinfo_version(line)) {
+		procfile_destroy(&slabfile);
 		return NULL;
 	}
 
 	stats->min_obj_size = INT_MAX;
 
-	while (fgets(line, SLABINFO_LINE_LEN, slabfile)) {
-		unsigned long nr_active_slabs, pages_per_slab;
-		int ret;
-
+	while ((line = procfile_next_line(line))) {
 		if (line[0] == '#')
 			continue;
 
@@ -103,17 +175,7 @@ static struct slab_info * get_slabinfo(struct slab_stat *stats)
 		if (stats->nr_caches++ == 0)
 			head = prev = p;
 
-		ret = sscanf(line, "%" STRINGIFY(SLABINFO_NAME_LEN) "s"
-			     " %lu %lu %lu %lu %lu : tunables %*d %*d %*d : \
-			     slabdata %lu %lu %*d", p->name, 
-			     &p->nr_active_objs, &p->nr_objs, 
-			     &p->obj_size, &p->objs_per_slab,
-			     &pages_per_slab,
-			     &nr_active_slabs,
-			     &p->nr_slabs);
-
-		if (ret != 8) {
-			fprintf(stderr, "unrecognizable data in slabinfo!\n");
+		if (parse_slab_line(line, p, &active_slabs)) {
 			head = NULL;
 			break;
 		}
@@ -123,27 +185,21 @@ static struct slab_info * get_slabinfo(struct slab_stat *stats)
 		if (p->obj_size > stats->max_obj_size)
 			stats->max_obj_size = p->obj_size;
 
-		p->nr_pages = p->nr_slabs * pages_per_slab;
-
-		if (p->nr_objs) {
-			p->use = 100 * p->nr_active_objs / p->nr_objs;
+		if (p->nr_objs)
 			stats->nr_active_caches++;
-		} else
-			p->use = 0;
 
 		stats->nr_objs += p->nr_objs;
 		stats->nr_active_objs += p->nr_active_objs;
 		stats->total_size += p->nr_objs * p->obj_size;
 		stats->active_size += p->nr_active_objs * p->obj_size;
 		stats->nr_slabs += p->nr_slabs;
-		stats->nr_active_slabs += nr_active_slabs;
+		stats->nr_active_slabs += active_slabs;
 
 		prev->next = p;
 		prev = p;
 	}
 
-	if (fclose(slabfile))
-		perror("fclose");
+	procfile_destroy(&slabfile);
 
 	if (p)
 		p->next = NULL;
@@ -267,44 +323,343 @@ static void * set_sort_func(char key)
 	}
 }
 
+/*
+ * Continuous mode.  Caches are tracked in an array allocated from the
+ * first read, found by name through a hash table of indices, each with a
+ * ring of its size over the last window samples.  Nothing is allocated
+ * after startup, so the cost of a sample is the same however busy the
+ * allocators being watched are.
+ */
+
+/* one tracked slab cache */
+struct slab_track {
+	char name[SLABINFO_NAME_LEN];
+	int next;			/* next index in hash chain, or -1 */
+	unsigned int seen;		/* last sample it was in slabinfo */
+	unsigned long *sizes;		/* cache size in bytes, per sample */
+	double rate;			/* growth over the window, bytes/s */
+	int leak;			/* grown at every sample of the window */
+};
+
+static struct slab_track *tracks;
+static unsigned int nr_tracks, max_tracks;
+static int *hash_heads;
+static unsigned int hash_mask;
+static unsigned int window;
+static double *times;			/* time of each sample, in seconds */
+static unsigned int nr_samples;		/* samples taken so far */
+
+static unsigned int hash_name(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+
+	return h;
+}
+
+/*
+ * find_track - find the cache of the given name, adding it if it is new.
+ * Returns NULL if it is new and there is no room left for it.
+ */
+static struct slab_track *find_track(const char *name)
+{
+	struct slab_track *t;
+	unsigned int h = hash_name(name) & hash_mask;
+	int i;
+
+	for (i = hash_heads[h]; i >= 0; i = tracks[i].next)
+		if (!strcmp(tracks[i].name, name))
+			return &tracks[i];
+
+	if (nr_tracks == max_tracks)
+		return NULL;
+
+	t = &tracks[nr_tracks];
+	strcpy(t->name, name);
+	t->next = hash_heads[h];
+	hash_heads[h] = nr_tracks++;
+
+	return t;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * take_sample - reread slabinfo and store the size of every cache in the
+ * current window slot.  Returns 0 on success, -1 on error.
+ */
+static int take_sample(procfile_t *slabfile, unsigned long page_bytes)
+{
+	struct slab_info info;
+	struct slab_track *t;
+	const char *line;
+	unsigned long active_slabs, size;
+	unsigned int slot = nr_samples % window, i;
+	static int warned;
+
+	if (procfile_read(slabfile) <= 0) {
+		fprintf(stderr, "cannot read from " SLABINFO_FILE "\n");
+		return -1;
+	}
+
+	line = slabfile->buf;
+	if (check_slabinfo_version(line))
+		return -1;
+
+	nr_samples++;
+	times[slot] = now_sec();
+	for (i = 0; i < nr_tracks; i++)
+		tracks[i].sizes[slot] = 0;
+
+	while ((line = procfile_next_line(line))) {
+		if (line[0] == '#')
+			continue;
+		if (parse_slab_line(line, &info, &active_slabs))
+			return -1;
+
+		t = find_track(info.name);
+		if (!t) {
+			if (!warned++)
+				fprintf(stderr, "too many new caches, not "
+					"tracking %s and later ones\n",
+					info.name);
+			continue;
+		}
+
+		/* names truncated to the same one add up */
+		size = info.nr_pages * page_bytes;
+		if (t->seen == nr_samples)
+			t->sizes[slot] += size;
+		else
+			t->sizes[slot] = size;
+		t->seen = nr_samples;
+	}
+
+	return 0;
+}
+
+/*
+ * update_rates - compute each cache's growth rate over the window, and
+ * whether it grew at every step of it.
+ */
+static void update_rates(void)
+{
+	unsigned int n = nr_samples < window ? nr_samples : window;
+	unsigned int first = (nr_samples - n) % window;
+	unsigned int last = (nr_samples - 1) % window;
+	unsigned int i, j, cur, prev;
+	double elapsed = times[last] - times[first];
+	struct slab_track *t;
+
+	for (i = 0; i < nr_tracks; i++) {
+		t = &tracks[i];
+		t->rate = 0;
+		t->leak = 0;
+		if (n < 2 || elapsed <= 0)
+			continue;
+
+		t->rate = ((double)t->sizes[last] - t->sizes[first]) / elapsed;
+
+		/*
+		 * Caches grow a slab at a time, so a leak shows as a size
+		 * that never goes down and grows at least once every few
+		 * samples; ask for it to have grown at every step to be sure.
+		 */
+		t->leak = n >= MIN_LEAK_SAMPLES;
+		for (j = 1, prev = first; j < n && t->leak; j++, prev = cur) {
+			cur = (first + j) % window;
+			t->leak = t->sizes[cur] > t->sizes[prev];
+		}
+	}
+}
+
+static int cmp_rate(const void *a, const void *b)
+{
+	const struct slab_track *ta = &tracks[*(const int *)a];
+	const struct slab_track *tb = &tracks[*(const int *)b];
+
+	if (ta->rate != tb->rate)
+		return ta->rate < tb->rate ? 1 : -1;
+
+	return strcmp(ta->name, tb->name);
+}
+
+/*
+ * watch_slabinfo - sample slabinfo every interval seconds and show the
+ * nr_rows caches growing fastest over the last window samples.
+ */
+static int watch_slabinfo(unsigned int interval, unsigned int nr_rows)
+{
+	procfile_t slabfile;
+	const char *line;
+	unsigned long page_bytes = getpagesize();
+	unsigned long *sizes;
+	unsigned int nr_caches = 0, n, i;
+	int *order;
+	struct slab_track *t;
+
+	procfile_init(&slabfile);
+	if (procfile_open(&slabfile, SLABINFO_FILE)) {
+		perror("open");
+		return -1;
+	}
+	if (procfile_read(&slabfile) <= 0) {
+		fprintf(stderr, "cannot read from " SLABINFO_FILE "\n");
+		procfile_destroy(&slabfile);
+		return -1;
+	}
+	for (line = slabfile.buf; (line = procfile_next_line(line)); )
+		if (line[0] != '#')
+			nr_caches++;
+
+	/* leave room for caches created while watching */
+	max_tracks = 2 * nr_caches + 64;
+	for (hash_mask = 1; hash_mask < 2 * max_tracks; hash_mask <<= 1)
+		;
+	hash_mask--;
+
+	tracks = calloc(max_tracks, sizeof(*tracks));
+	sizes = calloc((size_t)max_tracks * window, sizeof(*sizes));
+	hash_heads = malloc((hash_mask + 1) * sizeof(*hash_heads));
+	order = malloc(max_tracks * sizeof(*order));
+	times = calloc(window, sizeof(*times));
+	if (!tracks || !sizes || !hash_heads || !order || !times) {
+		perror("malloc");
+		procfile_destroy(&slabfile);
+		return -1;
+	}
+	for (i = 0; i < max_tracks; i++)
+		tracks[i].sizes = sizes + (size_t)i * window;
+	memset(hash_heads, -1, (hash_mask + 1) * sizeof(*hash_heads));
+
+	while (1) {
+		if (take_sample(&slabfile, page_bytes))
+			break;
+		update_rates();
+
+		n = nr_samples < window ? nr_samples : window;
+		for (i = 0; i < nr_tracks; i++)
+			order[i] = i;
+		qsort(order, nr_tracks, sizeof(*order), cmp_rate);
+
+		printf("Growth over the last %u samples (%.1fs)\n", n,
+		       times[(nr_samples - 1) % window] -
+		       times[(nr_samples - n) % window]);
+		printf("%10s %10s %10s %-5s %-23s\n",
+		       "CACHE SIZE", "GROWTH", "RATE", "", "NAME");
+		for (i = 0; i < nr_rows && i < nr_tracks; i++) {
+			t = &tracks[order[i]];
+			printf("%9luK %+9ldK %7.1fK/s %-5s %-23s\n",
+			       t->sizes[(nr_samples - 1) % window] / 1024,
+			       ((long)t->sizes[(nr_samples - 1) % window] -
+				(long)t->sizes[(nr_samples - n) % window]) / 1024,
+			       t->rate / 1024, t->leak ? "LEAK?" : "",
+			       t->name);
+		}
+		printf("\n");
+		fflush(stdout);
+
+		sleep(interval);
+	}
+
+	free(times);
+	free(order);
+	free(hash_heads);
+	free(sizes);
+	free(tracks);
+	procfile_destroy(&slabfile);
+
+	return -1;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "usage: %s [options]\n\n", cmd);
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -n N   show N caches (default " STRINGIFY(DEF_NR_ROWS) ")\n");
+	fprintf(stderr, "  -s S   specify sort criteria S\n");
+	fprintf(stderr, "  -d I   every I seconds, show the caches growing fastest\n");
+	fprintf(stderr, "  -w W   with -d, measure growth over W samples "
+		"(default " STRINGIFY(DEF_WINDOW) ")\n");
+	fprintf(stderr, "  -h     display this help\n\n");
+	fprintf(stderr, "Valid sort criteria:\n");
+	fprintf(stderr, "  a: number of Active objects\n");
+	fprintf(stderr, "  c: Cache size\n");
+	fprintf(stderr, "  l: number of sLabs\n");
+	fprintf(stderr, "  n: Name\n");
+	fprintf(stderr, "  o: number of Objects\n");
+	fprintf(stderr, "  p: objects Per slab\n");
+	fprintf(stderr, "  s: object Size\n");
+	fprintf(stderr, "  u: cache Utilization\n\n");
+	fprintf(stderr, "With -d, caches whose size grew at every one of at least "
+		STRINGIFY(MIN_LEAK_SAMPLES) "\nsamples are marked LEAK?.\n");
+}
+
+static unsigned int parse_uint(const char *arg)
+{
+	char *end;
+	unsigned long value;
+
+	errno = 0;
+	value = strtoul(arg, &end, 0);
+	if (errno || *end || value > UINT_MAX) {
+		fprintf(stderr, "invalid number: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
 int main(int argc, char *argv[])
 {
 	struct slab_info *list, *p;
 	struct slab_stat stats = { .nr_objs = 0 };
 	unsigned int page_size = getpagesize() / 1024, nr_rows = DEF_NR_ROWS, i;
+	unsigned int interval = 0;
+	int opt;
 
 	sort_func = DEF_SORT_FUNC;
+	window = DEF_WINDOW;
 
-	if (argc > 1) {
-		/* FIXME: Ugh. */
-		if (argc == 3 && !strcmp(argv[1], "-n")) {
-			errno = 0;
-			nr_rows = (unsigned int) strtoul(argv[2], NULL, 0);
-			if (errno) {
-				perror("strtoul");
+	while ((opt = getopt(argc, argv, "n:s:d:w:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_rows = parse_uint(optarg);
+			break;
+		case 's':
+			sort_func = set_sort_func(optarg[0]) ? : DEF_SORT_FUNC;
+			break;
+		case 'd':
+			interval = parse_uint(optarg);
+			if (!interval)
+				interval = 1;
+			break;
+		case 'w':
+			window = parse_uint(optarg);
+			if (window < 2) {
+				fprintf(stderr, "the window needs at least 2 samples\n");
 				exit(EXIT_FAILURE);
 			}
-		}
-		else if (argc == 3 && !strcmp(argv[1], "-s"))
-			sort_func = set_sort_func(argv[2][0]) ? : DEF_SORT_FUNC;
-		else {
-			fprintf(stderr, "usage: %s [options]\n\n", argv[0]);
-			fprintf(stderr, "options:\n");
-			fprintf(stderr, "  -s S   specify sort criteria S\n");
-			fprintf(stderr, "  -h     display this help\n\n");
-			fprintf(stderr, "Valid sort criteria:\n");
-			fprintf(stderr, "  a: number of Active objects\n");
-			fprintf(stderr, "  c: Cache size\n");
-			fprintf(stderr, "  l: number of sLabs\n");
-			fprintf(stderr, "  n: Name\n");
-			fprintf(stderr, "  o: number of Objects\n");
-			fprintf(stderr, "  p: objects Per slab\n");
-			fprintf(stderr, "  s: object Size\n");
-			fprintf(stderr, "  u: cache Utilization\n");
+			break;
+		default:
+			usage(argv[0]);
 			exit(EXIT_FAILURE);
 		}
 	}
 
+	if (interval) {
+		watch_slabinfo(interval, nr_rows);
+		exit(EXIT_FAILURE);
+	}
+
 	list = get_slabinfo (&stats);
 	if (!list)
 		exit(EXIT_FAILURE);